@@ -0,0 +1,571 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "mylib.h"
+
+// microbenchmarks for every opcode handler and for processOp, plus
+// whole-ROM throughput for each engine on a few synthetic ROMs and the cost
+// of turning a full screen into window-sized pixels
+//
+// results go out as JSON, one result per line, so two runs can be compared
+// with `bench -C before.json after.json`
+
+// how many times each measurement is repeated, we keep the median
+#define REPEATS 5
+#define BATCH 1024
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *left, const void *right)
+{
+    double a = *(const double *)left, b = *(const double *)right;
+    return (a > b) - (a < b);
+}
+
+static double median(double samples[REPEATS])
+{
+    qsort(samples, REPEATS, sizeof(double), compareDoubles);
+    return samples[REPEATS / 2];
+}
+
+// a fresh VM with something in every register and memory to work on
+static void resetVM(State *state, uint8_t memory[])
+{
+    memset(state, 0x0, sizeof(State));
+    state->pc = ROM_OFFSET;
+    state->i = 0x300;
+    for (int reg = 0; reg < 16; reg++)
+    {
+        state->registers[reg] = reg * 17 + 3;
+    }
+    state->keys = 1 << 0x3;
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    copySpritesToMemory(memory);
+    for (int idx = 0x300; idx < 0x400; idx++)
+    {
+        memory[idx] = idx * 31;
+    }
+}
+
+// one call of a handler, with whatever it needs put back so it can run forever
+typedef void (*HandlerBench)(State *state, uint8_t memory[]);
+
+static void benchClearDisplay(State *s, uint8_t m[]) { clearDisplay(s, m); }
+static void benchJumpToAddress(State *s, uint8_t m[]) { jumpToAddress(s, 0x2, 0x00); }
+static void benchCallSubroutine(State *s, uint8_t m[]) { s->sp = 0; callSubroutine(s, 0x2, 0x00); }
+static void benchReturnFromSubroutine(State *s, uint8_t m[]) { s->sp = 1; returnFromSubroutine(s); }
+static void benchSetRegister(State *s, uint8_t m[]) { setRegister(s, 0x1, 0x42); }
+static void benchAddToRegister(State *s, uint8_t m[]) { addToRegister(s, 0x1, 0x42); }
+static void benchJumpIfRegEqualToConst(State *s, uint8_t m[]) { jumpIfRegEqualToConst(s, 0x1, 0x42); }
+static void benchJumpIfRegNotEqualToConst(State *s, uint8_t m[]) { jumpIfRegNotEqualToConst(s, 0x1, 0x42); }
+static void benchJumpIfRegEqualToReg(State *s, uint8_t m[]) { jumpIfRegEqualToReg(s, 0x1, 0x2); }
+static void benchJumpIfRegNotEqualToReg(State *s, uint8_t m[]) { jumpIfRegNotEqualToReg(s, 0x1, 0x2); }
+static void benchSetRegisterToRegister(State *s, uint8_t m[]) { setRegisterToRegister(s, 0x1, 0x2); }
+static void benchSetRegisterToBitwiseOr(State *s, uint8_t m[]) { setRegisterToBitwiseOr(s, 0x1, 0x2); }
+static void benchSetRegisterToBitwiseAnd(State *s, uint8_t m[]) { setRegisterToBitwiseAnd(s, 0x1, 0x2); }
+static void benchSetRegisterToBitwiseXor(State *s, uint8_t m[]) { setRegisterToBitwiseXor(s, 0x1, 0x2); }
+static void benchAddRegisters(State *s, uint8_t m[]) { addRegisters(s, 0x1, 0x2); }
+static void benchSubtractRegisters(State *s, uint8_t m[]) { subtractRegisters(s, 0x1, 0x2); }
+static void benchRightShift(State *s, uint8_t m[]) { rightShift(s, 0x1); }
+static void benchSubtractRightFromLeft(State *s, uint8_t m[]) { subtractRightFromLeft(s, 0x1, 0x2); }
+static void benchLeftShift(State *s, uint8_t m[]) { leftShift(s, 0x1); }
+static void benchSetI(State *s, uint8_t m[]) { setI(s, 0x3, 0x00); }
+static void benchSetPC(State *s, uint8_t m[]) { setPC(s, 0x2, 0x00); }
+static void benchGetRandomNumber(State *s, uint8_t m[]) { getRandomNumber(s, 0x1, 0xff); }
+static void benchSetPixels2(State *s, uint8_t m[]) { setPixels2(s, 0x1, 0x2, 0xf, m); }
+static void benchJumpIfKeyPressed(State *s, uint8_t m[]) { s->registers[0x1] = 0x3; jumpIfKeyPressed(s, 0x1); }
+static void benchJumpIfKeyNotPressed(State *s, uint8_t m[]) { s->registers[0x1] = 0x3; jumpIfKeyNotPressed(s, 0x1); }
+static void benchSetRegisterToDelayTimer(State *s, uint8_t m[]) { setRegisterToDelayTimer(s, 0x1); }
+static void benchWaitForKey(State *s, uint8_t m[]) { waitForKey(s, 0x1); }
+static void benchSetDelayTimerFromRegister(State *s, uint8_t m[]) { setDelayTimerFromRegister(s, 0x1); }
+static void benchSetSoundTimerFromRegister(State *s, uint8_t m[]) { setSoundTimerFromRegister(s, 0x1); }
+static void benchAddRegToI(State *s, uint8_t m[]) { s->i = 0x300; addRegToI(s, 0x1); }
+static void benchSetIToSprite(State *s, uint8_t m[]) { setIToSprite(s, 0x1); }
+static void benchSetIToBCD(State *s, uint8_t m[]) { s->i = 0x300; setIToBCD(s, 0x1, m); }
+static void benchSaveRegisters(State *s, uint8_t m[]) { s->i = 0x300; saveRegisters(s, 0xf, m); }
+static void benchLoadRegisters(State *s, uint8_t m[]) { s->i = 0x300; loadRegisters(s, 0xf, m); }
+static void benchScrollDown(State *s, uint8_t m[]) { scrollDown(s, 0x4); }
+static void benchScrollUp(State *s, uint8_t m[]) { scrollUp(s, 0x4); }
+static void benchScrollRight(State *s, uint8_t m[]) { scrollRight(s); }
+static void benchScrollLeft(State *s, uint8_t m[]) { scrollLeft(s); }
+static void benchSetIToBigSprite(State *s, uint8_t m[]) { setIToBigSprite(s, 0x1); }
+static void benchSaveFlags(State *s, uint8_t m[]) { saveFlags(s, 0x7); }
+static void benchLoadFlags(State *s, uint8_t m[]) { loadFlags(s, 0x7); }
+static void benchSelectPlanes(State *s, uint8_t m[]) { selectPlanes(s, 0x1); }
+
+typedef struct
+{
+    const char *name;
+    // what processOp is given for the same instruction
+    uint16_t opCode;
+    HandlerBench run;
+} OpBench;
+
+static const OpBench opBenches[] = {
+    {"clearDisplay", 0x00e0, benchClearDisplay},
+    {"returnFromSubroutine", 0x00ee, benchReturnFromSubroutine},
+    {"jumpToAddress", 0x1200, benchJumpToAddress},
+    {"callSubroutine", 0x2200, benchCallSubroutine},
+    {"jumpIfRegEqualToConst", 0x3142, benchJumpIfRegEqualToConst},
+    {"jumpIfRegNotEqualToConst", 0x4142, benchJumpIfRegNotEqualToConst},
+    {"jumpIfRegEqualToReg", 0x5120, benchJumpIfRegEqualToReg},
+    {"setRegister", 0x6142, benchSetRegister},
+    {"addToRegister", 0x7142, benchAddToRegister},
+    {"setRegisterToRegister", 0x8120, benchSetRegisterToRegister},
+    {"setRegisterToBitwiseOr", 0x8121, benchSetRegisterToBitwiseOr},
+    {"setRegisterToBitwiseAnd", 0x8122, benchSetRegisterToBitwiseAnd},
+    {"setRegisterToBitwiseXor", 0x8123, benchSetRegisterToBitwiseXor},
+    {"addRegisters", 0x8124, benchAddRegisters},
+    {"subtractRegisters", 0x8125, benchSubtractRegisters},
+    {"rightShift", 0x8126, benchRightShift},
+    {"subtractRightFromLeft", 0x8127, benchSubtractRightFromLeft},
+    {"leftShift", 0x812e, benchLeftShift},
+    {"jumpIfRegNotEqualToReg", 0x9120, benchJumpIfRegNotEqualToReg},
+    {"setI", 0xa300, benchSetI},
+    {"setPC", 0xb200, benchSetPC},
+    {"getRandomNumber", 0xc1ff, benchGetRandomNumber},
+    {"setPixels2", 0xd12f, benchSetPixels2},
+    {"jumpIfKeyPressed", 0xe19e, benchJumpIfKeyPressed},
+    {"jumpIfKeyNotPressed", 0xe1a1, benchJumpIfKeyNotPressed},
+    {"setRegisterToDelayTimer", 0xf107, benchSetRegisterToDelayTimer},
+    {"waitForKey", 0xf10a, benchWaitForKey},
+    {"setDelayTimerFromRegister", 0xf115, benchSetDelayTimerFromRegister},
+    {"setSoundTimerFromRegister", 0xf118, benchSetSoundTimerFromRegister},
+    {"addRegToI", 0xf11e, benchAddRegToI},
+    {"setIToSprite", 0xf129, benchSetIToSprite},
+    {"setIToBCD", 0xf133, benchSetIToBCD},
+    {"saveRegisters", 0xff55, benchSaveRegisters},
+    {"loadRegisters", 0xff65, benchLoadRegisters},
+    {"scrollDown", 0x00c4, benchScrollDown},
+    {"scrollUp", 0x00d4, benchScrollUp},
+    {"scrollRight", 0x00fb, benchScrollRight},
+    {"scrollLeft", 0x00fc, benchScrollLeft},
+    {"setIToBigSprite", 0xf130, benchSetIToBigSprite},
+    {"saveFlags", 0xf775, benchSaveFlags},
+    {"loadFlags", 0xf785, benchLoadFlags},
+    {"selectPlanes", 0xf101, benchSelectPlanes},
+};
+
+// nanoseconds per call of the handler on its own
+static double benchHandler(const OpBench *bench, double minTime)
+{
+    State state;
+    uint8_t memory[MEM_SIZE];
+    double samples[REPEATS];
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        resetVM(&state, memory);
+        long calls = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int idx = 0; idx < BATCH; idx++)
+            {
+                bench->run(&state, memory);
+            }
+            calls += BATCH;
+            elapsed = now() - start;
+        } while (elapsed < minTime);
+        samples[rep] = elapsed / calls * 1e9;
+    }
+    return median(samples);
+}
+
+// nanoseconds per processOp of the same instruction: fetch, decode, dispatch and the handler
+static double benchProcessOp(const OpBench *bench, double minTime)
+{
+    State state;
+    uint8_t memory[MEM_SIZE];
+    double samples[REPEATS];
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        resetVM(&state, memory);
+        memory[ROM_OFFSET] = bench->opCode >> 8;
+        memory[ROM_OFFSET + 1] = bench->opCode & 0xff;
+        long calls = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int idx = 0; idx < BATCH; idx++)
+            {
+                // the same fix ups as the handler benchmarks, so only the dispatch differs
+                state.pc = ROM_OFFSET;
+                state.sp = bench->opCode == 0x00ee ? 1 : 0;
+                state.i = 0x300;
+                state.registers[0x1] = (bench->opCode & 0xf0ff) == 0xe09e || (bench->opCode & 0xf0ff) == 0xe0a1 ? 0x3 : state.registers[0x1];
+                processOp(&state, memory);
+            }
+            calls += BATCH;
+            elapsed = now() - start;
+        } while (elapsed < minTime);
+        samples[rep] = elapsed / calls * 1e9;
+    }
+    return median(samples);
+}
+
+// synthetic ROMs, each loops forever on one kind of work
+typedef struct
+{
+    const char *name;
+    const uint8_t *bytes;
+    size_t length;
+} BenchROM;
+
+// register arithmetic and skips
+static const uint8_t romAlu[] = {
+    0x60, 0x05, // v0 = 5
+    0x61, 0x03, // v1 = 3
+    0x80, 0x14, // v0 += v1
+    0x81, 0x05, // v1 -= v0
+    0x82, 0x06, // v2 >>= 1
+    0x83, 0x0e, // v3 <<= 1
+    0x30, 0x10, // skip if v0 == 0x10
+    0x74, 0x01, // v4 += 1
+    0x84, 0x13, // v4 ^= v1
+    0x12, 0x04, // jump to 0x204
+};
+
+// sprites, with a clear every time round
+static const uint8_t romDraw[] = {
+    0x00, 0xe0, // clear
+    0x60, 0x00, // v0 = 0
+    0x61, 0x00, // v1 = 0
+    0xa0, 0x00, // I = sprite 0
+    0xd0, 0x15, // draw 5 rows at (v0, v1)
+    0x70, 0x05, // v0 += 5
+    0x71, 0x03, // v1 += 3
+    0x40, 0x3c, // skip unless v0 == 60
+    0x12, 0x00, // jump to the start
+    0x12, 0x08, // jump to the draw
+};
+
+// memory: BCD, saves, loads and I arithmetic
+static const uint8_t romMemory[] = {
+    0xa3, 0x00, // I = 0x300
+    0x70, 0x07, // v0 += 7
+    0xf0, 0x33, // BCD of v0 at I
+    0xf5, 0x55, // save v0..v5 at I
+    0xf3, 0x65, // load v0..v3 from I
+    0xf0, 0x1e, // I += v0
+    0xf1, 0x29, // I = sprite for v1
+    0x12, 0x00, // jump to the start
+};
+
+// subroutine calls and returns
+static const uint8_t romCalls[] = {
+    0x22, 0x06, // call 0x206
+    0x22, 0x0a, // call 0x20a
+    0x12, 0x00, // jump to the start
+    0x70, 0x01, // v0 += 1
+    0x00, 0xee, // return
+    0x22, 0x06, // call 0x206
+    0x00, 0xee, // return
+};
+
+static const BenchROM benchROMs[] = {
+    {"alu", romAlu, sizeof(romAlu)},
+    {"draw", romDraw, sizeof(romDraw)},
+    {"memory", romMemory, sizeof(romMemory)},
+    {"calls", romCalls, sizeof(romCalls)},
+};
+
+// instructions per second running the ROM in 60Hz frames of cyclesPerFrame
+static double benchROM(const uint8_t *rom, size_t length, EngineKind kind, uint32_t cyclesPerFrame, double minTime)
+{
+    State state;
+    uint8_t memory[MEM_SIZE];
+    double samples[REPEATS];
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        memset(&state, 0x0, sizeof(State));
+        state.pc = ROM_OFFSET;
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(memory);
+        memcpy(memory + ROM_OFFSET, rom, length);
+        Engine engine;
+        initEngine(&engine, kind);
+        uint64_t executed = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int frame = 0; frame < 64 && !state.halted; frame++)
+            {
+                executed += runEngine(&engine, &state, memory, cyclesPerFrame);
+                tickTimers(&state);
+            }
+            elapsed = now() - start;
+        } while (elapsed < minTime && !state.halted);
+        freeEngine(&engine);
+        samples[rep] = executed / elapsed;
+    }
+    return median(samples);
+}
+
+// the same for LOCKSTEP_LANES copies of the ROM, counting every lane's instructions
+static double benchLockstep(const uint8_t *rom, size_t length, uint32_t cyclesPerFrame, double minTime)
+{
+    static State states[LOCKSTEP_LANES];
+    static uint8_t memories[LOCKSTEP_LANES][MEM_SIZE];
+    State *statePtrs[LOCKSTEP_LANES];
+    uint8_t *memoryPtrs[LOCKSTEP_LANES];
+    double samples[REPEATS];
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            memset(&states[lane], 0x0, sizeof(State));
+            states[lane].pc = ROM_OFFSET;
+            memset(memories[lane], 0x0, MEM_SIZE * sizeof(uint8_t));
+            copySpritesToMemory(memories[lane]);
+            memcpy(memories[lane] + ROM_OFFSET, rom, length);
+            statePtrs[lane] = &states[lane];
+            memoryPtrs[lane] = memories[lane];
+        }
+        LockstepGroup group;
+        initLockstep(&group, statePtrs, memoryPtrs, LOCKSTEP_LANES);
+        uint64_t executed = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int frame = 0; frame < 64; frame++)
+            {
+                executed += runLockstep(&group, cyclesPerFrame);
+                tickLockstepTimers(&group);
+            }
+            elapsed = now() - start;
+        } while (elapsed < minTime);
+        samples[rep] = executed / elapsed;
+    }
+    return median(samples);
+}
+
+// ns to expand and scale up the whole screen, as the frontend does after a full redraw
+static double benchUpscale(bool hires, int scale, double minTime)
+{
+    static const uint32_t palette[4] = {0x000000ff, 0xffffffff, 0x5599ddff, 0xaaaaaaff};
+    static State state;
+    memset(&state, 0x0, sizeof(State));
+    state.hires = hires;
+    for (int y = 0; y < displayHeight(&state); y++)
+    {
+        for (int word = 0; word < displayWidth(&state) / 64; word++)
+        {
+            state.pixels[0][y][word] = 0x9e3779b97f4a7c15ull * (y + word + 1);
+        }
+    }
+    uint32_t *pixels = malloc((size_t)displayWidth(&state) * displayHeight(&state) * scale * scale * sizeof(uint32_t));
+    double samples[REPEATS];
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        uint64_t frames = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int frame = 0; frame < 16; frame++)
+            {
+                state.pixels[0][frame][0] ^= frames;
+                upscaleRows(&state, 0, displayHeight(&state), scale, palette, pixels);
+            }
+            frames += 16;
+            elapsed = now() - start;
+        } while (elapsed < minTime);
+        samples[rep] = elapsed * 1e9 / frames;
+    }
+    free(pixels);
+    return median(samples);
+}
+
+static bool firstResult = true;
+
+static void printResult(FILE *out, const char *name, const char *unit, double value)
+{
+    fprintf(out, "%s    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g}", firstResult ? "" : ",\n", name, unit, value);
+    firstResult = false;
+}
+
+// the results from a file written by printResult, in the order they appear
+typedef struct
+{
+    char name[128];
+    char unit[32];
+    double value;
+} Result;
+
+static int readResults(const char *fileName, Result **results)
+{
+    FILE *fp = fopen(fileName, "r");
+    if (fp == NULL)
+        return -1;
+    int count = 0, capacity = 64;
+    *results = malloc(capacity * sizeof(Result));
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        Result result;
+        if (sscanf(line, " {\"name\": \"%127[^\"]\", \"unit\": \"%31[^\"]\", \"value\": %lf}", result.name, result.unit, &result.value) != 3)
+            continue;
+        if (count == capacity)
+        {
+            capacity *= 2;
+            *results = realloc(*results, capacity * sizeof(Result));
+        }
+        (*results)[count++] = result;
+    }
+    fclose(fp);
+    return count;
+}
+
+static int compareRuns(const char *before, const char *after)
+{
+    Result *old, *new;
+    int numOld = readResults(before, &old);
+    int numNew = readResults(after, &new);
+    if (numOld < 0 || numNew < 0)
+    {
+        fprintf(stderr, "Could not read %s\n", numOld < 0 ? before : after);
+        return 1;
+    }
+    // speedup is > 1 when after is faster, whichever way round the unit is
+    printf("%-44s %14s %14s %8s\n", "benchmark", "before", "after", "speedup");
+    for (int idx = 0; idx < numNew; idx++)
+    {
+        for (int match = 0; match < numOld; match++)
+        {
+            if (strcmp(new[idx].name, old[match].name) != 0)
+                continue;
+            bool lowerIsBetter = strncmp(new[idx].unit, "ns", 2) == 0;
+            double speedup = lowerIsBetter ? old[match].value / new[idx].value : new[idx].value / old[match].value;
+            printf("%-44s %14.4g %14.4g %7.2fx\n", new[idx].name, old[match].value, new[idx].value, speedup);
+            break;
+        }
+    }
+    free(old);
+    free(new);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double minTime = 0.05;
+    int clockSpeed = 500;
+    char *outFilename = NULL;
+    char *extraROMs[16];
+    int numExtraROMs = 0;
+    int c;
+    while ((c = getopt(argc, argv, "t:c:o:r:C")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            minTime = atof(optarg);
+            break;
+        case 'c':
+            clockSpeed = atoi(optarg);
+            break;
+        case 'o':
+            outFilename = optarg;
+            break;
+        case 'r':
+            if (numExtraROMs < 16)
+                extraROMs[numExtraROMs++] = optarg;
+            break;
+        case 'C':
+            if (argc - optind != 2)
+            {
+                fprintf(stderr, "Usage: %s -C before.json after.json\n", argv[0]);
+                return 1;
+            }
+            return compareRuns(argv[optind], argv[optind + 1]);
+        default:
+            fprintf(stderr, "Usage: %s [-t seconds per measurement] [-c clock speed] [-r rom]... [-o results.json]\n"
+                            "       %s -C before.json after.json\n",
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (minTime <= 0 || clockSpeed < 60)
+    {
+        fprintf(stderr, "The time per measurement (-t) must be positive and the clock speed (-c) at least 60\n");
+        return 1;
+    }
+    FILE *out = stdout;
+    if (outFilename != NULL && (out = fopen(outFilename, "w")) == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", outFilename);
+        return 1;
+    }
+    uint32_t cyclesPerFrame = clockSpeed / 60;
+
+    fprintf(out, "{\n  \"schema\": 1,\n");
+#ifdef __VERSION__
+    fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+    fprintf(out, "  \"clock_speed\": %d,\n  \"results\": [\n", clockSpeed);
+    char name[128];
+    for (size_t idx = 0; idx < sizeof(opBenches) / sizeof(opBenches[0]); idx++)
+    {
+        const OpBench *bench = &opBenches[idx];
+        snprintf(name, sizeof(name), "handler/%s", bench->name);
+        printResult(out, name, "ns/op", benchHandler(bench, minTime));
+        snprintf(name, sizeof(name), "processOp/%04x", bench->opCode);
+        printResult(out, name, "ns/op", benchProcessOp(bench, minTime));
+    }
+    for (size_t idx = 0; idx < sizeof(benchROMs) / sizeof(benchROMs[0]) + numExtraROMs; idx++)
+    {
+        BenchROM rom;
+        uint8_t romMemory[MEM_SIZE];
+        if (idx < sizeof(benchROMs) / sizeof(benchROMs[0]))
+        {
+            rom = benchROMs[idx];
+        }
+        else
+        {
+            // anything passed with -r is benchmarked the same way
+            rom.name = extraROMs[idx - sizeof(benchROMs) / sizeof(benchROMs[0])];
+            memset(romMemory, 0x0, MEM_SIZE * sizeof(uint8_t));
+            int length = loadROM(rom.name, romMemory);
+            if (length < 0)
+            {
+                fprintf(stderr, "Could not open %s\n", rom.name);
+                continue;
+            }
+            rom.bytes = romMemory + ROM_OFFSET;
+            rom.length = length;
+        }
+        for (EngineKind kind = ENGINE_SWITCH; kind <= ENGINE_JIT; kind++)
+        {
+            double ips = benchROM(rom.bytes, rom.length, kind, cyclesPerFrame, minTime);
+            snprintf(name, sizeof(name), "rom/%s/%s/ips", rom.name, engineKindName(kind));
+            printResult(out, name, "instructions/s", ips);
+            snprintf(name, sizeof(name), "rom/%s/%s/fps", rom.name, engineKindName(kind));
+            printResult(out, name, "frames/s", ips / cyclesPerFrame);
+        }
+        double ips = benchLockstep(rom.bytes, rom.length, cyclesPerFrame, minTime);
+        snprintf(name, sizeof(name), "rom/%s/lockstep/ips", rom.name);
+        printResult(out, name, "instructions/s", ips);
+        snprintf(name, sizeof(name), "rom/%s/lockstep/fps", rom.name);
+        printResult(out, name, "frames/s", ips / cyclesPerFrame);
+    }
+    // the same window sizes in both modes, a hi-res pixel is half a lo-res one
+    const int scales[] = {2, 4, 10, 20};
+    for (size_t idx = 0; idx < sizeof(scales) / sizeof(scales[0]); idx++)
+    {
+        snprintf(name, sizeof(name), "upscale/lores/x%d", scales[idx]);
+        printResult(out, name, "ns/frame", benchUpscale(false, scales[idx], minTime));
+        snprintf(name, sizeof(name), "upscale/hires/x%d", scales[idx] / 2);
+        printResult(out, name, "ns/frame", benchUpscale(true, scales[idx] / 2, minTime));
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,549 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "mylib.h"
+
+// compiles a ROM to C ahead of time, to be linked against the core and run by
+// runAot, see aot_runtime.c
+//
+// Everything reachable from ROM_OFFSET by following jumps, calls and skips is
+// split into blocks at every branch target. Each block is a label in one
+// function, with V0-VF in a local array, the simple instructions written out
+// in C and the rest calls to the same handlers processOp uses. Branches to a
+// known block are gotos, 00EE and BNNN go back through a switch on the pc,
+// and anything we didn't find is left to the interpreter
+
+// longer runs are split, a block only runs if it fits in what's left of the budget
+#define AOT_MAX_BLOCK_OPS 16
+
+typedef enum {
+    // not an instruction processOp knows, left to the interpreter to halt on
+    AOT_UNKNOWN,
+    // carries on at pc + 2
+    AOT_NEXT,
+    // ends the block, with up to two successors we know of
+    AOT_BRANCH,
+} AotKind;
+
+typedef struct {
+    uint8_t memory[MEM_SIZE];
+    // one past the last byte of the ROM
+    int romEnd;
+    // queued for analyseOp, so nothing is looked at twice
+    bool seen[MEM_SIZE];
+    // an instruction we compile starts here
+    bool code[MEM_SIZE];
+    // a block starts here
+    bool leader[MEM_SIZE];
+} Program;
+
+static bool inRom(const Program *program, int pc)
+{
+    return pc >= ROM_OFFSET && pc + 2 <= program->romEnd;
+}
+
+static bool isBlock(const Program *program, int pc)
+{
+    return inRom(program, pc) && program->code[pc] && program->leader[pc];
+}
+
+// mirrors the switch in processOp
+static AotKind analyseOp(uint16_t pc, uint8_t opCodeLeft, uint8_t opCodeRight, uint16_t targets[2], int *numTargets)
+{
+    uint16_t nnn = ((opCodeLeft & 0x0f) << 8) | opCodeRight;
+    *numTargets = 0;
+    switch (opCodeLeft >> 4)
+    {
+    case (0x0):
+        if (opCodeLeft != 0x00)
+            return AOT_UNKNOWN;
+        if ((opCodeRight >> 4) == 0xc || (opCodeRight >> 4) == 0xd)
+            return AOT_NEXT;
+        switch (opCodeRight)
+        {
+        case (0xe0):
+        case (0xfb):
+        case (0xfc):
+        case (0xfe):
+        case (0xff):
+            return AOT_NEXT;
+        case (0xee):
+            return AOT_BRANCH;
+        case (0xfd):
+            // the pc stays put
+            targets[(*numTargets)++] = pc;
+            return AOT_BRANCH;
+        default:
+            return AOT_UNKNOWN;
+        }
+    case (0x1):
+        targets[(*numTargets)++] = nnn;
+        return AOT_BRANCH;
+    case (0x2):
+        targets[(*numTargets)++] = nnn;
+        targets[(*numTargets)++] = pc + 2;
+        return AOT_BRANCH;
+    case (0x3):
+    case (0x4):
+    case (0x5):
+    case (0x9):
+        targets[(*numTargets)++] = pc + 2;
+        targets[(*numTargets)++] = pc + 4;
+        return AOT_BRANCH;
+    case (0x8):
+        switch (opCodeRight & 0x0f)
+        {
+        case (0x8):
+        case (0x9):
+        case (0xa):
+        case (0xb):
+        case (0xc):
+        case (0xd):
+        case (0xf):
+            return AOT_UNKNOWN;
+        default:
+            return AOT_NEXT;
+        }
+    case (0xb):
+        // wherever V0 says, through the switch
+        return AOT_BRANCH;
+    case (0xe):
+        if (opCodeRight != 0x9e && opCodeRight != 0xa1)
+            return AOT_UNKNOWN;
+        targets[(*numTargets)++] = pc + 2;
+        targets[(*numTargets)++] = pc + 4;
+        return AOT_BRANCH;
+    case (0xf):
+        switch (opCodeRight)
+        {
+        case (0x01):
+        case (0x07):
+        case (0x15):
+        case (0x18):
+        case (0x1e):
+        case (0x29):
+        case (0x30):
+        case (0x33):
+        case (0x55):
+        case (0x65):
+        case (0x75):
+        case (0x85):
+            return AOT_NEXT;
+        case (0x0a):
+            // waits by not moving the pc
+            targets[(*numTargets)++] = pc;
+            targets[(*numTargets)++] = pc + 2;
+            return AOT_BRANCH;
+        default:
+            return AOT_UNKNOWN;
+        }
+    default:
+        return AOT_NEXT;
+    }
+}
+
+static void queue(Program *program, uint16_t work[], int *count, int pc, bool leader)
+{
+    if (!inRom(program, pc))
+        return;
+    if (leader)
+        program->leader[pc] = true;
+    if (!program->seen[pc])
+    {
+        program->seen[pc] = true;
+        work[(*count)++] = pc;
+    }
+}
+
+static void findCode(Program *program)
+{
+    uint16_t work[MEM_SIZE];
+    int count = 0;
+    queue(program, work, &count, ROM_OFFSET, true);
+    while (count > 0)
+    {
+        uint16_t pc = work[--count];
+        uint16_t targets[2];
+        int numTargets;
+        AotKind kind = analyseOp(pc, program->memory[pc], program->memory[pc + 1], targets, &numTargets);
+        if (kind == AOT_UNKNOWN)
+            continue;
+        program->code[pc] = true;
+        if (kind == AOT_NEXT)
+            queue(program, work, &count, pc + 2, false);
+        for (int idx = 0; idx < numTargets; idx++)
+        {
+            queue(program, work, &count, targets[idx], true);
+        }
+    }
+    // a run of instructions only starts where one before it carries on, so
+    // going up through memory sees every run in order
+    int runLength[MEM_SIZE] = {0};
+    for (int pc = ROM_OFFSET; pc < program->romEnd; pc++)
+    {
+        if (!program->code[pc])
+            continue;
+        runLength[pc] = program->leader[pc] ? 1 : runLength[pc - 2] + 1;
+        if (runLength[pc] > AOT_MAX_BLOCK_OPS)
+        {
+            program->leader[pc] = true;
+            runLength[pc] = 1;
+        }
+    }
+}
+
+// the number of instructions in the block starting at pc
+static int blockOps(const Program *program, uint16_t start)
+{
+    int numOps = 0;
+    for (int pc = start; inRom(program, pc) && program->code[pc]; pc += 2)
+    {
+        numOps++;
+        uint16_t targets[2];
+        int numTargets;
+        if (analyseOp(pc, program->memory[pc], program->memory[pc + 1], targets, &numTargets) == AOT_BRANCH ||
+            program->leader[pc + 2])
+            break;
+    }
+    return numOps;
+}
+
+static void emitGoto(FILE *out, const Program *program, int pc)
+{
+    if (isBlock(program, pc))
+        fprintf(out, "goto block_%03x;\n", pc);
+    else
+        fprintf(out, "{ state->pc = 0x%03x; goto leave; }\n", pc);
+}
+
+// the conditional skips: if condition holds to pc + 4, otherwise to pc + 2
+static void emitSkip(FILE *out, const Program *program, uint16_t pc, const char *condition)
+{
+    fprintf(out, "        if (%s)\n            ", condition);
+    emitGoto(out, program, pc + 4);
+    fprintf(out, "        ");
+    emitGoto(out, program, pc + 2);
+}
+
+static void emitSyncOut(FILE *out)
+{
+    fprintf(out, "        memcpy(state->registers, v, sizeof(v));\n");
+}
+
+static void emitSyncIn(FILE *out)
+{
+    fprintf(out, "        memcpy(v, state->registers, sizeof(v));\n");
+}
+
+// after Fx33/Fx55, which may have overwritten compiled code and even this block
+static void emitInvalidate(FILE *out, uint16_t pc, int length, int opsLeft)
+{
+    fprintf(out, "        if (invalidateAot(aot, state->i, %d))\n        {\n", length);
+    fprintf(out, "            state->pc = 0x%03x;\n", pc + 2);
+    if (opsLeft > 0)
+        fprintf(out, "            executed -= %d;\n", opsLeft);
+    fprintf(out, "            goto leave;\n        }\n");
+}
+
+// opsLeft is how many of the block's instructions come after this one
+static void emitOp(FILE *out, const Program *program, uint16_t pc, int opsLeft)
+{
+    uint8_t opCodeLeft = program->memory[pc], opCodeRight = program->memory[pc + 1];
+    int x = opCodeLeft & 0x0f, y = opCodeRight >> 4, n = opCodeRight & 0x0f;
+    uint16_t nnn = (x << 8) | opCodeRight;
+    char condition[64];
+    fprintf(out, "        // %03x: %02x%02x\n", pc, opCodeLeft, opCodeRight);
+    switch (opCodeLeft >> 4)
+    {
+    case (0x0):
+        if ((opCodeRight >> 4) == 0xc)
+            fprintf(out, "        scrollDown(state, 0x%x);\n", n);
+        else if ((opCodeRight >> 4) == 0xd)
+            fprintf(out, "        scrollUp(state, 0x%x);\n", n);
+        else if (opCodeRight == 0xe0)
+            fprintf(out, "        clearDisplay(state, memory);\n");
+        else if (opCodeRight == 0xfb)
+            fprintf(out, "        scrollRight(state);\n");
+        else if (opCodeRight == 0xfc)
+            fprintf(out, "        scrollLeft(state);\n");
+        else if (opCodeRight == 0xfe || opCodeRight == 0xff)
+            fprintf(out, "        setDisplayMode(state, %s);\n", opCodeRight == 0xff ? "true" : "false");
+        else if (opCodeRight == 0xee)
+            fprintf(out, "        state->sp -= 1;\n        state->pc = state->stack[state->sp];\n        continue;\n");
+        else if (opCodeRight == 0xfd)
+        {
+            fprintf(out, "        state->pc = 0x%03x;\n        exitInterpreter(state);\n        ", pc);
+            emitGoto(out, program, pc);
+        }
+        break;
+    case (0x1):
+        fprintf(out, "        ");
+        emitGoto(out, program, nnn);
+        break;
+    case (0x2):
+        fprintf(out, "        state->stack[state->sp] = 0x%03x;\n        state->sp += 1;\n        ", pc + 2);
+        emitGoto(out, program, nnn);
+        break;
+    case (0x3):
+    case (0x4):
+        snprintf(condition, sizeof(condition), "v[0x%x] %s 0x%02x", x, (opCodeLeft >> 4) == 0x3 ? "==" : "!=", opCodeRight);
+        emitSkip(out, program, pc, condition);
+        break;
+    case (0x5):
+    case (0x9):
+        snprintf(condition, sizeof(condition), "v[0x%x] %s v[0x%x]", x, (opCodeLeft >> 4) == 0x5 ? "==" : "!=", y);
+        emitSkip(out, program, pc, condition);
+        break;
+    case (0x6):
+        fprintf(out, "        v[0x%x] = 0x%02x;\n", x, opCodeRight);
+        break;
+    case (0x7):
+        fprintf(out, "        v[0x%x] += 0x%02x;\n", x, opCodeRight);
+        break;
+    case (0x8):
+        switch (n)
+        {
+        case (0x0):
+            fprintf(out, "        v[0x%x] = v[0x%x];\n", x, y);
+            break;
+        case (0x1):
+            fprintf(out, "        v[0x%x] |= v[0x%x];\n", x, y);
+            break;
+        case (0x2):
+            fprintf(out, "        v[0x%x] &= v[0x%x];\n", x, y);
+            break;
+        case (0x3):
+            fprintf(out, "        v[0x%x] ^= v[0x%x];\n", x, y);
+            break;
+        case (0x4):
+            fprintf(out, "        {\n            uint16_t val = v[0x%x] + v[0x%x];\n", x, y);
+            fprintf(out, "            v[0x%x] = val & 0xff;\n            v[0xf] = (val & 0x100) >> 8;\n        }\n", x);
+            break;
+        case (0x5):
+        case (0x7):
+        {
+            // the same (a - b) % 0xff as subtractRegisters
+            int a = n == 0x5 ? x : y, b = n == 0x5 ? y : x;
+            fprintf(out, "        {\n            bool needBorrow = v[0x%x] > v[0x%x];\n", b, a);
+            fprintf(out, "            v[0x%x] = (v[0x%x] - v[0x%x]) %% 0xff;\n", x, a, b);
+            fprintf(out, "            v[0xf] = needBorrow ? 0 : 1;\n        }\n");
+            break;
+        }
+        case (0x6):
+            fprintf(out, "        v[0xf] = v[0x%x] & 0x1;\n        v[0x%x] >>= 1;\n", x, x);
+            break;
+        case (0xe):
+            fprintf(out, "        {\n            uint16_t val = v[0x%x] << 1;\n", x);
+            fprintf(out, "            v[0x%x] = val & 0xff;\n            v[0xf] = (val & 0x100) >> 8;\n        }\n", x);
+            break;
+        }
+        break;
+    case (0xa):
+        fprintf(out, "        state->i = 0x%03x;\n", nnn);
+        break;
+    case (0xb):
+        fprintf(out, "        state->pc = v[0x0] + 0x%03x;\n        continue;\n", nnn);
+        break;
+    case (0xc):
+        emitSyncOut(out);
+        fprintf(out, "        getRandomNumber(state, 0x%x, 0x%02x);\n", x, opCodeRight);
+        emitSyncIn(out);
+        break;
+    case (0xd):
+        emitSyncOut(out);
+        fprintf(out, "        setPixels2(state, 0x%x, 0x%x, 0x%x, memory);\n", x, y, n);
+        emitSyncIn(out);
+        break;
+    case (0xe):
+        snprintf(condition, sizeof(condition), "%s((state->keys >> (v[0x%x] & 0xf)) & 0x1)", opCodeRight == 0x9e ? "" : "!", x);
+        emitSkip(out, program, pc, condition);
+        break;
+    case (0xf):
+        switch (opCodeRight)
+        {
+        case (0x01):
+            fprintf(out, "        selectPlanes(state, 0x%x);\n", x);
+            break;
+        case (0x07):
+            fprintf(out, "        v[0x%x] = state->delay_timer;\n", x);
+            break;
+        case (0x0a):
+            emitSyncOut(out);
+            fprintf(out, "        state->pc = 0x%03x;\n        waitForKey(state, 0x%x);\n", pc, x);
+            emitSyncIn(out);
+            fprintf(out, "        continue;\n");
+            break;
+        case (0x15):
+            fprintf(out, "        state->delay_timer = v[0x%x];\n", x);
+            break;
+        case (0x18):
+            fprintf(out, "        state->sound_timer = v[0x%x];\n", x);
+            break;
+        case (0x1e):
+            fprintf(out, "        state->i += v[0x%x];\n", x);
+            break;
+        case (0x29):
+            // setIToSprite uses the register number rather than its value
+            fprintf(out, "        state->i = 0x%x;\n", x * 5);
+            break;
+        case (0x30):
+            fprintf(out, "        state->i = BIG_SPRITES_OFFSET + (v[0x%x] & 0xf) * 10;\n", x);
+            break;
+        case (0x33):
+            emitSyncOut(out);
+            fprintf(out, "        setIToBCD(state, 0x%x, memory);\n", x);
+            emitInvalidate(out, pc, 3, opsLeft);
+            break;
+        case (0x55):
+            emitSyncOut(out);
+            fprintf(out, "        saveRegisters(state, 0x%x, memory);\n", x);
+            emitInvalidate(out, pc, x + 1, opsLeft);
+            break;
+        case (0x65):
+            emitSyncOut(out);
+            fprintf(out, "        loadRegisters(state, 0x%x, memory);\n", x);
+            emitSyncIn(out);
+            break;
+        case (0x75):
+            emitSyncOut(out);
+            fprintf(out, "        saveFlags(state, 0x%x);\n", x);
+            break;
+        case (0x85):
+            emitSyncOut(out);
+            fprintf(out, "        loadFlags(state, 0x%x);\n", x);
+            emitSyncIn(out);
+            break;
+        }
+        break;
+    }
+}
+
+static void emitProgram(FILE *out, const Program *program, const char *romFilename, const char *name)
+{
+    fprintf(out, "// generated by chip8-aot from %s, do not edit\n", romFilename);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n#include \"mylib.h\"\n\n");
+
+    int romSize = program->romEnd - ROM_OFFSET;
+    fprintf(out, "static const uint8_t rom[%d] = {", romSize);
+    for (int idx = 0; idx < romSize; idx++)
+    {
+        fprintf(out, "%s0x%02x,", idx % 12 == 0 ? "\n    " : " ", program->memory[ROM_OFFSET + idx]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    int numBlocks = 0;
+    fprintf(out, "static const AotBlock blocks[] = {\n");
+    for (int pc = ROM_OFFSET; pc < program->romEnd; pc++)
+    {
+        if (!isBlock(program, pc))
+            continue;
+        fprintf(out, "    {0x%03x, %d},\n", pc, blockOps(program, pc) * 2);
+        numBlocks++;
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static uint32_t run(Aot *aot, State *state, uint8_t memory[], uint32_t numOps)\n{\n");
+    fprintf(out, "    // V0-VF live here, and go back to the State around handler calls\n");
+    fprintf(out, "    uint8_t v[16];\n    memcpy(v, state->registers, sizeof(v));\n    uint32_t executed = 0;\n");
+    // continue goes back to the switch when the next pc isn't known until runtime
+    fprintf(out, "    for (;;)\n    {\n        switch (state->pc)\n        {\n");
+    for (int pc = ROM_OFFSET; pc < program->romEnd; pc++)
+    {
+        if (isBlock(program, pc))
+            fprintf(out, "        case (0x%03x):\n            goto block_%03x;\n", pc, pc);
+    }
+    fprintf(out, "        default:\n            goto leave;\n        }\n");
+    for (int start = ROM_OFFSET; start < program->romEnd; start++)
+    {
+        if (!isBlock(program, start))
+            continue;
+        int numOps = blockOps(program, start);
+        fprintf(out, "    block_%03x:\n", start);
+        fprintf(out, "        if (aot->stale[0x%03x] || numOps - executed < %d)\n", start, numOps);
+        fprintf(out, "        {\n            state->pc = 0x%03x;\n            goto leave;\n        }\n", start);
+        fprintf(out, "        executed += %d;\n", numOps);
+        int pc = start;
+        for (int op = 0; op < numOps; op++, pc += 2)
+        {
+            emitOp(out, program, pc, numOps - op - 1);
+        }
+        uint16_t targets[2];
+        int numTargets;
+        pc -= 2;
+        if (analyseOp(pc, program->memory[pc], program->memory[pc + 1], targets, &numTargets) != AOT_BRANCH)
+        {
+            fprintf(out, "        ");
+            emitGoto(out, program, pc + 2);
+        }
+    }
+    fprintf(out, "    }\nleave:\n    memcpy(state->registers, v, sizeof(v));\n    return executed;\n}\n\n");
+
+    fprintf(out, "const AotProgram %s = {\n", name);
+    fprintf(out, "    .rom = rom,\n    .romSize = sizeof(rom),\n    .blocks = blocks,\n");
+    fprintf(out, "    .numBlocks = %d,\n    .run = run,\n};\n", numBlocks);
+}
+
+int main(int argc, char *argv[])
+{
+    char *romFilename = NULL;
+    char *outFilename = NULL;
+    char *name = "aotProgram";
+    int c;
+    while ((c = getopt(argc, argv, "r:o:n:")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            romFilename = optarg;
+            break;
+        case 'o':
+            outFilename = optarg;
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -r rom -o out.c [-n name]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (romFilename == NULL || outFilename == NULL)
+    {
+        fprintf(stderr, "A ROM (-r) and somewhere to write the C (-o) are required\n");
+        return 1;
+    }
+
+    static Program program;
+    copySpritesToMemory(program.memory);
+    int romSize = loadROM(romFilename, program.memory);
+    if (romSize <= 0)
+    {
+        fprintf(stderr, "Could not read %s\n", romFilename);
+        return 1;
+    }
+    program.romEnd = ROM_OFFSET + romSize;
+    findCode(&program);
+
+    FILE *out = fopen(outFilename, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", outFilename);
+        return 1;
+    }
+    emitProgram(out, &program, romFilename, name);
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "Could not write %s\n", outFilename);
+        return 1;
+    }
+    int numBlocks = 0, numOps = 0;
+    for (int pc = ROM_OFFSET; pc < program.romEnd; pc++)
+    {
+        numBlocks += isBlock(&program, pc);
+        numOps += program.code[pc];
+    }
+    printf("%s: %d instructions in %d blocks\n", outFilename, numOps, numBlocks);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mylib.h"
+
+// runs a ROM compiled by chip8-aot: the generated code runs whole blocks and
+// hands back to us whenever the pc isn't somewhere it knows, and we step
+// through processOp until it is again
+
+static bool writesMemory(uint8_t opCodeLeft, uint8_t opCodeRight, uint16_t *length)
+{
+    if ((opCodeLeft >> 4) != 0xf)
+        return false;
+    if (opCodeRight == 0x33)
+    {
+        *length = 3;
+        return true;
+    }
+    if (opCodeRight == 0x55)
+    {
+        *length = (opCodeLeft & 0x0f) + 1;
+        return true;
+    }
+    return false;
+}
+
+Aot *createAot(const AotProgram *program, const uint8_t memory[])
+{
+    Aot *aot = calloc(1, sizeof(Aot));
+    if (aot == NULL)
+        return NULL;
+    aot->program = program;
+    for (int idx = 0; idx < program->numBlocks; idx++)
+    {
+        const AotBlock *block = &program->blocks[idx];
+        memset(aot->compiled + block->start, true, block->length);
+        // a different ROM, or a save state whose code has changed since
+        aot->stale[block->start] =
+            memcmp(memory + block->start, program->rom + (block->start - ROM_OFFSET), block->length) != 0;
+    }
+    return aot;
+}
+
+void destroyAot(Aot *aot)
+{
+    free(aot);
+}
+
+bool invalidateAot(Aot *aot, uint16_t address, uint16_t length)
+{
+    // returns true if compiled code was overwritten, its blocks won't run again
+    bool hit = false;
+    for (int idx = address; idx < address + length && idx < MEM_SIZE; idx++)
+    {
+        hit |= aot->compiled[idx];
+    }
+    if (!hit)
+        return false;
+    // rare enough that going through every block is fine
+    for (int idx = 0; idx < aot->program->numBlocks; idx++)
+    {
+        const AotBlock *block = &aot->program->blocks[idx];
+        if (block->start < address + length && address < block->start + block->length)
+            aot->stale[block->start] = true;
+    }
+    return true;
+}
+
+uint32_t runAot(Aot *aot, State *state, uint8_t memory[], uint32_t numOps)
+{
+    uint32_t executed = 0;
+    while (executed < numOps)
+    {
+        executed += aot->program->run(aot, state, memory, numOps - executed);
+        if (executed == numOps)
+            break;
+        // code that wasn't found at compile time, was overwritten since or
+        // is near the end of the budget, one instruction at a time. That
+        // includes a pc BNNN took past the end of memory, which wraps like processOp's
+        uint16_t pc = state->pc & (MEM_SIZE - 1);
+        uint16_t length;
+        bool writes = writesMemory(memory[pc], memory[(pc + 1) & (MEM_SIZE - 1)], &length);
+        processOp(state, memory);
+        if (state->halted)
+            break;
+        if (writes)
+            invalidateAot(aot, state->i, length);
+        aot->interpreted++;
+        executed++;
+    }
+    return executed;
+}
@@ -0,0 +1,685 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "mylib.h"
+
+// runs a manifest of jobs across a pool of worker threads, without SDL
+//
+// each manifest line is `rom cycles [input script]`, blank lines and lines
+// starting with # are skipped. An input script has one `cycle keys` line per
+// change of input, where keys is a hex mask of the keys held from that cycle on
+// (bit n is key n). Results are printed in manifest order once every job is done
+//
+// with -l, jobs that run the same ROM for the same number of cycles are
+// grouped into lockstep groups of up to LOCKSTEP_LANES VMs, see lockstep.c
+
+typedef enum
+{
+    EXIT_RUNNING,
+    EXIT_BUDGET,
+    EXIT_HALTED,
+    EXIT_EXITED,
+    EXIT_LOAD_ERROR,
+} ExitReason;
+
+typedef struct
+{
+    uint64_t cycle;
+    uint16_t keys;
+} InputEvent;
+
+typedef struct
+{
+    char *romFilename;
+    char *scriptFilename;
+    uint64_t budget;
+    InputEvent *events;
+    size_t numEvents;
+    size_t nextEvent;
+    // only allocated while the job is in flight
+    Engine *engine;
+    uint8_t *memory;
+    State state;
+    uint64_t cycles;
+    uint64_t frames;
+    uint32_t frameCycles;
+    ExitReason reason;
+    uint64_t hash;
+} Job;
+
+// what the workers schedule: a single job, or a lockstep group of them
+typedef struct
+{
+    size_t jobs[LOCKSTEP_LANES];
+    int numJobs;
+    // only allocated while a lockstep task is in flight
+    LockstepGroup *group;
+    uint64_t cycles;
+    uint64_t frames;
+    uint32_t frameCycles;
+} Task;
+
+// a task queue per worker. The owner pushes and pops at the bottom so it keeps
+// stepping the VM whose engine is hot in its cache, thieves take from the top
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t capacity;
+    size_t top;
+    size_t bottom;
+} Deque;
+
+typedef struct Batch Batch;
+
+typedef struct
+{
+    Batch *batch;
+    Deque deque;
+    uint32_t seed;
+    pthread_t thread;
+} Worker;
+
+struct Batch
+{
+    Job *jobs;
+    size_t numJobs;
+    Task *tasks;
+    size_t numTasks;
+    bool lockstep;
+    Worker *workers;
+    int numWorkers;
+    EngineKind engineKind;
+    uint32_t clockSpeed;
+    uint64_t sliceCycles;
+    // every job starts its generator from the same seed, so identical jobs stay identical
+    uint64_t seed;
+    atomic_size_t remaining;
+};
+
+static void initDeque(Deque *deque, size_t capacity)
+{
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = malloc(capacity * sizeof(size_t));
+    deque->capacity = capacity;
+    deque->top = 0;
+    deque->bottom = 0;
+}
+
+static void freeDeque(Deque *deque)
+{
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->items);
+}
+
+static void pushBottom(Deque *deque, size_t task)
+{
+    // there are never more tasks queued than there are tasks, so this can't overflow
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->bottom % deque->capacity] = task;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool popBottom(Deque *deque, size_t *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top)
+    {
+        deque->bottom--;
+        *task = deque->items[deque->bottom % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool stealTop(Deque *deque, size_t *task)
+{
+    bool found = false;
+    // don't queue up behind the owner, just try someone else
+    if (pthread_mutex_trylock(&deque->lock) != 0)
+        return false;
+    if (deque->bottom != deque->top)
+    {
+        *task = deque->items[deque->top % deque->capacity];
+        deque->top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool stealTask(Worker *self, size_t *task)
+{
+    Batch *batch = self->batch;
+    // xorshift to pick where to start looking, so thieves spread out
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+    int start = self->seed % batch->numWorkers;
+    for (int k = 0; k < batch->numWorkers; k++)
+    {
+        Worker *victim = &batch->workers[(start + k) % batch->numWorkers];
+        if (victim != self && stealTop(&victim->deque, task))
+            return true;
+    }
+    return false;
+}
+
+static bool loadInputScript(Job *job)
+{
+    FILE *fp = fopen(job->scriptFilename, "r");
+    if (fp == NULL)
+        return false;
+    size_t capacity = 16;
+    job->events = malloc(capacity * sizeof(InputEvent));
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp) != NULL)
+    {
+        unsigned long long cycle;
+        unsigned int keys;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, "%llu %x", &cycle, &keys) != 2 || keys > 0xffff ||
+            (job->numEvents > 0 && cycle < job->events[job->numEvents - 1].cycle))
+        {
+            ok = false;
+            break;
+        }
+        if (job->numEvents == capacity)
+        {
+            capacity *= 2;
+            job->events = realloc(job->events, capacity * sizeof(InputEvent));
+        }
+        job->events[job->numEvents++] = (InputEvent){.cycle = cycle, .keys = keys};
+    }
+    fclose(fp);
+    return ok;
+}
+
+static bool startJob(Batch *batch, Job *job)
+{
+    job->memory = calloc(MEM_SIZE, sizeof(uint8_t));
+    copySpritesToMemory(job->memory);
+    if (loadROM(job->romFilename, job->memory) < 0)
+        return false;
+    if (job->scriptFilename != NULL && !loadInputScript(job))
+        return false;
+    job->state = (State){.pc = ROM_OFFSET, .dirtyRows = ALL_ROWS_DIRTY};
+    seedRandom(&job->state, batch->seed);
+    if (!batch->lockstep)
+    {
+        job->engine = malloc(sizeof(Engine));
+        initEngine(job->engine, batch->engineKind);
+    }
+    return true;
+}
+
+static void finishJob(Job *job, ExitReason reason)
+{
+    job->reason = reason;
+    if (reason != EXIT_LOAD_ERROR)
+    {
+        job->hash = hashState(&job->state, job->memory);
+    }
+    if (job->engine != NULL)
+    {
+        freeEngine(job->engine);
+        free(job->engine);
+        job->engine = NULL;
+    }
+    free(job->memory);
+    job->memory = NULL;
+    free(job->events);
+    job->events = NULL;
+}
+
+static void applyInput(Job *job)
+{
+    while (job->nextEvent < job->numEvents && job->events[job->nextEvent].cycle <= job->cycles)
+    {
+        job->state.keys = job->events[job->nextEvent].keys;
+        job->nextEvent++;
+    }
+}
+
+// 00FD is only noticed at the end of a frame, as the frontend does, so -l
+// stops a lane on the same cycle as running the job on its own would
+static bool hasExited(const Job *job, uint32_t frameCycles)
+{
+    return job->state.quit && (frameCycles == 0 || job->cycles >= job->budget);
+}
+
+// steps a job for one time slice, returns true once it's done
+static bool runJobSlice(Batch *batch, Job *job)
+{
+    if (job->memory == NULL && !startJob(batch, job))
+    {
+        finishJob(job, EXIT_LOAD_ERROR);
+        return true;
+    }
+    uint64_t sliceEnd = job->cycles + batch->sliceCycles;
+    if (sliceEnd > job->budget)
+        sliceEnd = job->budget;
+    while (job->cycles < sliceEnd && !job->state.halted && !hasExited(job, job->frameCycles))
+    {
+        // run up to whichever comes first: the end of the frame, the next
+        // change of input or the end of the slice
+        applyInput(job);
+        uint32_t cyclesPerFrame = cyclesInFrame(batch->clockSpeed, job->frames);
+        uint64_t stop = job->cycles + (cyclesPerFrame - job->frameCycles);
+        if (stop > sliceEnd)
+            stop = sliceEnd;
+        if (job->nextEvent < job->numEvents && job->events[job->nextEvent].cycle < stop)
+            stop = job->events[job->nextEvent].cycle;
+        uint32_t executed = runEngine(job->engine, &job->state, job->memory, stop - job->cycles);
+        job->cycles += executed;
+        job->frameCycles += executed;
+        if (job->frameCycles == cyclesPerFrame)
+        {
+            tickTimers(&job->state);
+            job->frames++;
+            job->frameCycles = 0;
+        }
+    }
+    if (job->state.halted)
+    {
+        finishJob(job, EXIT_HALTED);
+        return true;
+    }
+    if (hasExited(job, job->frameCycles))
+    {
+        finishJob(job, EXIT_EXITED);
+        return true;
+    }
+    if (job->cycles >= job->budget)
+    {
+        finishJob(job, EXIT_BUDGET);
+        return true;
+    }
+    return false;
+}
+
+static bool startLockstep(Batch *batch, Task *task)
+{
+    // jobs that can't be loaded drop out of the group
+    State *states[LOCKSTEP_LANES];
+    uint8_t *memories[LOCKSTEP_LANES];
+    int numLanes = 0;
+    for (int idx = 0; idx < task->numJobs; idx++)
+    {
+        Job *job = &batch->jobs[task->jobs[idx]];
+        if (!startJob(batch, job))
+        {
+            finishJob(job, EXIT_LOAD_ERROR);
+            continue;
+        }
+        task->jobs[numLanes] = task->jobs[idx];
+        states[numLanes] = &job->state;
+        memories[numLanes] = job->memory;
+        numLanes++;
+    }
+    task->numJobs = numLanes;
+    if (numLanes == 0)
+        return false;
+    task->group = malloc(sizeof(LockstepGroup));
+    initLockstep(task->group, states, memories, numLanes);
+    return true;
+}
+
+// the same as runJobSlice, for every lane of a lockstep group at once
+static bool runLockstepSlice(Batch *batch, Task *task)
+{
+    if (task->group == NULL && !startLockstep(batch, task))
+        return true;
+    // every job in the group has the same budget
+    uint64_t budget = batch->jobs[task->jobs[0]].budget;
+    uint64_t sliceEnd = task->cycles + batch->sliceCycles;
+    if (sliceEnd > budget)
+        sliceEnd = budget;
+    bool running = true;
+    while (task->cycles < sliceEnd && running)
+    {
+        uint32_t cyclesPerFrame = cyclesInFrame(batch->clockSpeed, task->frames);
+        uint64_t stop = task->cycles + (cyclesPerFrame - task->frameCycles);
+        if (stop > sliceEnd)
+            stop = sliceEnd;
+        for (int lane = 0; lane < task->numJobs; lane++)
+        {
+            Job *job = &batch->jobs[task->jobs[lane]];
+            if (!task->group->active[lane])
+                continue;
+            job->cycles = task->cycles;
+            applyInput(job);
+            if (job->nextEvent < job->numEvents && job->events[job->nextEvent].cycle < stop)
+                stop = job->events[job->nextEvent].cycle;
+        }
+        runLockstep(task->group, stop - task->cycles);
+        task->frameCycles += stop - task->cycles;
+        task->cycles = stop;
+        if (task->frameCycles == cyclesPerFrame)
+        {
+            tickLockstepTimers(task->group);
+            task->frames++;
+            task->frameCycles = 0;
+        }
+        running = false;
+        for (int lane = 0; lane < task->numJobs; lane++)
+        {
+            Job *job = &batch->jobs[task->jobs[lane]];
+            job->cycles = task->cycles;
+            if (task->group->active[lane] && hasExited(job, task->frameCycles))
+                stopLane(task->group, lane);
+            running |= task->group->active[lane] != 0x0;
+        }
+    }
+    if (running && task->cycles < budget)
+        return false;
+    syncLockstep(task->group);
+    for (int lane = 0; lane < task->numJobs; lane++)
+    {
+        Job *job = &batch->jobs[task->jobs[lane]];
+        job->cycles = task->group->cycles[lane];
+        if (job->state.halted)
+            finishJob(job, EXIT_HALTED);
+        else if (job->state.quit)
+            finishJob(job, EXIT_EXITED);
+        else
+            finishJob(job, EXIT_BUDGET);
+    }
+    free(task->group);
+    task->group = NULL;
+    return true;
+}
+
+static bool runSlice(Batch *batch, Task *task)
+{
+    if (batch->lockstep)
+        return runLockstepSlice(batch, task);
+    return runJobSlice(batch, &batch->jobs[task->jobs[0]]);
+}
+
+static void *runWorker(void *arg)
+{
+    Worker *self = arg;
+    Batch *batch = self->batch;
+    int idle = 0;
+    while (atomic_load_explicit(&batch->remaining, memory_order_acquire) > 0)
+    {
+        size_t task;
+        if (popBottom(&self->deque, &task) || stealTask(self, &task))
+        {
+            idle = 0;
+            if (runSlice(batch, &batch->tasks[task]))
+                atomic_fetch_sub_explicit(&batch->remaining, 1, memory_order_release);
+            else
+                pushBottom(&self->deque, task);
+        }
+        else if (++idle < 64)
+        {
+            sched_yield();
+        }
+        else
+        {
+            // everything left is being run by someone else
+            nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+        }
+    }
+    return NULL;
+}
+
+static bool readManifest(const char *filename, Batch *batch)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+    size_t capacity = 64;
+    batch->jobs = malloc(capacity * sizeof(Job));
+    batch->numJobs = 0;
+    char line[4096];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNumber++;
+        char rom[sizeof(line)], script[sizeof(line)];
+        unsigned long long budget;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        int fields = sscanf(line, "%s %llu %s", rom, &budget, script);
+        if (fields < 2)
+        {
+            fprintf(stderr, "%s:%d: expected `rom cycles [input script]`\n", filename, lineNumber);
+            fclose(fp);
+            return false;
+        }
+        if (batch->numJobs == capacity)
+        {
+            capacity *= 2;
+            batch->jobs = realloc(batch->jobs, capacity * sizeof(Job));
+        }
+        batch->jobs[batch->numJobs++] = (Job){
+            .romFilename = strdup(rom),
+            .scriptFilename = fields == 3 ? strdup(script) : NULL,
+            .budget = budget,
+            .reason = EXIT_RUNNING,
+        };
+    }
+    fclose(fp);
+    return true;
+}
+
+typedef struct
+{
+    const char *romFilename;
+    uint64_t budget;
+    size_t job;
+} JobKey;
+
+static int compareJobKeys(const void *left, const void *right)
+{
+    const JobKey *a = left, *b = right;
+    int order = strcmp(a->romFilename, b->romFilename);
+    if (order == 0)
+        order = (a->budget > b->budget) - (a->budget < b->budget);
+    if (order == 0)
+        order = (a->job > b->job) - (a->job < b->job);
+    return order;
+}
+
+static void buildTasks(Batch *batch)
+{
+    batch->tasks = calloc(batch->numJobs > 0 ? batch->numJobs : 1, sizeof(Task));
+    batch->numTasks = 0;
+    if (!batch->lockstep)
+    {
+        for (size_t job = 0; job < batch->numJobs; job++)
+        {
+            batch->tasks[batch->numTasks++] = (Task){.jobs = {job}, .numJobs = 1};
+        }
+        return;
+    }
+    // sort so jobs with the same ROM and budget end up next to each other
+    JobKey *keys = malloc((batch->numJobs > 0 ? batch->numJobs : 1) * sizeof(JobKey));
+    for (size_t job = 0; job < batch->numJobs; job++)
+    {
+        keys[job] = (JobKey){batch->jobs[job].romFilename, batch->jobs[job].budget, job};
+    }
+    qsort(keys, batch->numJobs, sizeof(JobKey), compareJobKeys);
+    for (size_t idx = 0; idx < batch->numJobs; idx++)
+    {
+        Task *task = batch->numTasks > 0 ? &batch->tasks[batch->numTasks - 1] : NULL;
+        if (task == NULL || task->numJobs == LOCKSTEP_LANES ||
+            strcmp(batch->jobs[task->jobs[0]].romFilename, keys[idx].romFilename) != 0 ||
+            batch->jobs[task->jobs[0]].budget != keys[idx].budget)
+        {
+            task = &batch->tasks[batch->numTasks++];
+        }
+        task->jobs[task->numJobs++] = keys[idx].job;
+    }
+    free(keys);
+}
+
+static const char *exitReasonName(ExitReason reason)
+{
+    switch (reason)
+    {
+    case (EXIT_BUDGET):
+        return "budget";
+    case (EXIT_HALTED):
+        return "halted";
+    case (EXIT_EXITED):
+        return "exited";
+    case (EXIT_LOAD_ERROR):
+        return "load-error";
+    default:
+        return "running";
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    char *manifestFilename = NULL;
+    int clockSpeed = 500;
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    long sliceCycles = 100000;
+    EngineKind engineKind = ENGINE_CACHED;
+    bool lockstep = false;
+    uint64_t seed = 0;
+    static const struct option longOptions[] = {
+        {"seed", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "m:j:s:c:e:l", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'R':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            manifestFilename = optarg;
+            break;
+        case 'j':
+            numThreads = atol(optarg);
+            break;
+        case 's':
+            sliceCycles = atol(optarg);
+            break;
+        case 'c':
+            clockSpeed = atoi(optarg);
+            break;
+        case 'e':
+            if (!parseEngineKind(optarg, &engineKind))
+            {
+                fprintf(stderr, "Unknown engine %s, expected one of switch, cached, threaded, jit or aot\n", optarg);
+                return 1;
+            }
+            if (engineKind == ENGINE_AOT)
+            {
+                fprintf(stderr, "The aot engine needs a ROM compiled in with chip8_aot_executable\n");
+                return 1;
+            }
+            break;
+        case 'l':
+            lockstep = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -m manifest [-j threads] [-s slice cycles] [-c clock speed] [-e engine | -l] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (manifestFilename == NULL || clockSpeed < 60 || numThreads < 1 || sliceCycles < 1)
+    {
+        fprintf(stderr, "A manifest (-m), a clock speed of at least 60 (-c), at least one thread (-j) and a positive slice (-s) are required\n");
+        return 1;
+    }
+#ifdef CHIP8_PROFILE
+    // the profile counters aren't atomic, so everything runs on one thread
+    numThreads = 1;
+#endif
+    PROFILE_START();
+
+    Batch batch = {
+        .numWorkers = numThreads,
+        .engineKind = engineKind,
+        .clockSpeed = clockSpeed,
+        .sliceCycles = sliceCycles,
+        .seed = seed,
+        .lockstep = lockstep,
+    };
+    if (!readManifest(manifestFilename, &batch))
+        return 1;
+    buildTasks(&batch);
+    atomic_init(&batch.remaining, batch.numTasks);
+
+    // deal the tasks out round robin, in reverse so each worker starts with
+    // the earliest of its tasks
+    batch.workers = calloc(batch.numWorkers, sizeof(Worker));
+    for (int w = 0; w < batch.numWorkers; w++)
+    {
+        batch.workers[w].batch = &batch;
+        batch.workers[w].seed = 0x9e3779b9u * (w + 1);
+        initDeque(&batch.workers[w].deque, batch.numTasks > 0 ? batch.numTasks : 1);
+    }
+    for (size_t task = batch.numTasks; task-- > 0;)
+    {
+        pushBottom(&batch.workers[task % batch.numWorkers].deque, task);
+    }
+
+    double start = now();
+    for (int w = 0; w < batch.numWorkers; w++)
+    {
+        pthread_create(&batch.workers[w].thread, NULL, runWorker, &batch.workers[w]);
+    }
+    for (int w = 0; w < batch.numWorkers; w++)
+    {
+        pthread_join(batch.workers[w].thread, NULL);
+    }
+    double elapsed = now() - start;
+
+    uint64_t totalCycles = 0;
+    int failed = 0;
+    for (size_t idx = 0; idx < batch.numJobs; idx++)
+    {
+        Job *job = &batch.jobs[idx];
+        printf("%zu\t%s\t%llu\t%016llx\t%s\n", idx, job->romFilename, (unsigned long long)job->cycles,
+               (unsigned long long)job->hash, exitReasonName(job->reason));
+        totalCycles += job->cycles;
+        failed += job->reason == EXIT_LOAD_ERROR;
+        free(job->romFilename);
+        free(job->scriptFilename);
+    }
+    fprintf(stderr, "%zu jobs on %d threads with the %s engine: %llu cycles in %.3fs (%.1f MIPS)\n",
+            batch.numJobs, batch.numWorkers, lockstep ? "lockstep" : engineKindName(engineKind), (unsigned long long)totalCycles, elapsed,
+            elapsed > 0 ? totalCycles / elapsed / 1e6 : 0.0);
+
+    for (int w = 0; w < batch.numWorkers; w++)
+    {
+        freeDeque(&batch.workers[w].deque);
+    }
+    free(batch.workers);
+    free(batch.tasks);
+    free(batch.jobs);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "mylib.h"
+
+// the debugger: pc breakpoints, watchpoints on memory and I, conditions on
+// the registers and single stepping, plus a disassembler for looking around.
+//
+// While one is attached to an engine, runEngine hands every call to
+// runDebugged, which steps through processOp one instruction at a time and
+// checks whatever is armed around each. None of the engines know about it,
+// so with no debugger attached their loops are exactly what they always were
+
+void initDebugger(Debugger *debugger)
+{
+    memset(debugger, 0x0, sizeof(Debugger));
+    debugger->stopped = DEBUG_RUNNING;
+}
+
+static bool conditionHolds(const DebugCondition *condition, const State *state)
+{
+    uint8_t vx = state->registers[condition->reg];
+    switch (condition->compare)
+    {
+    case (DEBUG_EQUAL):
+        return vx == condition->value;
+    case (DEBUG_NOT_EQUAL):
+        return vx != condition->value;
+    case (DEBUG_LESS):
+        return vx < condition->value;
+    case (DEBUG_GREATER):
+        return vx > condition->value;
+    }
+    return false;
+}
+
+bool addDebugCondition(Debugger *debugger, const State *state, uint8_t reg, DebugCompare compare, uint8_t value)
+{
+    // one that already holds only stops us once it's been false
+    if (debugger->numConditions == DEBUG_MAX_CONDITIONS || reg > 0xf)
+        return false;
+    DebugCondition *condition = &debugger->conditions[debugger->numConditions++];
+    *condition = (DebugCondition){.reg = reg, .compare = compare, .value = value};
+    condition->held = conditionHolds(condition, state);
+    return true;
+}
+
+static uint16_t memoryWritten(uint16_t opCode)
+{
+    // the number of bytes from I the instruction writes, FX33 and FX55 being the only ones
+    if ((opCode & 0xf0ff) == 0xf033)
+        return 3;
+    if ((opCode & 0xf0ff) == 0xf055)
+        return ((opCode >> 8) & 0xf) + 1;
+    return 0;
+}
+
+static DebugStop checkAfter(Debugger *debugger, const State *state, const uint8_t memory[], uint16_t i,
+                            const uint8_t before[], uint16_t length)
+{
+    // what the instruction that just ran set off, if anything. i is what I
+    // was before it, before what the length bytes from there held
+    for (uint16_t idx = 0; idx < length; idx++)
+    {
+        if (debugger->watched[i + idx] && memory[i + idx] != before[idx])
+        {
+            debugger->where = i + idx;
+            return DEBUG_WATCH_MEMORY;
+        }
+    }
+    if (debugger->watchI && state->i != i)
+        return DEBUG_WATCH_I;
+    DebugStop stop = DEBUG_RUNNING;
+    for (int idx = 0; idx < debugger->numConditions; idx++)
+    {
+        // every condition is brought up to date, even past the first to become true
+        DebugCondition *condition = &debugger->conditions[idx];
+        bool holds = conditionHolds(condition, state);
+        if (holds && !condition->held && stop == DEBUG_RUNNING)
+        {
+            debugger->where = idx;
+            stop = DEBUG_CONDITION;
+        }
+        condition->held = holds;
+    }
+    return stop;
+}
+
+uint32_t runDebugged(Debugger *debugger, Engine *engine, State *state, uint8_t memory[], uint32_t numOps)
+{
+    // returns the number of instructions executed, which is less than numOps
+    // when something stopped us - debugger->stopped says what
+    debugger->stopped = DEBUG_RUNNING;
+    uint32_t executed = 0;
+    while (executed < numOps)
+    {
+        // a pc BNNN took past the end of memory wraps like processOp's fetch,
+        // so a breakpoint stops whatever runs the instruction at its address
+        uint16_t pc = state->pc & (MEM_SIZE - 1);
+        // breakpoints stop us before the instruction runs
+        if (debugger->breakpoints[pc] && !debugger->resume)
+        {
+            debugger->stopped = DEBUG_BREAKPOINT;
+            break;
+        }
+        debugger->resume = false;
+        uint16_t opCode = (memory[pc] << 8) | memory[(pc + 1) & (MEM_SIZE - 1)];
+        uint16_t i = state->i;
+        uint16_t length = memoryWritten(opCode);
+        if (i + length > MEM_SIZE)
+            length = i < MEM_SIZE ? MEM_SIZE - i : 0;
+        uint8_t before[16];
+        if (length > 0)
+            memcpy(before, memory + i, length);
+        if (engine->trace != NULL)
+        {
+            // which invalidates anything the engine decoded for us
+            runTraced(engine->trace, engine, state, memory, 1);
+        }
+        else
+        {
+            processOp(state, memory);
+            if (length > 0)
+                invalidateEngine(engine, i, length);
+        }
+        // like runEngine, the unknown opcode doesn't count
+        if (state->halted)
+        {
+            debugger->stopped = DEBUG_HALTED;
+            break;
+        }
+        executed++;
+        debugger->stopped = checkAfter(debugger, state, memory, i, before, length);
+        if (debugger->stopped != DEBUG_RUNNING)
+            break;
+        if (debugger->steps > 0 && --debugger->steps == 0)
+        {
+            debugger->stopped = DEBUG_STEP;
+            break;
+        }
+    }
+    // carrying on runs the instruction we stopped at, rather than stopping there again
+    if (debugger->stopped != DEBUG_RUNNING && debugger->stopped != DEBUG_HALTED)
+        debugger->resume = true;
+    return executed;
+}
+
+const char *debugStopName(DebugStop stop)
+{
+    static const char *names[] = {
+        [DEBUG_RUNNING] = "running",
+        [DEBUG_BREAKPOINT] = "breakpoint",
+        [DEBUG_WATCH_MEMORY] = "memory watchpoint",
+        [DEBUG_WATCH_I] = "i watchpoint",
+        [DEBUG_CONDITION] = "condition",
+        [DEBUG_STEP] = "step",
+        [DEBUG_HALTED] = "unknown opcode",
+    };
+    return names[stop];
+}
+
+void disassembleOp(char *out, size_t size, uint16_t opCode)
+{
+    // e.g. "add  v1, v2" for 8124
+    int x = (opCode >> 8) & 0xf, y = (opCode >> 4) & 0xf, n = opCode & 0xf, nn = opCode & 0xff, nnn = opCode & 0xfff;
+    switch (opCode >> 12)
+    {
+    case (0x0):
+        if (opCode == 0x00e0)
+            snprintf(out, size, "cls");
+        else if (opCode == 0x00ee)
+            snprintf(out, size, "ret");
+        else if ((opCode & 0xfff0) == 0x00c0)
+            snprintf(out, size, "scd  %x", n);
+        else if ((opCode & 0xfff0) == 0x00d0)
+            snprintf(out, size, "scu  %x", n);
+        else if (opCode == 0x00fb)
+            snprintf(out, size, "scr");
+        else if (opCode == 0x00fc)
+            snprintf(out, size, "scl");
+        else if (opCode == 0x00fd)
+            snprintf(out, size, "exit");
+        else if (opCode == 0x00fe)
+            snprintf(out, size, "low");
+        else if (opCode == 0x00ff)
+            snprintf(out, size, "high");
+        else
+            snprintf(out, size, "unknown");
+        break;
+    case (0x1):
+        snprintf(out, size, "jp   %03x", nnn);
+        break;
+    case (0x2):
+        snprintf(out, size, "call %03x", nnn);
+        break;
+    case (0x3):
+        snprintf(out, size, "se   v%x, %02x", x, nn);
+        break;
+    case (0x4):
+        snprintf(out, size, "sne  v%x, %02x", x, nn);
+        break;
+    case (0x5):
+        snprintf(out, size, "se   v%x, v%x", x, y);
+        break;
+    case (0x6):
+        snprintf(out, size, "ld   v%x, %02x", x, nn);
+        break;
+    case (0x7):
+        snprintf(out, size, "add  v%x, %02x", x, nn);
+        break;
+    case (0x8):
+    {
+        static const char *names[16] = {"ld", "or", "and", "xor", "add", "sub", "shr", "subn",
+                                        NULL, NULL, NULL, NULL, NULL, NULL, "shl", NULL};
+        if (names[n] == NULL)
+            snprintf(out, size, "unknown");
+        else
+            snprintf(out, size, "%-4s v%x, v%x", names[n], x, y);
+        break;
+    }
+    case (0x9):
+        snprintf(out, size, "sne  v%x, v%x", x, y);
+        break;
+    case (0xa):
+        snprintf(out, size, "ld   i, %03x", nnn);
+        break;
+    case (0xb):
+        snprintf(out, size, "jp   v0, %03x", nnn);
+        break;
+    case (0xc):
+        snprintf(out, size, "rnd  v%x, %02x", x, nn);
+        break;
+    case (0xd):
+        snprintf(out, size, "drw  v%x, v%x, %x", x, y, n);
+        break;
+    case (0xe):
+        if (nn == 0x9e)
+            snprintf(out, size, "skp  v%x", x);
+        else if (nn == 0xa1)
+            snprintf(out, size, "sknp v%x", x);
+        else
+            snprintf(out, size, "unknown");
+        break;
+    case (0xf):
+        switch (nn)
+        {
+        case (0x01):
+            snprintf(out, size, "plane %x", x);
+            break;
+        case (0x07):
+            snprintf(out, size, "ld   v%x, dt", x);
+            break;
+        case (0x0a):
+            snprintf(out, size, "ld   v%x, k", x);
+            break;
+        case (0x15):
+            snprintf(out, size, "ld   dt, v%x", x);
+            break;
+        case (0x18):
+            snprintf(out, size, "ld   st, v%x", x);
+            break;
+        case (0x1e):
+            snprintf(out, size, "add  i, v%x", x);
+            break;
+        case (0x29):
+            snprintf(out, size, "ld   f, v%x", x);
+            break;
+        case (0x30):
+            snprintf(out, size, "ld   hf, v%x", x);
+            break;
+        case (0x33):
+            snprintf(out, size, "ld   b, v%x", x);
+            break;
+        case (0x55):
+            snprintf(out, size, "ld   [i], v%x", x);
+            break;
+        case (0x65):
+            snprintf(out, size, "ld   v%x, [i]", x);
+            break;
+        case (0x75):
+            snprintf(out, size, "ld   r, v%x", x);
+            break;
+        case (0x85):
+            snprintf(out, size, "ld   v%x, r", x);
+            break;
+        default:
+            snprintf(out, size, "unknown");
+            break;
+        }
+        break;
+    }
+}
+
+void dumpDisassembly(FILE *out, const Debugger *debugger, const State *state, const uint8_t memory[], uint16_t address, int count)
+{
+    // one instruction a line, the pc marked with > and breakpoints with *
+    char text[32];
+    for (int idx = 0; idx < count && address + 1 < MEM_SIZE; idx++, address += 2)
+    {
+        uint16_t opCode = (memory[address] << 8) | memory[address + 1];
+        disassembleOp(text, sizeof(text), opCode);
+        fprintf(out, "%c%c %03x  %04x  %s\n", address == state->pc ? '>' : ' ',
+                debugger != NULL && debugger->breakpoints[address] ? '*' : ' ', address, opCode, text);
+    }
+}
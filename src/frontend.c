@@ -0,0 +1,268 @@
+#include <stdint.h>
+#include <string.h>
+#include "frontend.h"
+
+void fillScreen(uint32_t pixels[], uint32_t pixel)
+{
+    for (int i = 0; i < LORES_WIDTH * LORES_HEIGHT; i++)
+    {
+        pixels[i] = pixel;
+    }
+}
+
+static const uint32_t palette[4] = {PIXEL_OFF, PIXEL_ON, PIXEL_PLANE2, PIXEL_BOTH};
+
+void updateScreen2(SDL_Renderer *renderer, SDL_Texture *texture, State *state, uint32_t pixels[], int scale)
+{
+    // only convert and upload the rows drawn to since the last call,
+    // merging neighbouring rows into a single upload. pixels and the texture
+    // are already the window's size, so SDL copies them without scaling.
+    // scale is the size of a hi-res pixel, lo-res ones are twice that
+    int pixelScale = state->hires ? scale : scale * 2;
+    int width = displayWidth(state) * pixelScale, height = displayHeight(state);
+    int y = 0;
+    while (y < height)
+    {
+        if (!((state->dirtyRows >> y) & 0x1))
+        {
+            y++;
+            continue;
+        }
+        int firstRow = y;
+        while (y < height && ((state->dirtyRows >> y) & 0x1))
+            y++;
+        upscaleRows(state, firstRow, y - firstRow, pixelScale, palette, pixels);
+        SDL_Rect rect = {.x = 0, .y = firstRow * pixelScale, .w = width, .h = (y - firstRow) * pixelScale};
+        SDL_UpdateTexture(texture, &rect, pixels + firstRow * pixelScale * width, width * sizeof(uint32_t));
+    }
+    state->dirtyRows = 0;
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+void updateScreen(SDL_Renderer *renderer, SDL_Texture *texture, uint8_t memory[], uint32_t pixels[])
+{
+    // assume we're filling by row
+    uint8_t values;
+    int pixelIndex = 0;
+    uint16_t offset = MEM_DISPLAY_START;
+    for (int row = 0; row < LORES_HEIGHT; row++)
+    {
+        // our memory unit is a byte - so each block of 8 bits represents 8 pixels
+        for (int colGroup = 0; colGroup < LORES_WIDTH / 8; colGroup++)
+        {
+            values = memory[offset];
+            // we now bit-shift to get the state of each pixel
+            for (int shift = 7; shift >= 0; shift--)
+            {
+                pixels[pixelIndex] = ((values >> shift) & 0x1) ? PIXEL_ON : PIXEL_OFF;
+                pixelIndex++;
+            }
+            offset += 1;
+        }
+    }
+    SDL_UpdateTexture(texture, NULL, pixels, LORES_WIDTH * sizeof(uint32_t));
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+void initFrameClock(FrameClock *clock)
+{
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    clock->ticksPerFrame = frequency / FRAMES_PER_SECOND;
+    clock->ticksPerMillisecond = frequency / 1000;
+    resetFrameClock(clock);
+}
+
+void resetFrameClock(FrameClock *clock)
+{
+    // the next frame is due one frame from now
+    clock->deadline = SDL_GetPerformanceCounter() + clock->ticksPerFrame;
+}
+
+void waitForNextFrame(FrameClock *clock)
+{
+    // SDL_Delay only has millisecond resolution and can oversleep, but the
+    // deadline moves on by exactly a frame each time, so waking up a little
+    // late only shortens the next wait rather than needing a spin to avoid
+    uint64_t now = SDL_GetPerformanceCounter();
+    while (now < clock->deadline)
+    {
+        uint64_t remaining = clock->deadline - now;
+        SDL_Delay(remaining > clock->ticksPerMillisecond ? remaining / clock->ticksPerMillisecond : 1);
+        now = SDL_GetPerformanceCounter();
+    }
+    clock->deadline += clock->ticksPerFrame;
+    // more than a few frames behind (a slow host, or the window being dragged):
+    // start again from now rather than running a burst of frames to catch up
+    if (now > clock->deadline + 4 * clock->ticksPerFrame)
+        clock->deadline = now + clock->ticksPerFrame;
+}
+
+#define FRAME_FRESH 0x4u
+
+void initTripleBuffer(TripleBuffer *buffer)
+{
+    memset(buffer->frames, 0, sizeof(buffer->frames));
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+}
+
+Frame *backFrame(TripleBuffer *buffer)
+{
+    // the frame the writer fills in before calling publishFrame
+    return &buffer->frames[buffer->back];
+}
+
+void publishFrame(TripleBuffer *buffer)
+{
+    // the finished frame goes in the middle, whatever was there becomes the
+    // next back buffer whether the reader saw it or not
+    unsigned previous = atomic_exchange_explicit(&buffer->middle, buffer->back | FRAME_FRESH, memory_order_acq_rel);
+    buffer->back = previous & ~FRAME_FRESH;
+}
+
+const Frame *latestFrame(TripleBuffer *buffer)
+{
+    // the newest published frame, or NULL if there's been none since the last call
+    if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & FRAME_FRESH))
+        return NULL;
+    unsigned previous = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel);
+    buffer->front = previous & ~FRAME_FRESH;
+    return &buffer->frames[buffer->front];
+}
+
+static void fillAudio(void *userdata, Uint8 *stream, int len)
+{
+    // runs on SDL's audio thread, it must never wait on the emulation
+    Beeper *beeper = userdata;
+    int16_t *out = (int16_t *)stream;
+    int samples = len / sizeof(int16_t);
+    if (!atomic_load_explicit(&beeper->on, memory_order_relaxed))
+    {
+        memset(stream, 0, len);
+        return;
+    }
+    int waveLength = sizeof(beeper->wave) / sizeof(beeper->wave[0]);
+    while (samples > 0)
+    {
+        int count = waveLength - beeper->position;
+        if (count > samples)
+            count = samples;
+        memcpy(out, beeper->wave + beeper->position, count * sizeof(int16_t));
+        out += count;
+        samples -= count;
+        beeper->position = (beeper->position + count) % waveLength;
+    }
+}
+
+bool openBeeper(Beeper *beeper)
+{
+    // returns false if there's no audio device, the beeper is silent then
+    atomic_init(&beeper->on, false);
+    beeper->position = 0;
+    int waveLength = sizeof(beeper->wave) / sizeof(beeper->wave[0]);
+    for (int sample = 0; sample < waveLength; sample++)
+    {
+        beeper->wave[sample] = sample % BEEP_PERIOD < BEEP_PERIOD / 2 ? BEEP_AMPLITUDE : -BEEP_AMPLITUDE;
+    }
+    SDL_AudioSpec want = {
+        .freq = AUDIO_SAMPLE_RATE,
+        .format = AUDIO_S16SYS,
+        .channels = 1,
+        .samples = AUDIO_BUFFER_SAMPLES,
+        .callback = fillAudio,
+        .userdata = beeper,
+    };
+    // no allowed changes, SDL converts if the device wants something else
+    beeper->device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if (beeper->device == 0)
+        return false;
+    SDL_PauseAudioDevice(beeper->device, 0);
+    return true;
+}
+
+void setBeeper(Beeper *beeper, bool on)
+{
+    // called once a frame, a relaxed store is all it costs
+    atomic_store_explicit(&beeper->on, on, memory_order_relaxed);
+}
+
+void closeBeeper(Beeper *beeper)
+{
+    if (beeper->device != 0)
+        SDL_CloseAudioDevice(beeper->device);
+    beeper->device = 0;
+}
+
+// the scancode for each CHIP-8 key, laid out as the left hand side of a QWERTY keyboard:
+//   1 2 3 C     1 2 3 4
+//   4 5 6 D  =  Q W E R
+//   7 8 9 E     A S D F
+//   A 0 B F     Z X C V
+static const SDL_Scancode keyMap[16] = {
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V,
+};
+
+void initKeyboard(Keyboard *keyboard)
+{
+    memset(keyboard, 0x0, sizeof(Keyboard));
+}
+
+void pollKeyboard(Keyboard *keyboard)
+{
+    // drains SDL's event queue, once per frame. Each event carries the time
+    // it was queued, which is kept so input latency can be measured against it
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+    {
+        if (event.type == SDL_QUIT)
+        {
+            keyboard->quit = true;
+            continue;
+        }
+        // held keys repeat, but a repeat changes nothing
+        if ((event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) || event.key.repeat)
+            continue;
+        bool down = event.type == SDL_KEYDOWN;
+        SDL_Scancode scancode = event.key.keysym.scancode;
+        for (int key = 0; key < 16; key++)
+        {
+            if (keyMap[key] != scancode)
+                continue;
+            if (down)
+            {
+                keyboard->keys |= 1 << key;
+                keyboard->pressedAt[key] = event.key.timestamp;
+            }
+            else
+            {
+                keyboard->keys &= ~(1 << key);
+                keyboard->releasedAt[key] = event.key.timestamp;
+            }
+        }
+        switch (scancode)
+        {
+        case SDL_SCANCODE_SPACE:
+            keyboard->quit |= down;
+            break;
+        case SDL_SCANCODE_TAB:
+            keyboard->fastForward = down;
+            break;
+        case SDL_SCANCODE_BACKSPACE:
+            keyboard->rewinding = down;
+            break;
+        case SDL_SCANCODE_F5:
+            keyboard->checkpoints += down;
+            break;
+        default:
+            break;
+        }
+    }
+}
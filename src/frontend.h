@@ -0,0 +1,122 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+// SDL rendering, input and sound on top of the core in mylib.h
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+#include "mylib.h"
+
+#define PIXEL_ON 0xffffffff
+#define PIXEL_OFF 0x000000ff
+// XO-CHIP's second plane, and pixels set in both
+#define PIXEL_PLANE2 0x5599ddff
+#define PIXEL_BOTH 0xaaaaaaff
+#define FRAMES_PER_SECOND 60
+#define AUDIO_SAMPLE_RATE 48000
+// ~10ms at 48kHz, small enough that the beep starts and stops with its frame
+#define AUDIO_BUFFER_SAMPLES 512
+// one period of the tone, ~440Hz at 48kHz
+#define BEEP_PERIOD 109
+#define BEEP_AMPLITUDE 3000
+
+// paces the main loop on SDL's high resolution counter, which is monotonic
+typedef struct {
+    uint64_t ticksPerFrame;
+    uint64_t ticksPerMillisecond;
+    // when the next frame is due
+    uint64_t deadline;
+} FrameClock;
+
+// a finished frame, as the emulation thread hands it to the render thread
+typedef struct {
+    uint64_t pixels[DISPLAY_PLANES][HIRES_HEIGHT][DISPLAY_WORDS];
+    bool hires;
+} Frame;
+
+// lock-free triple buffer between one writer and one reader: the writer
+// fills back while the reader shows front, and finished frames are swapped
+// through middle. Neither side ever waits, the reader just skips to the
+// newest frame and the writer overwrites frames nobody looked at
+typedef struct {
+    Frame frames[3];
+    // index of the middle frame, with FRAME_FRESH set if the reader hasn't taken it yet
+    _Alignas(64) atomic_uint middle;
+    // only touched by the writer
+    _Alignas(64) unsigned back;
+    // only touched by the reader
+    _Alignas(64) unsigned front;
+} TripleBuffer;
+
+// plays a square wave while the sound timer runs. The emulation thread only
+// flips a flag, the audio thread does the rest in its callback
+typedef struct {
+    SDL_AudioDeviceID device;
+    atomic_bool on;
+    // whole periods of the wave, so the callback can copy it out in blocks
+    int16_t wave[BEEP_PERIOD * 8];
+    // where in wave the next callback starts, only touched by the audio thread
+    int position;
+} Beeper;
+
+// the keyboard as of the last pollKeyboard, built up from SDL's key events
+typedef struct {
+    // the CHIP-8 keys, bit n set while key n is held
+    uint16_t keys;
+    // SDL timestamps (ms) of the last press and release of each CHIP-8 key
+    uint32_t pressedAt[16];
+    uint32_t releasedAt[16];
+    // window closed or space pressed
+    bool quit;
+    // tab and backspace held
+    bool fastForward;
+    bool rewinding;
+    // F5 presses not yet acted on
+    unsigned checkpoints;
+} Keyboard;
+
+void
+fillScreen(uint32_t pixels[], uint32_t pixel);
+
+void
+updateScreen(SDL_Renderer *renderer, SDL_Texture *texture, uint8_t memory[], uint32_t pixels[]);
+
+void
+updateScreen2(SDL_Renderer *renderer, SDL_Texture *texture, State *state, uint32_t pixels[], int scale);
+
+void
+initFrameClock(FrameClock *clock);
+
+void
+resetFrameClock(FrameClock *clock);
+
+void
+waitForNextFrame(FrameClock *clock);
+
+void
+initTripleBuffer(TripleBuffer *buffer);
+
+Frame *
+backFrame(TripleBuffer *buffer);
+
+void
+publishFrame(TripleBuffer *buffer);
+
+const Frame *
+latestFrame(TripleBuffer *buffer);
+
+void
+initKeyboard(Keyboard *keyboard);
+
+void
+pollKeyboard(Keyboard *keyboard);
+
+bool
+openBeeper(Beeper *beeper);
+
+void
+setBeeper(Beeper *beeper, bool on);
+
+void
+closeBeeper(Beeper *beeper);
+
+#endif
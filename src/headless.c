@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "mylib.h"
+
+// runs a ROM without SDL for a fixed number of cycles or frames, then dumps the final state
+
+#ifdef CHIP8_AOT_PROGRAM
+// built by chip8_aot_executable() with a ROM compiled in, which runs when -r isn't given
+extern const AotProgram CHIP8_AOT_PROGRAM;
+#endif
+
+static const char *debugHelp =
+    "b addr           break at addr        db addr          delete it\n"
+    "w addr [length]  watch memory         dw addr [length] stop watching it\n"
+    "w i              watch i              dw i             stop watching it\n"
+    "if vx op nn      stop when vx op nn becomes true, op is one of == != < >\n"
+    "di               delete every condition\n"
+    "s [n]            step n instructions  c                carry on\n"
+    "r                registers            l [addr] [n]     disassemble n instructions\n"
+    "x addr [n]       dump n bytes         q                quit\n"
+    "every number is in hex\n";
+
+static bool parseCompare(const char *text, DebugCompare *compare)
+{
+    static const char *names[] = {[DEBUG_EQUAL] = "==", [DEBUG_NOT_EQUAL] = "!=", [DEBUG_LESS] = "<", [DEBUG_GREATER] = ">"};
+    for (int idx = 0; idx < 4; idx++)
+    {
+        if (strcmp(text, names[idx]) == 0)
+        {
+            *compare = idx;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool debugPrompt(Debugger *debugger, State *state, uint8_t memory[])
+{
+    // shows where we stopped and takes commands until one of them carries
+    // on, returning false to quit
+    if (debugger->stopped == DEBUG_RUNNING)
+        printf("stopped before the first instruction, h for help\n");
+    else if (debugger->stopped == DEBUG_WATCH_MEMORY)
+        printf("stopped: %s at %03x\n", debugStopName(debugger->stopped), debugger->where);
+    else if (debugger->stopped == DEBUG_CONDITION)
+        printf("stopped: %s %d\n", debugStopName(debugger->stopped), debugger->where);
+    else
+        printf("stopped: %s\n", debugStopName(debugger->stopped));
+    dumpState(stdout, state);
+    dumpDisassembly(stdout, debugger, state, memory, state->pc, 4);
+    char line[128];
+    while (printf("(chip8) "), fflush(stdout), fgets(line, sizeof(line), stdin) != NULL)
+    {
+        char command[8] = "", what[8] = "";
+        unsigned address = 0, count = 0, value = 0;
+        int fields = sscanf(line, "%7s %x %x", command, &address, &count);
+        if (fields < 1)
+            continue;
+        if (strcmp(command, "c") == 0)
+            return true;
+        if (strcmp(command, "q") == 0)
+            return false;
+        if (strcmp(command, "s") == 0)
+        {
+            debugger->steps = fields > 1 ? address : 1;
+            if (debugger->steps > 0)
+                return true;
+        }
+        else if ((strcmp(command, "b") == 0 || strcmp(command, "db") == 0) && fields > 1 && address < MEM_SIZE)
+            debugger->breakpoints[address] = command[0] == 'b';
+        else if ((strcmp(command, "w") == 0 || strcmp(command, "dw") == 0) && sscanf(line, "%*s %7s", what) == 1 &&
+                 strcmp(what, "i") == 0)
+            debugger->watchI = command[0] == 'w';
+        else if ((strcmp(command, "w") == 0 || strcmp(command, "dw") == 0) && fields > 1)
+        {
+            for (unsigned idx = address; idx < address + (fields > 2 ? count : 1) && idx < MEM_SIZE; idx++)
+            {
+                debugger->watched[idx] = command[0] == 'w';
+            }
+        }
+        else if (strcmp(command, "if") == 0)
+        {
+            char compare[4];
+            DebugCompare kind;
+            if (sscanf(line, "%*s v%x %3s %x", &address, compare, &value) != 3 || !parseCompare(compare, &kind) ||
+                !addDebugCondition(debugger, state, address, kind, value))
+                printf("expected if vx op nn, with op one of == != < > and at most %d conditions\n", DEBUG_MAX_CONDITIONS);
+        }
+        else if (strcmp(command, "di") == 0)
+            debugger->numConditions = 0;
+        else if (strcmp(command, "r") == 0)
+            dumpState(stdout, state);
+        else if (strcmp(command, "l") == 0)
+            dumpDisassembly(stdout, debugger, state, memory, fields > 1 ? address : state->pc, fields > 2 ? count : 8);
+        else if (strcmp(command, "x") == 0 && fields > 1)
+        {
+            for (unsigned idx = 0; idx < (fields > 2 ? count : 16) && address + idx < MEM_SIZE; idx++)
+            {
+                if (idx % 16 == 0)
+                    printf("%s%03x:", idx > 0 ? "\n" : "", address + idx);
+                printf(" %02x", memory[address + idx]);
+            }
+            printf("\n");
+        }
+        else
+            printf("%s", debugHelp);
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    char *romFilename = NULL;
+    char *saveFilename = NULL;
+    char *loadFilename = NULL;
+    char *traceFilename = NULL;
+    bool debug = false;
+    int clockSpeed = 500;
+    long maxCycles = -1;
+    long maxFrames = -1;
+    uint64_t seed = 0;
+#ifdef CHIP8_AOT_PROGRAM
+    EngineKind engineKind = ENGINE_AOT;
+    bool haveROM = true;
+#else
+    EngineKind engineKind = ENGINE_CACHED;
+    bool haveROM = false;
+#endif
+    static const struct option longOptions[] = {
+        {"save", required_argument, NULL, 'S'},
+        {"load", required_argument, NULL, 'L'},
+        {"trace", required_argument, NULL, 'T'},
+        {"seed", required_argument, NULL, 'R'},
+        {"debug", no_argument, NULL, 'D'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "r:c:n:f:e:", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'S':
+            saveFilename = optarg;
+            break;
+        case 'L':
+            loadFilename = optarg;
+            break;
+        case 'T':
+            traceFilename = optarg;
+            break;
+        case 'R':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'D':
+            debug = true;
+            break;
+        case 'r':
+            romFilename = optarg;
+            break;
+        case 'c':
+            clockSpeed = atoi(optarg);
+            break;
+        case 'n':
+            maxCycles = atol(optarg);
+            break;
+        case 'f':
+            maxFrames = atol(optarg);
+            break;
+        case 'e':
+            if (!parseEngineKind(optarg, &engineKind))
+            {
+                fprintf(stderr, "Unknown engine %s, expected one of switch, cached, threaded, jit or aot\n", optarg);
+                return 1;
+            }
+#ifndef CHIP8_AOT_PROGRAM
+            if (engineKind == ENGINE_AOT)
+            {
+                fprintf(stderr, "The aot engine needs a ROM compiled in with chip8_aot_executable\n");
+                return 1;
+            }
+#endif
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -r rom | --load state [-n cycles] [-f frames] [-c clock speed] [-e engine] [--save state] [--trace file] [--seed n] [--debug]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((romFilename == NULL && loadFilename == NULL && !haveROM) || clockSpeed < 60 || (maxCycles < 0 && maxFrames < 0))
+    {
+        fprintf(stderr, "A ROM (-r) or save state (--load), a clock speed of at least 60 (-c) and a number of cycles (-n) or frames (-f) are required\n");
+        return 1;
+    }
+    PROFILE_START();
+
+    // VM init
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    copySpritesToMemory(memory);
+    State state = {.pc = ROM_OFFSET};
+    if (loadFilename != NULL)
+    {
+        if (!loadState(loadFilename, &state, memory))
+        {
+            fprintf(stderr, "Could not load a version %d save state from %s\n", SAVE_STATE_VERSION, loadFilename);
+            return 1;
+        }
+    }
+    else if (romFilename != NULL && loadROM(romFilename, memory) < 0)
+    {
+        fprintf(stderr, "Could not open %s\n", romFilename);
+        return 1;
+    }
+    else
+    {
+#ifdef CHIP8_AOT_PROGRAM
+        if (romFilename == NULL)
+            memcpy(memory + ROM_OFFSET, CHIP8_AOT_PROGRAM.rom, CHIP8_AOT_PROGRAM.romSize);
+#endif
+        // a save state carries on with its own generator
+        seedRandom(&state, seed);
+    }
+    Engine engine;
+#ifdef CHIP8_AOT_PROGRAM
+    // blocks that don't match what's in memory, from -r or --load, are left to the interpreter
+    if (engineKind == ENGINE_AOT)
+        initAotEngine(&engine, &CHIP8_AOT_PROGRAM, memory);
+    else
+#endif
+        initEngine(&engine, engineKind);
+    if (traceFilename != NULL && (engine.trace = openTrace(traceFilename, 1 << 20)) == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", traceFilename);
+        return 1;
+    }
+
+    // stopped before the first instruction, with a prompt
+    static Debugger debugger;
+    bool running = true;
+    if (debug)
+    {
+        initDebugger(&debugger);
+        engine.debugger = &debugger;
+        running = debugPrompt(&debugger, &state, memory);
+    }
+
+    // timers tick once every cyclesInFrame cycles, exactly as they would at full speed
+    long cycles = 0;
+    long frames = 0;
+    // the debugger can stop us part way through a frame
+    uint32_t frameCycles = 0;
+    // stops on an unknown opcode, or when the ROM exits with 00FD
+    while (running && !state.halted && !state.quit && (maxCycles < 0 || cycles < maxCycles) && (maxFrames < 0 || frames < maxFrames))
+    {
+        uint32_t cyclesPerFrame = cyclesInFrame(clockSpeed, frames);
+        uint32_t numOps = cyclesPerFrame - frameCycles;
+        if (maxCycles >= 0 && maxCycles - cycles < numOps)
+            numOps = maxCycles - cycles;
+        uint32_t executed = runEngine(&engine, &state, memory, numOps);
+        cycles += executed;
+        frameCycles += executed;
+        if (frameCycles == cyclesPerFrame)
+        {
+            tickTimers(&state);
+            frames++;
+            frameCycles = 0;
+        }
+        if (engine.debugger != NULL && debugger.stopped != DEBUG_RUNNING && !debugPrompt(&debugger, &state, memory))
+            break;
+    }
+    if (engine.trace != NULL && !closeTrace(engine.trace))
+    {
+        fprintf(stderr, "Could not write the whole trace to %s\n", traceFilename);
+        return 1;
+    }
+    freeEngine(&engine);
+    if (saveFilename != NULL && !saveState(saveFilename, &state, memory))
+    {
+        fprintf(stderr, "Could not save to %s\n", saveFilename);
+        return 1;
+    }
+
+    printf("engine: %s\n", engineKindName(engine.kind));
+    printf("cycles: %ld\n", cycles);
+    printf("frames: %ld\n", frames);
+    dumpState(stdout, &state);
+    dumpDisplay(stdout, &state);
+    return state.halted ? 1 : 0;
+}
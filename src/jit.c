@@ -0,0 +1,692 @@
+// mmap/mprotect aren't part of C11
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "mylib.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#endif
+
+// enough for a few thousand blocks, we start over once it's full
+#define JIT_CODE_SIZE (1 << 20)
+// worst case is ~60 bytes per instruction plus the prologue/epilogue
+#define JIT_MAX_BLOCK_OPS 64
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_OPS * 64 + 128)
+
+typedef void (*JitBlockFn)(State *state);
+
+typedef enum {
+    // not looked at yet
+    BLOCK_EMPTY,
+    // native code in fn
+    BLOCK_NATIVE,
+    // the first instruction can't be translated, run it through processOp
+    BLOCK_INTERPRET,
+} JitBlockKind;
+
+typedef struct {
+    JitBlockFn fn;
+    uint16_t numOps;
+    uint8_t kind;
+} JitBlock;
+
+struct Jit {
+    uint8_t *code;
+    size_t codeUsed;
+    JitBlock blocks[MEM_SIZE];
+    // set for every byte of guest code a native block was built from
+    bool translated[MEM_SIZE];
+};
+
+static bool writesMemory(uint8_t opCodeLeft, uint8_t opCodeRight, uint16_t *length)
+{
+    if ((opCodeLeft >> 4) != 0xf)
+        return false;
+    if (opCodeRight == 0x33)
+    {
+        *length = 3;
+        return true;
+    }
+    if (opCodeRight == 0x55)
+    {
+        *length = (opCodeLeft & 0x0f) + 1;
+        return true;
+    }
+    return false;
+}
+
+static void flushJit(Jit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->translated, 0, sizeof(jit->translated));
+    jit->codeUsed = 0;
+}
+
+void invalidateJit(Jit *jit, uint16_t address, uint16_t length)
+{
+    // self-modifying code is rare enough that throwing everything away is simpler
+    // than tracking which blocks cover which bytes
+    for (int idx = address; idx < address + length && idx < MEM_SIZE; idx++)
+    {
+        if (jit->translated[idx])
+        {
+            flushJit(jit);
+            return;
+        }
+    }
+}
+
+#ifdef JIT_SUPPORTED
+
+// host registers, numbered as in the instruction encoding
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R12 = 12,
+};
+
+// registers we can hand out to V0-VF; rax, rcx and rdx are scratch, rdi holds State *
+static const uint8_t registerPool[] = {RSI, R8, R8 + 1, R8 + 2, R8 + 3, RBX, RBP, R12, R12 + 1, R12 + 2, R12 + 3};
+#define POOL_SIZE (int)(sizeof(registerPool) / sizeof(registerPool[0]))
+
+#define OFFSET_REGISTERS offsetof(State, registers)
+#define OFFSET_I offsetof(State, i)
+#define OFFSET_PC offsetof(State, pc)
+#define OFFSET_SP offsetof(State, sp)
+#define OFFSET_STACK offsetof(State, stack)
+#define OFFSET_DELAY_TIMER offsetof(State, delay_timer)
+#define OFFSET_SOUND_TIMER offsetof(State, sound_timer)
+
+// x86-64 ALU opcodes (op r/m32, r32) and their /digit for the immediate form
+enum {
+    ALU_ADD = 0x01,
+    ALU_OR = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39,
+};
+
+typedef struct {
+    uint8_t *out;
+    // host register for each of V0-VF, or -1
+    int8_t host[16];
+    bool dirty[16];
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t byte)
+{
+    *e->out++ = byte;
+}
+static void emit16(Emitter *e, uint16_t value)
+{
+    emit8(e, value & 0xff);
+    emit8(e, value >> 8);
+}
+static void emit32(Emitter *e, uint32_t value)
+{
+    emit16(e, value & 0xffff);
+    emit16(e, value >> 16);
+}
+static void emitRex(Emitter *e, int reg, int rm, bool force)
+{
+    uint8_t rex = 0x40 | ((reg & 8) ? 0x4 : 0) | ((rm & 8) ? 0x1 : 0);
+    if (rex != 0x40 || force)
+        emit8(e, rex);
+}
+// op r/m32, reg32 with both operands registers
+static void emitRegReg(Emitter *e, uint8_t opcode, int dst, int src)
+{
+    emitRex(e, src, dst, false);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+static void emitMovRegReg(Emitter *e, int dst, int src)
+{
+    emitRegReg(e, 0x89, dst, src);
+}
+static void emitMovRegImm(Emitter *e, int dst, uint32_t value)
+{
+    emitRex(e, 0, dst, false);
+    emit8(e, 0xb8 + (dst & 7));
+    emit32(e, value);
+}
+// op r/m32, imm32 - the /digit of the immediate form is the register form's opcode >> 3
+static void emitAluImm(Emitter *e, uint8_t alu, int dst, uint32_t value)
+{
+    emitRex(e, 0, dst, false);
+    emit8(e, 0x81);
+    emit8(e, 0xc0 | ((alu >> 3) << 3) | (dst & 7));
+    emit32(e, value);
+}
+static void emitShift(Emitter *e, bool left, int dst, uint8_t count)
+{
+    emitRex(e, 0, dst, false);
+    emit8(e, 0xc1);
+    emit8(e, 0xc0 | ((left ? 4 : 5) << 3) | (dst & 7));
+    emit8(e, count);
+}
+// [rdi + disp32] addressing for reg
+static void emitStateOperand(Emitter *e, int reg, uint32_t offset)
+{
+    emit8(e, 0x80 | ((reg & 7) << 3) | RDI);
+    emit32(e, offset);
+}
+// movzx reg32, byte/word [rdi + offset]
+static void emitLoadState(Emitter *e, int dst, uint32_t offset, bool word)
+{
+    emitRex(e, dst, RDI, false);
+    emit8(e, 0x0f);
+    emit8(e, word ? 0xb7 : 0xb6);
+    emitStateOperand(e, dst, offset);
+}
+// mov byte [rdi + offset], reg8
+static void emitStoreStateByte(Emitter *e, int src, uint32_t offset)
+{
+    // the REX prefix makes 5/6 mean bpl/sil rather than ch/dh
+    emitRex(e, src, RDI, true);
+    emit8(e, 0x88);
+    emitStateOperand(e, src, offset);
+}
+// mov word [rdi + offset], ax
+static void emitStoreStateWordAx(Emitter *e, uint32_t offset)
+{
+    emit8(e, 0x66);
+    emit8(e, 0x89);
+    emitStateOperand(e, RAX, offset);
+}
+// mov word [rdi + offset], imm16
+static void emitStoreStateWordImm(Emitter *e, uint32_t offset, uint16_t value)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xc7);
+    emitStateOperand(e, 0, offset);
+    emit16(e, value);
+}
+// cmovcc eax, ecx
+static void emitCmovEaxEcx(Emitter *e, bool equal)
+{
+    emit8(e, 0x0f);
+    emit8(e, equal ? 0x44 : 0x45);
+    emit8(e, 0xc1);
+}
+// cmove eax, edx
+static void emitCmoveEaxEdx(Emitter *e)
+{
+    emit8(e, 0x0f);
+    emit8(e, 0x44);
+    emit8(e, 0xc2);
+}
+// setae cl; movzx ecx, cl
+static void emitSetaeEcx(Emitter *e)
+{
+    emit8(e, 0x0f);
+    emit8(e, 0x93);
+    emit8(e, 0xc1);
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    emit8(e, 0xc9);
+}
+static void emitPush(Emitter *e, int reg)
+{
+    emitRex(e, 0, reg, false);
+    emit8(e, 0x50 + (reg & 7));
+}
+static void emitPop(Emitter *e, int reg)
+{
+    emitRex(e, 0, reg, false);
+    emit8(e, 0x58 + (reg & 7));
+}
+static bool isCalleeSaved(int reg)
+{
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+// the pc after the block when it falls through or skips
+static void emitConditionalPC(Emitter *e, bool equal, uint16_t pc)
+{
+    emitMovRegImm(e, RAX, pc + 2);
+    emitMovRegImm(e, RCX, pc + 4);
+    emitCmovEaxEcx(e, equal);
+    emitStoreStateWordAx(e, OFFSET_PC);
+}
+
+// dst = (a - b) % 0xff as computed by subtractRegisters: only differs from
+// 8-bit wraparound when the difference is +/-255, which becomes 0
+static void emitSubtract(Emitter *e, int dst, int a, int b, int f)
+{
+    // VF = no borrow
+    emitRegReg(e, ALU_CMP, a, b);
+    emitSetaeEcx(e);
+    emitMovRegReg(e, RAX, a);
+    emitRegReg(e, ALU_SUB, RAX, b);
+    emitRegReg(e, ALU_XOR, RDX, RDX);
+    emitAluImm(e, ALU_CMP, RAX, 255);
+    emitCmoveEaxEdx(e);
+    emitAluImm(e, ALU_CMP, RAX, (uint32_t)-255);
+    emitCmoveEaxEdx(e);
+    emitAluImm(e, ALU_AND, RAX, 0xff);
+    emitMovRegReg(e, dst, RAX);
+    emitMovRegReg(e, f, RCX);
+}
+
+typedef enum {
+    // can't be translated, the block stops before it
+    TRANSLATE_NONE,
+    // straight-line instruction
+    TRANSLATE_SIMPLE,
+    // changes the pc, the block ends after it
+    TRANSLATE_TERMINATOR,
+} TranslateKind;
+
+// which of V0-VF an instruction touches, and whether we can translate it
+static TranslateKind analyseOp(uint8_t opCodeLeft, uint8_t opCodeRight, uint16_t *usedRegs)
+{
+    uint8_t x = opCodeLeft & 0x0f;
+    uint8_t y = opCodeRight >> 4;
+    switch (opCodeLeft >> 4)
+    {
+    case (0x0):
+        if (opCodeLeft == 0x00 && opCodeRight == 0xee)
+            return TRANSLATE_TERMINATOR;
+        return TRANSLATE_NONE;
+    case (0x1):
+    case (0x2):
+        return TRANSLATE_TERMINATOR;
+    case (0x3):
+    case (0x4):
+        *usedRegs |= 1 << x;
+        return TRANSLATE_TERMINATOR;
+    case (0x5):
+    case (0x9):
+        *usedRegs |= (1 << x) | (1 << y);
+        return TRANSLATE_TERMINATOR;
+    case (0x6):
+    case (0x7):
+        *usedRegs |= 1 << x;
+        return TRANSLATE_SIMPLE;
+    case (0x8):
+        switch (opCodeRight & 0x0f)
+        {
+        case (0x0):
+        case (0x1):
+        case (0x2):
+        case (0x3):
+            *usedRegs |= (1 << x) | (1 << y);
+            return TRANSLATE_SIMPLE;
+        case (0x4):
+        case (0x5):
+        case (0x7):
+            *usedRegs |= (1 << x) | (1 << y) | (1 << 0xf);
+            return TRANSLATE_SIMPLE;
+        case (0x6):
+        case (0xe):
+            *usedRegs |= (1 << x) | (1 << 0xf);
+            return TRANSLATE_SIMPLE;
+        default:
+            return TRANSLATE_NONE;
+        }
+    case (0xa):
+        return TRANSLATE_SIMPLE;
+    case (0xb):
+        *usedRegs |= 1 << 0;
+        return TRANSLATE_TERMINATOR;
+    case (0xf):
+        switch (opCodeRight)
+        {
+        case (0x07):
+        case (0x15):
+        case (0x18):
+        case (0x1e):
+            *usedRegs |= 1 << x;
+            return TRANSLATE_SIMPLE;
+        case (0x29):
+            return TRANSLATE_SIMPLE;
+        default:
+            return TRANSLATE_NONE;
+        }
+    default:
+        // draw, random and key handling go through processOp
+        return TRANSLATE_NONE;
+    }
+}
+
+static void emitOp(Emitter *e, uint16_t pc, uint8_t opCodeLeft, uint8_t opCodeRight)
+{
+    uint8_t x = opCodeLeft & 0x0f;
+    uint8_t y = opCodeRight >> 4;
+    uint16_t nnn = (x << 8) | opCodeRight;
+    int hx = e->host[x];
+    int hy = e->host[y];
+    int hf = e->host[0xf];
+    switch (opCodeLeft >> 4)
+    {
+    case (0x0):
+        // 00ee: sp -= 1; pc = stack[sp]
+        emit8(e, 0xfe);
+        emitStateOperand(e, 1, OFFSET_SP);
+        emitLoadState(e, RAX, OFFSET_SP, false);
+        // movzx eax, word [rdi + rax*2 + stack]
+        emit8(e, 0x0f);
+        emit8(e, 0xb7);
+        emit8(e, 0x84);
+        emit8(e, 0x47);
+        emit32(e, OFFSET_STACK);
+        emitStoreStateWordAx(e, OFFSET_PC);
+        break;
+    case (0x1):
+        emitStoreStateWordImm(e, OFFSET_PC, nnn);
+        break;
+    case (0x2):
+        // stack[sp] = pc + 2; sp += 1; pc = nnn
+        emitLoadState(e, RAX, OFFSET_SP, false);
+        // mov word [rdi + rax*2 + stack], imm16
+        emit8(e, 0x66);
+        emit8(e, 0xc7);
+        emit8(e, 0x84);
+        emit8(e, 0x47);
+        emit32(e, OFFSET_STACK);
+        emit16(e, pc + 2);
+        emit8(e, 0xfe);
+        emitStateOperand(e, 0, OFFSET_SP);
+        emitStoreStateWordImm(e, OFFSET_PC, nnn);
+        break;
+    case (0x3):
+    case (0x4):
+        emitAluImm(e, ALU_CMP, hx, opCodeRight);
+        emitConditionalPC(e, (opCodeLeft >> 4) == 0x3, pc);
+        break;
+    case (0x5):
+    case (0x9):
+        emitRegReg(e, ALU_CMP, hx, hy);
+        emitConditionalPC(e, (opCodeLeft >> 4) == 0x5, pc);
+        break;
+    case (0x6):
+        emitMovRegImm(e, hx, opCodeRight);
+        e->dirty[x] = true;
+        break;
+    case (0x7):
+        emitAluImm(e, ALU_ADD, hx, opCodeRight);
+        emitAluImm(e, ALU_AND, hx, 0xff);
+        e->dirty[x] = true;
+        break;
+    case (0x8):
+        e->dirty[x] = true;
+        switch (opCodeRight & 0x0f)
+        {
+        case (0x0):
+            if (x != y)
+                emitMovRegReg(e, hx, hy);
+            break;
+        case (0x1):
+            emitRegReg(e, ALU_OR, hx, hy);
+            break;
+        case (0x2):
+            emitRegReg(e, ALU_AND, hx, hy);
+            break;
+        case (0x3):
+            emitRegReg(e, ALU_XOR, hx, hy);
+            break;
+        case (0x4):
+            // the sum is at most 0x1fe, so bit 8 is the carry
+            emitMovRegReg(e, RAX, hx);
+            emitRegReg(e, ALU_ADD, RAX, hy);
+            emitMovRegReg(e, hx, RAX);
+            emitAluImm(e, ALU_AND, hx, 0xff);
+            emitShift(e, false, RAX, 8);
+            emitMovRegReg(e, hf, RAX);
+            e->dirty[0xf] = true;
+            break;
+        case (0x5):
+            emitSubtract(e, hx, hx, hy, hf);
+            e->dirty[0xf] = true;
+            break;
+        case (0x6):
+            emitMovRegReg(e, RAX, hx);
+            emitAluImm(e, ALU_AND, RAX, 0x1);
+            emitMovRegReg(e, hf, RAX);
+            emitShift(e, false, hx, 1);
+            e->dirty[0xf] = true;
+            break;
+        case (0x7):
+            emitSubtract(e, hx, hy, hx, hf);
+            e->dirty[0xf] = true;
+            break;
+        case (0xe):
+            emitMovRegReg(e, RAX, hx);
+            emitShift(e, true, RAX, 1);
+            emitMovRegReg(e, hx, RAX);
+            emitAluImm(e, ALU_AND, hx, 0xff);
+            emitShift(e, false, RAX, 8);
+            emitMovRegReg(e, hf, RAX);
+            e->dirty[0xf] = true;
+            break;
+        }
+        break;
+    case (0xa):
+        emitStoreStateWordImm(e, OFFSET_I, nnn);
+        break;
+    case (0xb):
+        emitMovRegReg(e, RAX, e->host[0]);
+        emitAluImm(e, ALU_ADD, RAX, nnn);
+        emitStoreStateWordAx(e, OFFSET_PC);
+        break;
+    case (0xf):
+        switch (opCodeRight)
+        {
+        case (0x07):
+            emitLoadState(e, hx, OFFSET_DELAY_TIMER, false);
+            e->dirty[x] = true;
+            break;
+        case (0x15):
+            emitStoreStateByte(e, hx, OFFSET_DELAY_TIMER);
+            break;
+        case (0x18):
+            emitStoreStateByte(e, hx, OFFSET_SOUND_TIMER);
+            break;
+        case (0x1e):
+            // add word [rdi + i], ax
+            emitMovRegReg(e, RAX, hx);
+            emit8(e, 0x66);
+            emit8(e, 0x01);
+            emitStateOperand(e, RAX, OFFSET_I);
+            break;
+        case (0x29):
+            // setIToSprite uses the register number rather than its value
+            emitStoreStateWordImm(e, OFFSET_I, x * 5);
+            break;
+        }
+        break;
+    }
+}
+
+static JitBlockFn toFunction(uint8_t *code)
+{
+    // ISO C has no conversion between object and function pointers
+    JitBlockFn fn;
+    memcpy(&fn, &code, sizeof(fn));
+    return fn;
+}
+
+static void translateBlock(Jit *jit, uint8_t memory[], uint16_t start)
+{
+    JitBlock *block = &jit->blocks[start];
+    // first pass: how far the block goes and which registers it needs
+    uint16_t usedRegs = 0;
+    int numOps = 0;
+    bool terminated = false;
+    uint16_t pc = start;
+    while (numOps < JIT_MAX_BLOCK_OPS && pc + 1 < MEM_SIZE)
+    {
+        uint16_t regs = usedRegs;
+        TranslateKind kind = analyseOp(memory[pc], memory[pc + 1], &regs);
+        if (kind == TRANSLATE_NONE || __builtin_popcount(regs) > POOL_SIZE)
+            break;
+        usedRegs = regs;
+        numOps++;
+        pc += 2;
+        if (kind == TRANSLATE_TERMINATOR)
+        {
+            terminated = true;
+            break;
+        }
+    }
+    if (numOps == 0)
+    {
+        block->kind = BLOCK_INTERPRET;
+        return;
+    }
+    if (jit->codeUsed + JIT_MAX_BLOCK_BYTES > JIT_CODE_SIZE)
+    {
+        flushJit(jit);
+    }
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        block->kind = BLOCK_INTERPRET;
+        return;
+    }
+
+    Emitter e = {.out = jit->code + jit->codeUsed};
+    memset(e.host, -1, sizeof(e.host));
+    int nextHost = 0;
+    for (int reg = 0; reg < 16; reg++)
+    {
+        if (usedRegs & (1 << reg))
+            e.host[reg] = registerPool[nextHost++];
+    }
+    uint8_t *entry = e.out;
+    // prologue: save what the SysV ABI wants preserved, pull V0-VF into host registers
+    for (int idx = 0; idx < nextHost; idx++)
+    {
+        if (isCalleeSaved(registerPool[idx]))
+            emitPush(&e, registerPool[idx]);
+    }
+    for (int reg = 0; reg < 16; reg++)
+    {
+        if (e.host[reg] >= 0)
+            emitLoadState(&e, e.host[reg], OFFSET_REGISTERS + reg, false);
+    }
+    pc = start;
+    for (int op = 0; op < numOps; op++, pc += 2)
+    {
+        emitOp(&e, pc, memory[pc], memory[pc + 1]);
+    }
+    if (!terminated)
+    {
+        emitStoreStateWordImm(&e, OFFSET_PC, pc);
+    }
+    // epilogue: write back whatever changed
+    for (int reg = 0; reg < 16; reg++)
+    {
+        if (e.dirty[reg])
+            emitStoreStateByte(&e, e.host[reg], OFFSET_REGISTERS + reg);
+    }
+    for (int idx = nextHost - 1; idx >= 0; idx--)
+    {
+        if (isCalleeSaved(registerPool[idx]))
+            emitPop(&e, registerPool[idx]);
+    }
+    emit8(&e, 0xc3);
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    jit->codeUsed = e.out - jit->code;
+    block->fn = toFunction(entry);
+    block->numOps = numOps;
+    block->kind = BLOCK_NATIVE;
+    for (int idx = start; idx < pc; idx++)
+    {
+        jit->translated[idx] = true;
+    }
+}
+
+Jit *createJit(void)
+{
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (jit == NULL)
+        return NULL;
+    // mapped read/exec and only made writable while translating
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    jit->code = code;
+    return jit;
+}
+
+void destroyJit(Jit *jit)
+{
+    if (jit == NULL)
+        return;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+#else
+
+Jit *createJit(void)
+{
+    // no code generator for this host, callers fall back to an interpreter
+    return NULL;
+}
+
+void destroyJit(Jit *jit)
+{
+}
+
+static void translateBlock(Jit *jit, uint8_t memory[], uint16_t start)
+{
+    jit->blocks[start].kind = BLOCK_INTERPRET;
+}
+
+#endif
+
+uint32_t runJit(Jit *jit, State *state, uint8_t memory[], uint32_t numOps)
+{
+    uint32_t requested = numOps;
+    while (numOps > 0)
+    {
+        // blocks store the pcs they end on as they are, so a pc past the end
+        // of memory (BNNN can get there) is left to processOp, which wraps it
+        if (state->pc < MEM_SIZE)
+        {
+            JitBlock *block = &jit->blocks[state->pc];
+            if (block->kind == BLOCK_EMPTY)
+            {
+                translateBlock(jit, memory, state->pc);
+            }
+            // a block runs all of its instructions, so near the end of the
+            // budget we step through the rest one at a time
+            if (block->kind == BLOCK_NATIVE && block->numOps <= numOps)
+            {
+                block->fn(state);
+                numOps -= block->numOps;
+                continue;
+            }
+        }
+        uint16_t pc = state->pc & (MEM_SIZE - 1);
+        uint16_t length;
+        bool writes = writesMemory(memory[pc], memory[(pc + 1) & (MEM_SIZE - 1)], &length);
+        processOp(state, memory);
+        if (state->halted)
+            break;
+        if (writes)
+        {
+            invalidateJit(jit, state->i, length);
+        }
+        numOps--;
+    }
+    return requested - numOps;
+}
@@ -0,0 +1,668 @@
+#include <stdint.h>
+#include <string.h>
+#include "mylib.h"
+
+// runs the same ROM in up to LOCKSTEP_LANES VMs at once
+//
+// Every step, each active lane executes exactly one instruction. The lanes
+// whose pc matches the leader's run it together with SIMD over the
+// structure of arrays in LockstepGroup, the rest go through processOp one
+// lane at a time until their pcs line up again. Ops that touch the display,
+// input, memory or the rng always go through processOp.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i Vec;
+#define VEC_BYTES 32
+static inline Vec vecLoad(const void *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void vecStore(void *p, Vec v) { _mm256_storeu_si256((__m256i *)p, v); }
+static inline Vec vecSet8(uint8_t value) { return _mm256_set1_epi8((char)value); }
+static inline Vec vecSet16(uint16_t value) { return _mm256_set1_epi16((short)value); }
+static inline Vec vecAnd(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+static inline Vec vecOr(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+static inline Vec vecXor(Vec a, Vec b) { return _mm256_xor_si256(a, b); }
+// ~a & b
+static inline Vec vecAndNot(Vec a, Vec b) { return _mm256_andnot_si256(a, b); }
+static inline Vec vecAdd8(Vec a, Vec b) { return _mm256_add_epi8(a, b); }
+static inline Vec vecSub8(Vec a, Vec b) { return _mm256_sub_epi8(a, b); }
+static inline Vec vecMin8(Vec a, Vec b) { return _mm256_min_epu8(a, b); }
+static inline Vec vecEq8(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline Vec vecShr1(Vec a) { return _mm256_and_si256(_mm256_srli_epi16(a, 1), vecSet8(0x7f)); }
+static inline Vec vecAdd16(Vec a, Vec b) { return _mm256_add_epi16(a, b); }
+static inline Vec vecEq16(Vec a, Vec b) { return _mm256_cmpeq_epi16(a, b); }
+static inline uint32_t vecMoveMask(Vec a) { return (uint32_t)_mm256_movemask_epi8(a); }
+// two vectors of 16-bit lane masks to one of 8-bit lane masks, keeping the lane order
+static inline Vec vecNarrowMask(Vec lo, Vec hi) { return _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8); }
+// 8-bit lanes to 16-bit ones, sign extended for masks and zero extended for values
+static inline void vecWidenMask(Vec a, Vec *lo, Vec *hi)
+{
+    *lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(a));
+    *hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(a, 1));
+}
+static inline void vecWidenValue(Vec a, Vec *lo, Vec *hi)
+{
+    *lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a));
+    *hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i Vec;
+#define VEC_BYTES 16
+static inline Vec vecLoad(const void *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void vecStore(void *p, Vec v) { _mm_storeu_si128((__m128i *)p, v); }
+static inline Vec vecSet8(uint8_t value) { return _mm_set1_epi8((char)value); }
+static inline Vec vecSet16(uint16_t value) { return _mm_set1_epi16((short)value); }
+static inline Vec vecAnd(Vec a, Vec b) { return _mm_and_si128(a, b); }
+static inline Vec vecOr(Vec a, Vec b) { return _mm_or_si128(a, b); }
+static inline Vec vecXor(Vec a, Vec b) { return _mm_xor_si128(a, b); }
+static inline Vec vecAndNot(Vec a, Vec b) { return _mm_andnot_si128(a, b); }
+static inline Vec vecAdd8(Vec a, Vec b) { return _mm_add_epi8(a, b); }
+static inline Vec vecSub8(Vec a, Vec b) { return _mm_sub_epi8(a, b); }
+static inline Vec vecMin8(Vec a, Vec b) { return _mm_min_epu8(a, b); }
+static inline Vec vecEq8(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+static inline Vec vecShr1(Vec a) { return _mm_and_si128(_mm_srli_epi16(a, 1), vecSet8(0x7f)); }
+static inline Vec vecAdd16(Vec a, Vec b) { return _mm_add_epi16(a, b); }
+static inline Vec vecEq16(Vec a, Vec b) { return _mm_cmpeq_epi16(a, b); }
+static inline uint32_t vecMoveMask(Vec a) { return (uint32_t)_mm_movemask_epi8(a); }
+static inline Vec vecNarrowMask(Vec lo, Vec hi) { return _mm_packs_epi16(lo, hi); }
+static inline void vecWidenMask(Vec a, Vec *lo, Vec *hi)
+{
+    *lo = _mm_unpacklo_epi8(a, a);
+    *hi = _mm_unpackhi_epi8(a, a);
+}
+static inline void vecWidenValue(Vec a, Vec *lo, Vec *hi)
+{
+    *lo = _mm_unpacklo_epi8(a, _mm_setzero_si128());
+    *hi = _mm_unpackhi_epi8(a, _mm_setzero_si128());
+}
+#else
+// no SIMD, plain loops over 16 byte chunks
+#define VEC_BYTES 16
+typedef struct {
+    uint8_t b[VEC_BYTES];
+} Vec;
+#define VEC_MAP8(expr)                   \
+    Vec r;                               \
+    for (int k = 0; k < VEC_BYTES; k++)  \
+        r.b[k] = (uint8_t)(expr);        \
+    return r;
+#define VEC_MAP16(expr)                                \
+    uint16_t a16[VEC_BYTES / 2], b16[VEC_BYTES / 2];   \
+    memcpy(a16, a.b, VEC_BYTES);                       \
+    memcpy(b16, b.b, VEC_BYTES);                       \
+    for (int k = 0; k < VEC_BYTES / 2; k++)            \
+        a16[k] = (uint16_t)(expr);                     \
+    memcpy(a.b, a16, VEC_BYTES);                       \
+    return a;
+static inline Vec vecLoad(const void *p) { Vec r; memcpy(r.b, p, VEC_BYTES); return r; }
+static inline void vecStore(void *p, Vec v) { memcpy(p, v.b, VEC_BYTES); }
+static inline Vec vecSet8(uint8_t value) { VEC_MAP8(value) }
+static inline Vec vecSet16(uint16_t value) { Vec a = {{0}}, b = {{0}}; VEC_MAP16(value) }
+static inline Vec vecAnd(Vec a, Vec b) { VEC_MAP8(a.b[k] & b.b[k]) }
+static inline Vec vecOr(Vec a, Vec b) { VEC_MAP8(a.b[k] | b.b[k]) }
+static inline Vec vecXor(Vec a, Vec b) { VEC_MAP8(a.b[k] ^ b.b[k]) }
+static inline Vec vecAndNot(Vec a, Vec b) { VEC_MAP8(~a.b[k] & b.b[k]) }
+static inline Vec vecAdd8(Vec a, Vec b) { VEC_MAP8(a.b[k] + b.b[k]) }
+static inline Vec vecSub8(Vec a, Vec b) { VEC_MAP8(a.b[k] - b.b[k]) }
+static inline Vec vecMin8(Vec a, Vec b) { VEC_MAP8(a.b[k] < b.b[k] ? a.b[k] : b.b[k]) }
+static inline Vec vecEq8(Vec a, Vec b) { VEC_MAP8(a.b[k] == b.b[k] ? 0xff : 0x00) }
+static inline Vec vecShr1(Vec a) { VEC_MAP8(a.b[k] >> 1) }
+static inline Vec vecAdd16(Vec a, Vec b) { VEC_MAP16(a16[k] + b16[k]) }
+static inline Vec vecEq16(Vec a, Vec b) { VEC_MAP16(a16[k] == b16[k] ? 0xffff : 0x0000) }
+static inline uint32_t vecMoveMask(Vec a)
+{
+    uint32_t bits = 0;
+    for (int k = 0; k < VEC_BYTES; k++)
+        bits |= (uint32_t)(a.b[k] >> 7) << k;
+    return bits;
+}
+static inline Vec vecNarrowMask(Vec lo, Vec hi)
+{
+    Vec r;
+    for (int k = 0; k < VEC_BYTES / 2; k++)
+    {
+        r.b[k] = lo.b[2 * k];
+        r.b[k + VEC_BYTES / 2] = hi.b[2 * k];
+    }
+    return r;
+}
+static inline void vecWidenLanes(Vec a, Vec *lo, Vec *hi, bool mask)
+{
+    uint16_t lo16[VEC_BYTES / 2], hi16[VEC_BYTES / 2];
+    for (int k = 0; k < VEC_BYTES / 2; k++)
+    {
+        lo16[k] = mask ? (uint16_t)(int8_t)a.b[k] : a.b[k];
+        hi16[k] = mask ? (uint16_t)(int8_t)a.b[k + VEC_BYTES / 2] : a.b[k + VEC_BYTES / 2];
+    }
+    memcpy(lo->b, lo16, VEC_BYTES);
+    memcpy(hi->b, hi16, VEC_BYTES);
+}
+static inline void vecWidenMask(Vec a, Vec *lo, Vec *hi) { vecWidenLanes(a, lo, hi, true); }
+static inline void vecWidenValue(Vec a, Vec *lo, Vec *hi) { vecWidenLanes(a, lo, hi, false); }
+#endif
+
+#define LANE_CHUNKS (LOCKSTEP_LANES / VEC_BYTES)
+// lanes held in one vector of 16-bit values
+#define HALF_CHUNK (VEC_BYTES / 2)
+
+static inline Vec vecBlend(Vec old, Vec value, Vec mask)
+{
+    return vecOr(vecAnd(mask, value), vecAndNot(mask, old));
+}
+
+static inline int countLanes(uint32_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(bits);
+#else
+    int count = 0;
+    for (; bits; bits &= bits - 1)
+        count++;
+    return count;
+#endif
+}
+
+// writes value to the lanes in mask, 8-bit lanes
+static inline void storeMasked(uint8_t *lanes, Vec value, Vec mask)
+{
+    vecStore(lanes, vecBlend(vecLoad(lanes), value, mask));
+}
+
+// the same for 16-bit lanes, with mask still one byte per lane
+static inline void storeMasked16(uint16_t *lanes, Vec valueLo, Vec valueHi, Vec mask)
+{
+    Vec maskLo, maskHi;
+    vecWidenMask(mask, &maskLo, &maskHi);
+    vecStore(lanes, vecBlend(vecLoad(lanes), valueLo, maskLo));
+    vecStore(lanes + HALF_CHUNK, vecBlend(vecLoad(lanes + HALF_CHUNK), valueHi, maskHi));
+}
+
+static void loadLane(LockstepGroup *group, int lane)
+{
+    const State *state = group->states[lane];
+    for (int reg = 0; reg < 16; reg++)
+    {
+        group->registers[reg][lane] = state->registers[reg];
+    }
+    group->i[lane] = state->i;
+    group->pc[lane] = state->pc;
+    group->sp[lane] = state->sp;
+    for (int level = 0; level < 12; level++)
+    {
+        group->stack[level][lane] = state->stack[level];
+    }
+    group->delay_timer[lane] = state->delay_timer;
+    group->sound_timer[lane] = state->sound_timer;
+}
+
+static void storeLane(const LockstepGroup *group, int lane)
+{
+    State *state = group->states[lane];
+    for (int reg = 0; reg < 16; reg++)
+    {
+        state->registers[reg] = group->registers[reg][lane];
+    }
+    state->i = group->i[lane];
+    state->pc = group->pc[lane];
+    state->sp = group->sp[lane];
+    for (int level = 0; level < 12; level++)
+    {
+        state->stack[level] = group->stack[level][lane];
+    }
+    state->delay_timer = group->delay_timer[lane];
+    state->sound_timer = group->sound_timer[lane];
+}
+
+void initLockstep(LockstepGroup *group, State *states[], uint8_t *memories[], int numLanes)
+{
+    // the registers, timers and stack are taken from the States here and only
+    // written back by syncLockstep. Memory is compared once, so call this
+    // again after changing any of it
+    memset(group, 0x0, sizeof(LockstepGroup));
+    group->numLanes = numLanes;
+    group->sharedMemory = true;
+    for (int lane = 0; lane < numLanes; lane++)
+    {
+        group->states[lane] = states[lane];
+        group->memories[lane] = memories[lane];
+        loadLane(group, lane);
+        group->active[lane] = states[lane]->halted ? 0x0 : 0xff;
+        if (memcmp(memories[lane], memories[0], MEM_SIZE) != 0)
+            group->sharedMemory = false;
+    }
+    group->leader = states[0]->pc;
+}
+
+void syncLockstep(LockstepGroup *group)
+{
+    for (int lane = 0; lane < group->numLanes; lane++)
+    {
+        storeLane(group, lane);
+    }
+}
+
+void stopLane(LockstepGroup *group, int lane)
+{
+    // the lane keeps its state and cycle count, but runs and ticks no more
+    group->active[lane] = 0x0;
+}
+
+void tickLockstepTimers(LockstepGroup *group)
+{
+    // tickTimers for every lane that hasn't halted
+    PROFILE_FRAME();
+    Vec zero = vecSet8(0x0), one = vecSet8(0x1);
+    for (int c = 0; c < LANE_CHUNKS; c++)
+    {
+        Vec active = vecLoad(&group->active[c * VEC_BYTES]);
+        uint8_t *timers[] = {&group->delay_timer[c * VEC_BYTES], &group->sound_timer[c * VEC_BYTES]};
+        for (int t = 0; t < 2; t++)
+        {
+            Vec timer = vecLoad(timers[t]);
+            Vec running = vecAndNot(vecEq8(timer, zero), active);
+            vecStore(timers[t], vecSub8(timer, vecAnd(running, one)));
+        }
+    }
+}
+
+static int countActive(const LockstepGroup *group)
+{
+    int numActive = 0;
+    for (int c = 0; c < LANE_CHUNKS; c++)
+    {
+        numActive += countLanes(vecMoveMask(vecLoad(&group->active[c * VEC_BYTES])));
+    }
+    return numActive;
+}
+
+// mask gets 0xff for the active lanes whose pc is pc, returns how many there are
+static int laneMask(const LockstepGroup *group, uint16_t pc, uint8_t mask[])
+{
+    Vec target = vecSet16(pc);
+    int count = 0;
+    for (int c = 0; c < LANE_CHUNKS; c++)
+    {
+        Vec lo = vecEq16(vecLoad(&group->pc[c * VEC_BYTES]), target);
+        Vec hi = vecEq16(vecLoad(&group->pc[c * VEC_BYTES + HALF_CHUNK]), target);
+        Vec lanes = vecAnd(vecNarrowMask(lo, hi), vecLoad(&group->active[c * VEC_BYTES]));
+        vecStore(&mask[c * VEC_BYTES], lanes);
+        count += countLanes(vecMoveMask(lanes));
+    }
+    return count;
+}
+
+// the pc shared by the most active lanes
+static uint16_t electLeader(const LockstepGroup *group, int numActive)
+{
+    _Alignas(32) uint8_t mask[LOCKSTEP_LANES];
+    uint16_t leader = 0;
+    int best = 0;
+    for (int lane = 0; lane < group->numLanes && best * 2 <= numActive; lane++)
+    {
+        if (!group->active[lane])
+            continue;
+        int count = laneMask(group, group->pc[lane], mask);
+        if (count > best)
+        {
+            best = count;
+            leader = group->pc[lane];
+        }
+    }
+    return leader;
+}
+
+static bool writesMemory(uint8_t opCodeLeft, uint8_t opCodeRight)
+{
+    return (opCodeLeft >> 4) == 0xf && (opCodeRight == 0x33 || opCodeRight == 0x55);
+}
+
+// one instruction for one lane, through processOp
+static void stepLane(LockstepGroup *group, int lane, uint64_t step)
+{
+    State *state = group->states[lane];
+    uint8_t *memory = group->memories[lane];
+    uint16_t pc = group->pc[lane] & (MEM_SIZE - 1);
+    storeLane(group, lane);
+    processOp(state, memory);
+    loadLane(group, lane);
+    if (state->halted)
+    {
+        group->active[lane] = 0x0;
+        group->cycles[lane] += step;
+    }
+    else if (writesMemory(memory[pc], memory[(pc + 1) & (MEM_SIZE - 1)]))
+    {
+        // checked in bulk by the caller when every lane writes
+        group->sharedMemory = false;
+    }
+    group->scalarOps++;
+}
+
+// after every lane in mask ran Fx33/Fx55, memory is still shared if they all
+// wrote the same bytes to the same place
+static void checkSharedWrite(LockstepGroup *group, const uint8_t mask[], uint16_t length, int first)
+{
+    uint16_t address = group->i[first];
+    if (address + length > MEM_SIZE)
+        length = MEM_SIZE - address;
+    for (int lane = 0; lane < group->numLanes; lane++)
+    {
+        if (mask[lane] && group->i[lane] != address)
+        {
+            group->sharedMemory = false;
+            return;
+        }
+        if (memcmp(group->memories[lane] + address, group->memories[first] + address, length) != 0)
+        {
+            group->sharedMemory = false;
+            return;
+        }
+    }
+}
+
+// (a - b) % 0xff as processOp computes it, which sends 255 and -255 to 0
+static inline Vec subtractQuirk(Vec a, Vec b)
+{
+    Vec zero = vecSet8(0x00), ones = vecSet8(0xff);
+    Vec wraps = vecOr(vecAnd(vecEq8(a, ones), vecEq8(b, zero)), vecAnd(vecEq8(a, zero), vecEq8(b, ones)));
+    return vecAndNot(wraps, vecSub8(a, b));
+}
+
+// runs one instruction at pc across the lanes in mask, returns false if it
+// isn't one we can do that for
+static bool stepLockstep(LockstepGroup *group, const uint8_t mask[], uint16_t pc, uint8_t opCodeLeft, uint8_t opCodeRight)
+{
+    uint8_t x = opCodeLeft & 0xf, y = opCodeRight >> 4, n = opCodeRight & 0xf, nn = opCodeRight;
+    uint16_t nnn = (x << 8) | nn;
+    Vec one = vecSet8(0x1), ones = vecSet8(0xff);
+    // lanes that skip the next instruction
+    _Alignas(32) uint8_t skip[LOCKSTEP_LANES] = {0};
+    // where the pc goes if it doesn't just move on
+    bool jumps = false;
+    uint16_t target = 0;
+    bool fromV0 = false;
+    switch (opCodeLeft >> 4)
+    {
+    case (0x1):
+        jumps = true;
+        target = nnn;
+        break;
+    case (0x0):
+        // 00E0 needs the display
+        if (opCodeLeft != 0x00 || opCodeRight != 0xee)
+            return false;
+        for (int lane = 0; lane < group->numLanes; lane++)
+        {
+            if (mask[lane])
+            {
+                group->sp[lane] -= 1;
+                group->pc[lane] = group->stack[group->sp[lane]][lane];
+            }
+        }
+        return true;
+    case (0x2):
+        // the stacks can be at different depths, so lane by lane
+        for (int lane = 0; lane < group->numLanes; lane++)
+        {
+            if (mask[lane])
+            {
+                group->stack[group->sp[lane]][lane] = pc + 2;
+                group->sp[lane] += 1;
+            }
+        }
+        jumps = true;
+        target = nnn;
+        break;
+    case (0x3):
+    case (0x4):
+    case (0x5):
+    case (0x9):
+        // processOp ignores the low nibble of 5XYn and 9XYn, and so do we
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            Vec vx = vecLoad(&group->registers[x][c * VEC_BYTES]);
+            Vec other = (opCodeLeft >> 4 == 0x3 || opCodeLeft >> 4 == 0x4) ? vecSet8(nn) : vecLoad(&group->registers[y][c * VEC_BYTES]);
+            Vec equal = vecEq8(vx, other);
+            if (opCodeLeft >> 4 == 0x4 || opCodeLeft >> 4 == 0x9)
+                equal = vecXor(equal, ones);
+            vecStore(&skip[c * VEC_BYTES], equal);
+        }
+        break;
+    case (0x6):
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            storeMasked(&group->registers[x][c * VEC_BYTES], vecSet8(nn), vecLoad(&mask[c * VEC_BYTES]));
+        }
+        break;
+    case (0x7):
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            uint8_t *vx = &group->registers[x][c * VEC_BYTES];
+            storeMasked(vx, vecAdd8(vecLoad(vx), vecSet8(nn)), vecLoad(&mask[c * VEC_BYTES]));
+        }
+        break;
+    case (0x8):
+        if (n > 0x7 && n != 0xe)
+            return false;
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            Vec m = vecLoad(&mask[c * VEC_BYTES]);
+            uint8_t *rx = &group->registers[x][c * VEC_BYTES];
+            uint8_t *rf = &group->registers[0xf][c * VEC_BYTES];
+            Vec vx = vecLoad(rx);
+            Vec vy = vecLoad(&group->registers[y][c * VEC_BYTES]);
+            // VF is written after Vx, except for 8XY6, same as processOp
+            switch (n)
+            {
+            case (0x0):
+                storeMasked(rx, vy, m);
+                break;
+            case (0x1):
+                storeMasked(rx, vecOr(vx, vy), m);
+                break;
+            case (0x2):
+                storeMasked(rx, vecAnd(vx, vy), m);
+                break;
+            case (0x3):
+                storeMasked(rx, vecXor(vx, vy), m);
+                break;
+            case (0x4):
+            {
+                Vec sum = vecAdd8(vx, vy);
+                // carried if the sum wrapped round below vx
+                Vec carry = vecAndNot(vecEq8(vecMin8(sum, vx), vx), one);
+                storeMasked(rx, sum, m);
+                storeMasked(rf, carry, m);
+            }
+            break;
+            case (0x5):
+            {
+                Vec noBorrow = vecAnd(vecEq8(vecMin8(vx, vy), vy), one);
+                storeMasked(rx, subtractQuirk(vx, vy), m);
+                storeMasked(rf, noBorrow, m);
+            }
+            break;
+            case (0x6):
+                storeMasked(rf, vecAnd(vx, one), m);
+                storeMasked(rx, vecShr1(vecLoad(rx)), m);
+                break;
+            case (0x7):
+            {
+                Vec noBorrow = vecAnd(vecEq8(vecMin8(vx, vy), vx), one);
+                storeMasked(rx, subtractQuirk(vy, vx), m);
+                storeMasked(rf, noBorrow, m);
+            }
+            break;
+            case (0xe):
+            {
+                Vec high = vecSet8(0x80);
+                storeMasked(rx, vecAdd8(vx, vx), m);
+                storeMasked(rf, vecAnd(vecEq8(vecAnd(vx, high), high), one), m);
+            }
+            break;
+            }
+        }
+        break;
+    case (0xa):
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            Vec value = vecSet16(nnn);
+            storeMasked16(&group->i[c * VEC_BYTES], value, value, vecLoad(&mask[c * VEC_BYTES]));
+        }
+        break;
+    case (0xb):
+        jumps = true;
+        fromV0 = true;
+        target = nnn;
+        break;
+    case (0xf):
+        for (int c = 0; c < LANE_CHUNKS; c++)
+        {
+            Vec m = vecLoad(&mask[c * VEC_BYTES]);
+            uint8_t *rx = &group->registers[x][c * VEC_BYTES];
+            switch (opCodeRight)
+            {
+            case (0x07):
+                storeMasked(rx, vecLoad(&group->delay_timer[c * VEC_BYTES]), m);
+                break;
+            case (0x15):
+                storeMasked(&group->delay_timer[c * VEC_BYTES], vecLoad(rx), m);
+                break;
+            case (0x18):
+                storeMasked(&group->sound_timer[c * VEC_BYTES], vecLoad(rx), m);
+                break;
+            case (0x1e):
+            {
+                Vec lo, hi;
+                uint16_t *i = &group->i[c * VEC_BYTES];
+                vecWidenValue(vecLoad(rx), &lo, &hi);
+                storeMasked16(i, vecAdd16(vecLoad(i), lo), vecAdd16(vecLoad(i + HALF_CHUNK), hi), m);
+            }
+            break;
+            case (0x29):
+            {
+                // the register index rather than its value, same as setIToSprite
+                Vec value = vecSet16(x * 5);
+                storeMasked16(&group->i[c * VEC_BYTES], value, value, m);
+            }
+            break;
+            default:
+                return false;
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+
+    // every lane in mask started at pc, so they move on or jump together
+    for (int c = 0; c < LANE_CHUNKS; c++)
+    {
+        Vec m = vecLoad(&mask[c * VEC_BYTES]);
+        Vec lo, hi;
+        if (fromV0)
+        {
+            vecWidenValue(vecLoad(&group->registers[0x0][c * VEC_BYTES]), &lo, &hi);
+            lo = vecAdd16(lo, vecSet16(target));
+            hi = vecAdd16(hi, vecSet16(target));
+        }
+        else if (jumps)
+        {
+            lo = hi = vecSet16(target);
+        }
+        else
+        {
+            Vec skipLo, skipHi;
+            vecWidenMask(vecLoad(&skip[c * VEC_BYTES]), &skipLo, &skipHi);
+            lo = vecAdd16(vecSet16(pc + 2), vecAnd(skipLo, vecSet16(2)));
+            hi = vecAdd16(vecSet16(pc + 2), vecAnd(skipHi, vecSet16(2)));
+        }
+        storeMasked16(&group->pc[c * VEC_BYTES], lo, hi, m);
+    }
+    return true;
+}
+
+uint64_t runLockstep(LockstepGroup *group, uint32_t numOps)
+{
+    // every lane that hasn't halted runs numOps instructions, returns the
+    // total across lanes
+    int numActive = countActive(group);
+    _Alignas(32) uint8_t mask[LOCKSTEP_LANES];
+    uint64_t executed = 0;
+    uint32_t step = 0;
+    uint32_t lastElection = 0;
+    uint16_t leader = group->leader;
+    for (; step < numOps && numActive > 0; step++)
+    {
+        int inStep = laneMask(group, leader, mask);
+        // when the leader loses most of its lanes, look for a bigger group,
+        // but not every step if the lanes are scattered
+        if (inStep == 0 || (inStep * 2 < numActive && step - lastElection >= 16))
+        {
+            leader = electLeader(group, numActive);
+            lastElection = step;
+            inStep = laneMask(group, leader, mask);
+        }
+        int first = 0;
+        while (!mask[first])
+            first++;
+        // BNNN can take the pc past the end of memory, the fetch wraps like processOp's
+        uint16_t fetch = leader & (MEM_SIZE - 1), fetchNext = (leader + 1) & (MEM_SIZE - 1);
+        uint8_t opCodeLeft = group->memories[first][fetch];
+        uint8_t opCodeRight = group->memories[first][fetchNext];
+        if (!group->sharedMemory)
+        {
+            // same pc, but not necessarily the same instruction
+            for (int lane = first + 1; lane < group->numLanes; lane++)
+            {
+                if (mask[lane] && (group->memories[lane][fetch] != opCodeLeft || group->memories[lane][fetchNext] != opCodeRight))
+                {
+                    mask[lane] = 0x0;
+                    inStep--;
+                }
+            }
+        }
+
+        // the stragglers first, one at a time
+        if (inStep != numActive)
+        {
+            for (int lane = 0; lane < group->numLanes; lane++)
+            {
+                if (group->active[lane] && !mask[lane])
+                    stepLane(group, lane, step);
+            }
+        }
+        if (inStep > 1 && stepLockstep(group, mask, leader, opCodeLeft, opCodeRight))
+        {
+            group->lockstepOps += inStep;
+            PROFILE_OPS(leader, (opCodeLeft << 8) | opCodeRight, inStep);
+        }
+        else
+        {
+            bool shared = group->sharedMemory;
+            for (int lane = 0; lane < group->numLanes; lane++)
+            {
+                if (mask[lane])
+                    stepLane(group, lane, step);
+            }
+            // all of them wrote memory, which may still match
+            if (shared && inStep == numActive && writesMemory(opCodeLeft, opCodeRight))
+            {
+                group->sharedMemory = true;
+                checkSharedWrite(group, mask, opCodeRight == 0x33 ? 3 : (opCodeLeft & 0xf) + 1, first);
+            }
+        }
+        numActive = countActive(group);
+        executed += numActive;
+        if (group->active[first])
+            leader = group->pc[first];
+    }
+
+    for (int lane = 0; lane < group->numLanes; lane++)
+    {
+        if (group->active[lane])
+            group->cycles[lane] += step;
+    }
+    group->leader = leader;
+    return executed;
+}
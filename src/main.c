@@ -1,20 +1,180 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <SDL2/SDL.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
-#include "mylib.h"
+#include "frontend.h"
+
+// everything the emulation thread works on, and the controls the main thread
+// drives it with. Until the thread is joined, only it touches the VM
+typedef struct {
+    State *state;
+    uint8_t *memory;
+    Engine *engine;
+    // NULL if there wasn't enough memory for it
+    Rewind *rewind;
+    Beeper *beeper;
+    TripleBuffer *display;
+    uint32_t clockSpeed;
+    uint32_t presentInterval;
+    const char *saveFilename;
+    // set by the main thread once per frame: the keys held, one bit per key
+    atomic_uint keys;
+    atomic_bool quit;
+    atomic_bool fastForward;
+    atomic_bool rewinding;
+    // bumped once per F5 press, a checkpoint is saved each time it changes
+    atomic_uint checkpoints;
+    // set by the emulation thread when it stops, on a quit or an unknown opcode
+    atomic_bool finished;
+} Emulation;
+
+static int runEmulation(void *data)
+{
+    Emulation *emulation = data;
+    State *state = emulation->state;
+    FrameClock frameClock;
+    initFrameClock(&frameClock);
+    bool wasFastForwarding = false;
+    unsigned checkpointsSaved = 0;
+    uint32_t lastSnapshot = 0;
+    uint64_t frameCount = 0;
+    while (!atomic_load_explicit(&emulation->quit, memory_order_acquire))
+    {
+        state->keys = atomic_load_explicit(&emulation->keys, memory_order_relaxed);
+        bool fastForward = atomic_load_explicit(&emulation->fastForward, memory_order_relaxed);
+        bool rewinding = emulation->rewind != NULL && atomic_load_explicit(&emulation->rewinding, memory_order_relaxed);
+        unsigned checkpoints = atomic_load_explicit(&emulation->checkpoints, memory_order_relaxed);
+        if (emulation->saveFilename != NULL && checkpoints != checkpointsSaved)
+        {
+            if (saveState(emulation->saveFilename, state, emulation->memory))
+                SDL_Log("Saved to %s", emulation->saveFilename);
+            else
+                SDL_Log("Could not save to %s", emulation->saveFilename);
+            checkpointsSaved = checkpoints;
+        }
+
+        if (rewinding)
+        {
+            // memory comes back too, so anything decoded from it is stale
+            if (stepBackRewind(emulation->rewind, state, emulation->memory))
+                invalidateEngine(emulation->engine, 0, MEM_SIZE);
+        }
+        else
+        {
+            runEngine(emulation->engine, state, emulation->memory, cyclesInFrame(emulation->clockSpeed, frameCount++));
+            if (state->halted)
+            {
+                // we could do a bit more like dumping the state/memory
+                SDL_Log("Unknown/unimplemented opcode %04x at %03x", state->badOpcode, state->pc);
+                break;
+            }
+            if (state->quit)
+            {
+                SDL_Log("The ROM exited (00FD) at %03x", state->pc);
+                break;
+            }
+            tickTimers(state);
+            // fast forwarding, one snapshot per present is plenty
+            if (emulation->rewind != NULL && (!fastForward || SDL_GetTicks() - lastSnapshot >= emulation->presentInterval))
+            {
+                pushRewind(emulation->rewind, state, emulation->memory);
+                lastSnapshot = SDL_GetTicks();
+            }
+        }
+        // silent while rewinding, the sound timer of a past frame isn't a beep
+        setBeeper(emulation->beeper, !rewinding && state->sound_timer > 0);
+        if (state->draw)
+        {
+            Frame *frame = backFrame(emulation->display);
+            memcpy(frame->pixels, state->pixels, sizeof(state->pixels));
+            frame->hires = state->hires;
+            publishFrame(emulation->display);
+            state->draw = false;
+        }
+
+        if (fastForward)
+        {
+            wasFastForwarding = true;
+            continue;
+        }
+        if (wasFastForwarding)
+        {
+            resetFrameClock(&frameClock);
+            wasFastForwarding = false;
+        }
+        waitForNextFrame(&frameClock);
+    }
+    atomic_store_explicit(&emulation->finished, true, memory_order_release);
+    return 0;
+}
+
+static void showLatestFrame(SDL_Renderer *renderer, SDL_Texture *texture, TripleBuffer *display, State *screen, uint32_t pixels[], int scale)
+{
+    // frames arrive whole, so the rows to upload are the ones that differ from what's on screen
+    const Frame *frame = latestFrame(display);
+    if (frame != NULL)
+    {
+        // a change of mode redraws everything
+        if (frame->hires != screen->hires)
+        {
+            screen->hires = frame->hires;
+            screen->dirtyRows = ALL_ROWS_DIRTY;
+        }
+        for (int row = 0; row < displayHeight(screen); row++)
+        {
+            for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+            {
+                if (memcmp(frame->pixels[plane][row], screen->pixels[plane][row], sizeof(screen->pixels[plane][row])) != 0)
+                {
+                    memcpy(screen->pixels[plane][row], frame->pixels[plane][row], sizeof(screen->pixels[plane][row]));
+                    screen->dirtyRows |= 1ull << row;
+                }
+            }
+        }
+    }
+    if (screen->dirtyRows)
+        updateScreen2(renderer, texture, screen, pixels, scale);
+}
 
 int main(int argc, char *argv[])
 {
     int scale = 1;
-    char *romFilename;
+    char *romFilename = NULL;
+    char *saveFilename = NULL;
+    char *loadFilename = NULL;
+    char *traceFilename = NULL;
     int clockSpeed = 500;
+    EngineKind engineKind = ENGINE_CACHED;
+    bool turbo = false;
+    uint64_t seed = 0;
+    static const struct option longOptions[] = {
+        {"save", required_argument, NULL, 'S'},
+        {"load", required_argument, NULL, 'L'},
+        {"trace", required_argument, NULL, 'T'},
+        {"seed", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
     int c;
-    while ((c = getopt(argc, argv, "s:r:c:")) != -1)
+    while ((c = getopt_long(argc, argv, "s:r:c:e:t", longOptions, NULL)) != -1)
     {
         switch (c)
         {
+        case 'S':
+            saveFilename = optarg;
+            break;
+        case 'L':
+            loadFilename = optarg;
+            break;
+        case 'T':
+            traceFilename = optarg;
+            break;
+        case 'R':
+            seed = strtoull(optarg, NULL, 0);
+            break;
         case 's':
             scale = atoi(optarg);
             break;
@@ -24,21 +184,50 @@ int main(int argc, char *argv[])
         case 'c':
             clockSpeed = atoi(optarg);
             break;
+        case 'e':
+            if (!parseEngineKind(optarg, &engineKind))
+            {
+                fprintf(stderr, "Unknown engine %s, expected one of switch, cached, threaded, jit or aot", optarg);
+                return 1;
+            }
+            if (engineKind == ENGINE_AOT)
+            {
+                fprintf(stderr, "The aot engine needs a ROM compiled in with chip8_aot_executable\n");
+                return 1;
+            }
+            break;
+        case 't':
+            turbo = true;
+            break;
         case '?':
-            fprintf(stderr, "Scale (-s) requires an integer > 0, clock speend (-c) too, and ROM (-r) a path to the ROM");
+            fprintf(stderr, "Scale (-s) requires an integer > 0, clock speend (-c) too, ROM (-r) a path to the ROM and engine (-e) one of switch, cached, threaded, jit or aot");
             return 1;
         default:
             abort();
         }
     }
+    if (romFilename == NULL && loadFilename == NULL)
+    {
+        fprintf(stderr, "A ROM (-r) or a save state to resume from (--load) is required\n");
+        return 1;
+    }
+    if (scale < 1)
+    {
+        fprintf(stderr, "Scale (-s) requires an integer > 0\n");
+        return 1;
+    }
 
     SDL_Init(SDL_INIT_EVERYTHING);
 
+    // -s is the size of a lo-res pixel, and hi-res ones are half that: odd
+    // scales round up so they stay whole
+    int hiresScale = (scale + 1) / 2;
     SDL_Window *window = SDL_CreateWindow("CHIP8 Display",
-                                          SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH * scale, SCREEN_HEIGHT * scale, SDL_WINDOW_RESIZABLE);
+                                          SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, HIRES_WIDTH * hiresScale, HIRES_HEIGHT * hiresScale, SDL_WINDOW_RESIZABLE);
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, SCREEN_WIDTH, SCREEN_HEIGHT);
-    SDL_RenderSetScale(renderer, SCALE, scale);
+    // the texture is the window's size, we scale up ourselves - see upscaleRows
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, HIRES_WIDTH * hiresScale, HIRES_HEIGHT * hiresScale);
+    PROFILE_START();
 
     // VM init
     uint8_t memory[MEM_SIZE];
@@ -50,66 +239,159 @@ int main(int argc, char *argv[])
     }
     // load up the sprites
     copySpritesToMemory(memory);
-    State state = {.draw = false, .pc = ROM_OFFSET};
-    // this is where our *actual* pixels will be stored
-    uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
-    SDL_Log("ROM filename: %s", romFilename);
-    loadROM(romFilename, memory);
-
-    const uint8_t *keyStates = SDL_GetKeyboardState(NULL);
-    // 60Hz, in milliseconds
-    float timerDelta = 1 / 60.0 * 1000;
-    float accumulator = 0.0;
-    uint32_t currTick = SDL_GetTicks();
-    uint32_t newTick, elapsedTicks, numCycles;
-    uint32_t totalCycles = 0;
-    float timePerCycle;
-    while (!state.quit)
+    // everything dirty so the first present uploads a blank screen
+    State state = {.draw = false, .pc = ROM_OFFSET, .dirtyRows = ALL_ROWS_DIRTY};
+    // this is where our *actual* pixels will be stored, scaled up to the window
+    uint32_t *pixels = malloc((size_t)HIRES_WIDTH * HIRES_HEIGHT * hiresScale * hiresScale * sizeof(uint32_t));
+    if (pixels == NULL)
+    {
+        SDL_Log("Not enough memory for a %dx%d window", HIRES_WIDTH * hiresScale, HIRES_HEIGHT * hiresScale);
+        return 1;
+    }
+    if (loadFilename != NULL)
     {
-        newTick = SDL_GetTicks();
-        elapsedTicks = newTick - currTick;
-        numCycles = elapsedTicks / 1000 * clockSpeed;
-        totalCycles += numCycles;
-        if (numCycles > 0)
+        // the save has all of memory, so there's no ROM to load
+        if (!loadState(loadFilename, &state, memory))
         {
-            currTick = newTick;
-            timePerCycle = elapsedTicks / numCycles;
-            while (numCycles > 1)
-            {
+            SDL_Log("Could not load a version %d save state from %s", SAVE_STATE_VERSION, loadFilename);
+            return 1;
+        }
+        SDL_Log("Resuming from %s at %03x", loadFilename, state.pc);
+    }
+    else
+    {
+        SDL_Log("ROM filename: %s", romFilename);
+        int bytesRead = loadROM(romFilename, memory);
+        if (bytesRead < 0)
+        {
+            SDL_Log("Could not open %s", romFilename);
+            return 1;
+        }
+        SDL_Log("Read %d bytes from %s", bytesRead, romFilename);
+        // a save state carries on with its own generator
+        seedRandom(&state, seed);
+        int numOpcodesToPrint = 8;
+        SDL_Log("The first %d opcodes are:", numOpcodesToPrint);
+        for (int i = 0; i < numOpcodesToPrint; i++)
+        {
+            SDL_Log("Opcode at %0x: %0x%0x", i * 2, memory[ROM_OFFSET + i * 2], memory[ROM_OFFSET + i * 2 + 1]);
+        }
+    }
+    // decoded instructions are cached per address, so this has to happen after the ROM is in memory
+    Engine engine;
+    initEngine(&engine, engineKind);
+    SDL_Log("Engine: %s", engineKindName(engine.kind));
+    // every instruction goes through processOp while tracing, whatever the engine
+    if (traceFilename != NULL)
+    {
+        engine.trace = openTrace(traceFilename, 1 << 20);
+        if (engine.trace == NULL)
+            SDL_Log("Could not open %s, not tracing", traceFilename);
+    }
 
-                SDL_PumpEvents(); // this is needed to populate the keyboard state array
-                processInput(&state, keyStates);
-                processOp(&state, memory);
-                accumulator += timePerCycle;
-                if (keyStates[SDL_SCANCODE_SPACE])
-                {
-                    SDL_Log("Backspace pressed, will exit");
-                    state.quit = true;
-                    break;
-                }
-                if (state.draw)
-                {
-                    updateScreen2(renderer, texture, state.pixels, pixels);
-                    state.draw = false;
-                }
-                while (accumulator > timerDelta)
-                {
-                    if (state.delay_timer > 0)
-                        state.delay_timer--;
-                    if (state.sound_timer > 0)
-                        //TODO: play audio!
-                        state.sound_timer--;
-                    accumulator -= timerDelta;
-                }
-                numCycles--;
-                SDL_Delay(timePerCycle);
-            }
+    // the main thread polls input and presents at the display's refresh
+    // rate, the emulation thread runs the VM - see runEmulation
+    SDL_DisplayMode displayMode;
+    int refreshRate = 60;
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &displayMode) == 0 && displayMode.refresh_rate > 0)
+    {
+        refreshRate = displayMode.refresh_rate;
+    }
+    uint32_t presentInterval = 1000 / refreshRate;
+
+    // a snapshot every frame, an hour of them fits in 8MB for most ROMs.
+    // Hold backspace to go back through them
+    Rewind rewind;
+    bool haveRewind = initRewind(&rewind, 8 << 20, 60 * 60 * FRAMES_PER_SECOND);
+    if (!haveRewind)
+        SDL_Log("Not enough memory for rewind");
+    Beeper beeper;
+    if (!openBeeper(&beeper))
+        SDL_Log("No audio: %s", SDL_GetError());
+    TripleBuffer display;
+    initTripleBuffer(&display);
+    Emulation emulation = {
+        .state = &state,
+        .memory = memory,
+        .engine = &engine,
+        .rewind = haveRewind ? &rewind : NULL,
+        .beeper = &beeper,
+        .display = &display,
+        // every 60Hz frame runs its share of clockSpeed instructions then ticks the timers
+        .clockSpeed = clockSpeed,
+        .presentInterval = presentInterval,
+        .saveFilename = saveFilename,
+    };
+    atomic_init(&emulation.keys, 0);
+    atomic_init(&emulation.quit, false);
+    atomic_init(&emulation.fastForward, turbo);
+    atomic_init(&emulation.rewinding, false);
+    atomic_init(&emulation.checkpoints, 0);
+    atomic_init(&emulation.finished, false);
+    SDL_Thread *emulationThread = SDL_CreateThread(runEmulation, "emulation", &emulation);
+    if (emulationThread == NULL)
+    {
+        SDL_Log("Could not start the emulation thread: %s", SDL_GetError());
+        return 1;
+    }
+
+    Keyboard keyboard;
+    initKeyboard(&keyboard);
+    // what's on screen, everything dirty so the first present uploads a blank screen
+    State screen = {.dirtyRows = ALL_ROWS_DIRTY};
+    while (!atomic_load_explicit(&emulation.finished, memory_order_acquire))
+    {
+        uint32_t start = SDL_GetTicks();
+        // the input for this frame, whatever has queued up since the last one
+        pollKeyboard(&keyboard);
+        if (keyboard.quit)
+        {
+            SDL_Log("Quit pressed, will exit");
+            break;
         }
+        atomic_store_explicit(&emulation.keys, keyboard.keys, memory_order_relaxed);
+        // -t, or hold tab to fast forward: frames run back to back, the
+        // presents stay at the display's refresh rate
+        atomic_store_explicit(&emulation.fastForward, turbo || keyboard.fastForward, memory_order_relaxed);
+        atomic_store_explicit(&emulation.rewinding, keyboard.rewinding, memory_order_relaxed);
+        // F5 writes a checkpoint to the --save file, once per press
+        if (keyboard.checkpoints > 0)
+            atomic_fetch_add_explicit(&emulation.checkpoints, 1, memory_order_relaxed);
+        keyboard.checkpoints = 0;
+
+        showLatestFrame(renderer, texture, &display, &screen, pixels, hiresScale);
+        uint32_t elapsed = SDL_GetTicks() - start;
+        if (elapsed < presentInterval)
+            SDL_Delay(presentInterval - elapsed);
     }
+    atomic_store_explicit(&emulation.quit, true, memory_order_release);
+    SDL_WaitThread(emulationThread, NULL);
+    // whatever the emulation got to before it stopped
+    showLatestFrame(renderer, texture, &display, &screen, pixels, hiresScale);
+
+    if (saveFilename != NULL)
+    {
+        if (saveState(saveFilename, &state, memory))
+            SDL_Log("Saved to %s", saveFilename);
+        else
+            SDL_Log("Could not save to %s", saveFilename);
+    }
+    setBeeper(&beeper, false);
     // bit of a delay so we get the see the screen before it closes
     SDL_Delay(2000);
+    closeBeeper(&beeper);
 
+    if (haveRewind)
+        freeRewind(&rewind);
+    if (engine.trace != NULL)
+    {
+        SDL_Log("Trace buffer filled up %zu times", traceStalls(engine.trace));
+        if (!closeTrace(engine.trace))
+            SDL_Log("Could not write the whole trace to %s", traceFilename);
+    }
+    freeEngine(&engine);
+    free(pixels);
     SDL_Quit();
 
-    return 0;
-}
\ No newline at end of file
+    return state.halted ? 1 : 0;
+}
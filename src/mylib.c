@@ -1,27 +1,35 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "mylib.h"
 
-void fillScreen(uint32_t pixels[], uint32_t pixel)
-{
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
-    {
-        pixels[i] = pixel;
-    }
-}
-
-void loadROM(char *fileName, uint8_t memory[])
+int loadROM(const char *fileName, uint8_t memory[])
 {
+    // returns the number of bytes read, or -1 if the file can't be opened
     FILE *fp;
     fp = fopen(fileName, "rb");
+    if (fp == NULL)
+        return -1;
     int bytesRead = fread(memory + ROM_OFFSET, sizeof(uint8_t), MAX_ROM_SIZE, fp);
-    SDL_Log("Read %d bytes from %s", bytesRead, fileName);
-    int numOpcodesToPrint = 8;
-    SDL_Log("The first %d opcodes are:", numOpcodesToPrint);
-    for (int i = 0; i < numOpcodesToPrint; i++)
-    {
-        SDL_Log("Opcode at %0x: %0x%0x", i * 2, memory[ROM_OFFSET + i * 2], memory[ROM_OFFSET + i * 2 + 1]);
-    }
+    fclose(fp);
+    return bytesRead;
+}
+void tickTimers(State *state)
+{
+    // called at 60Hz
+    PROFILE_FRAME();
+    if (state->delay_timer > 0)
+        state->delay_timer--;
+    if (state->sound_timer > 0)
+        state->sound_timer--;
+}
+uint32_t cyclesInFrame(uint32_t clockSpeed, uint64_t frame)
+{
+    // clockSpeed/60 instructions per frame with the remainder carried over,
+    // so any 60 frames in a row run exactly clockSpeed of them
+    return (frame + 1) * clockSpeed / 60 - frame * clockSpeed / 60;
 }
 void copySpritesToMemory(uint8_t memory[])
 {
@@ -43,17 +51,45 @@ void copySpritesToMemory(uint8_t memory[])
         0xf0, 0x80, 0xf0, 0x80, 0xf0, // e
         0xf0, 0x80, 0xf0, 0x80, 0x80, // f
     };
+    // SUPER-CHIP only has 0-9, a-f are the ones XO-CHIP added
+    uint8_t bigSprites[] = {
+        0x3c, 0x7e, 0xe7, 0xc3, 0xc3, 0xc3, 0xc3, 0xe7, 0x7e, 0x3c, // 0
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3c, // 1
+        0x3e, 0x7f, 0xc3, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xff, 0xff, // 2
+        0x3c, 0x7e, 0xc3, 0x03, 0x0e, 0x0e, 0x03, 0xc3, 0x7e, 0x3c, // 3
+        0x06, 0x0e, 0x1e, 0x36, 0x66, 0xc6, 0xff, 0xff, 0x06, 0x06, // 4
+        0xff, 0xff, 0xc0, 0xc0, 0xfc, 0xfe, 0x03, 0xc3, 0x7e, 0x3c, // 5
+        0x3e, 0x7c, 0xe0, 0xc0, 0xfc, 0xfe, 0xc3, 0xc3, 0x7e, 0x3c, // 6
+        0xff, 0xff, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+        0x3c, 0x7e, 0xc3, 0xc3, 0x7e, 0x7e, 0xc3, 0xc3, 0x7e, 0x3c, // 8
+        0x3c, 0x7e, 0xc3, 0xc3, 0x7f, 0x3f, 0x03, 0x03, 0x3e, 0x7c, // 9
+        0x7e, 0xff, 0xc3, 0xc3, 0xc3, 0xff, 0xff, 0xc3, 0xc3, 0xc3, // a
+        0xfc, 0xfc, 0xc3, 0xc3, 0xfc, 0xfc, 0xc3, 0xc3, 0xfc, 0xfc, // b
+        0x3c, 0xff, 0xc3, 0xc0, 0xc0, 0xc0, 0xc0, 0xc3, 0xff, 0x3c, // c
+        0xfc, 0xfe, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xfe, 0xfc, // d
+        0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, // e
+        0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0xc0, 0xc0, 0xc0, 0xc0, // f
+    };
 
     memcpy(memory + SPRITES_OFFSET, sprites, sizeof(sprites));
+    memcpy(memory + BIG_SPRITES_OFFSET, bigSprites, sizeof(bigSprites));
+}
+// the planes FN01 picked, see State
+static inline uint8_t selectedPlanes(const State *state)
+{
+    return state->planes ^ 0x1;
 }
 void clearDisplay(State *state, uint8_t memory[])
 {
+    // only the selected planes are cleared
     memset(memory + MEM_DISPLAY_START, 0, 256 * sizeof(uint8_t));
     state->draw = true;
-    for (int i=0;i<SCREEN_WIDTH*SCREEN_HEIGHT;i++)
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
     {
-        state->pixels[i] = false;
+        if ((selectedPlanes(state) >> plane) & 0x1)
+            memset(state->pixels[plane], 0, sizeof(state->pixels[plane]));
     }
+    state->dirtyRows = ALL_ROWS_DIRTY;
     state->pc += 2;
 }
 void jumpToAddress(State *state, uint8_t opCodeB, uint8_t opCodeRight)
@@ -161,19 +197,18 @@ void subtractRightFromLeft(State *state, uint8_t reg1, uint8_t reg2)
 }
 void jumpIfKeyPressed(State *state, uint8_t reg)
 {
-    state->pc += state->input[state->registers[reg]] ? 4 : 2;
+    state->pc += (state->keys >> (state->registers[reg] & 0xf)) & 0x1 ? 4 : 2;
 }
 void jumpIfKeyNotPressed(State *state, uint8_t reg)
 {
-    state->pc += state->input[state->registers[reg]] ? 2 : 4;
+    state->pc += (state->keys >> (state->registers[reg] & 0xf)) & 0x1 ? 2 : 4;
 }
 void waitForKey(State *state, uint8_t reg)
 {
     for (int key = 0; key < 16; key++)
     {
-        if (state->input[key])
+        if ((state->keys >> key) & 0x1)
         {
-            SDL_Log("noticed key %d pressed", key);
             state->registers[reg] = key;
             state->pc += 2;
             break;
@@ -212,9 +247,42 @@ void loadRegisters(State *state, uint8_t reg, uint8_t memory[])
     }
     state->pc += 2;
 }
+void seedRandom(State *state, uint64_t seed)
+{
+    // splitmix64 spreads the seed over the generator state, so small or
+    // similar seeds still give unrelated sequences and never all zeros
+    for (int word = 0; word < 4; word += 2)
+    {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        state->rng[word] = z & 0xffffffff;
+        state->rng[word + 1] = z >> 32;
+    }
+}
+static inline uint32_t rotateLeft32(uint32_t value, int shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
 void getRandomNumber(State *state, uint8_t reg, uint8_t mask)
 {
-    state->registers[reg] = rand() % 256 & mask;
+    // each VM has its own xoshiro128** generator, so VMs don't share rand()'s
+    // hidden state and a run is reproducible from its seed
+    uint32_t *s = state->rng;
+    // a zeroed State hasn't been seeded, xoshiro would give zeros forever
+    if ((s[0] | s[1] | s[2] | s[3]) == 0)
+        seedRandom(state, 0);
+    uint32_t result = rotateLeft32(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotateLeft32(s[3], 11);
+    // the top bits are the best ones
+    state->registers[reg] = (result >> 24) & mask;
     state->pc += 2;
 }
 void setIToSprite(State *state, uint8_t reg)
@@ -225,17 +293,43 @@ void setIToSprite(State *state, uint8_t reg)
 }
 void setPixels2(State *state, uint8_t xReg, uint8_t yReg, uint8_t height, uint8_t memory[])
 {
-    state->registers[0xf] = 0;
-    for (int h=0; h<height;h++) {
-        uint8_t y = (state->registers[yReg] + h) % SCREEN_HEIGHT;
-        uint8_t sprite = memory[state->i+h];
-        for (int shift=7;shift>=0;shift--) {
-            uint8_t x = (state->registers[xReg] + 7-shift) % SCREEN_WIDTH;
-            uint8_t bit = (sprite >> shift) & 0x1;
-            state->registers[0xf] |= state->pixels[x+y*SCREEN_WIDTH] & bit;
-            state->pixels[x+y*SCREEN_WIDTH] ^= bit; 
+    int width = displayWidth(state), screenHeight = displayHeight(state), words = width / 64;
+    int x = state->registers[xReg] % width;
+    uint8_t yStart = state->registers[yReg];
+    // Dxy0 draws a 16x16 sprite, two bytes a row. With both planes selected
+    // the second plane's rows follow the first's
+    int rows = height ? height : 16, rowBytes = height ? 1 : 2;
+    int word = x / 64, shift = x % 64, nextWord = (word + 1) % words;
+    uint16_t address = state->i;
+    uint64_t collisions = 0;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        if (!((selectedPlanes(state) >> plane) & 0x1))
+            continue;
+        for (int h = 0; h < rows; h++)
+        {
+            int y = (yStart + h) % screenHeight;
+            // the sprite's leftmost pixel is the row's most significant bit
+            uint64_t sprite = (uint64_t)memory[address % MEM_SIZE] << 56;
+            if (rowBytes == 2)
+                sprite |= (uint64_t)memory[(address + 1) % MEM_SIZE] << 48;
+            address += rowBytes;
+            // whatever goes past the end of the word carries on in the next
+            // one, which in lo-res is the same word: a rotate, wrapping the
+            // sprite round the edge of the screen
+            uint64_t *row = state->pixels[plane][y];
+            uint64_t first = sprite >> shift;
+            uint64_t spill = shift ? sprite << (64 - shift) : 0;
+            collisions |= row[word] & first;
+            row[word] ^= first;
+            collisions |= row[nextWord] & spill;
+            row[nextWord] ^= spill;
+            // xor with anything but 0 changes the row
+            if (sprite)
+                state->dirtyRows |= 1ull << y;
         }
     }
+    state->registers[0xf] = collisions != 0;
     state->draw = true;
     state->pc += 2;
 }
@@ -265,6 +359,113 @@ void setSoundTimerFromRegister(State *state, uint8_t reg)
     state->sound_timer = state->registers[reg];
     state->pc += 2;
 }
+// the scrolls move the selected planes by whole rows or whole words, never a
+// pixel at a time. Amounts are in pixels of the current mode
+void scrollDown(State *state, uint8_t rows)
+{
+    int height = displayHeight(state);
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        if (!((selectedPlanes(state) >> plane) & 0x1))
+            continue;
+        memmove(state->pixels[plane][rows], state->pixels[plane][0], (height - rows) * sizeof(state->pixels[plane][0]));
+        memset(state->pixels[plane][0], 0, rows * sizeof(state->pixels[plane][0]));
+    }
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    state->draw = true;
+    state->pc += 2;
+}
+void scrollUp(State *state, uint8_t rows)
+{
+    int height = displayHeight(state);
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        if (!((selectedPlanes(state) >> plane) & 0x1))
+            continue;
+        memmove(state->pixels[plane][0], state->pixels[plane][rows], (height - rows) * sizeof(state->pixels[plane][0]));
+        memset(state->pixels[plane][height - rows], 0, rows * sizeof(state->pixels[plane][0]));
+    }
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    state->draw = true;
+    state->pc += 2;
+}
+void scrollRight(State *state)
+{
+    // 4 pixels, carrying from each word into the next
+    int height = displayHeight(state), words = displayWidth(state) / 64;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        if (!((selectedPlanes(state) >> plane) & 0x1))
+            continue;
+        for (int y = 0; y < height; y++)
+        {
+            uint64_t *row = state->pixels[plane][y];
+            for (int word = words - 1; word > 0; word--)
+            {
+                row[word] = (row[word] >> 4) | (row[word - 1] << 60);
+            }
+            row[0] >>= 4;
+        }
+    }
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    state->draw = true;
+    state->pc += 2;
+}
+void scrollLeft(State *state)
+{
+    int height = displayHeight(state), words = displayWidth(state) / 64;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        if (!((selectedPlanes(state) >> plane) & 0x1))
+            continue;
+        for (int y = 0; y < height; y++)
+        {
+            uint64_t *row = state->pixels[plane][y];
+            for (int word = 0; word < words - 1; word++)
+            {
+                row[word] = (row[word] << 4) | (row[word + 1] >> 60);
+            }
+            row[words - 1] <<= 4;
+        }
+    }
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    state->draw = true;
+    state->pc += 2;
+}
+void exitInterpreter(State *state)
+{
+    // the pc stays on the 00FD, so the VM goes nowhere until the frontend stops it
+    state->quit = true;
+}
+void setDisplayMode(State *state, bool hires)
+{
+    // switching clears every plane, as XO-CHIP does
+    state->hires = hires;
+    memset(state->pixels, 0, sizeof(state->pixels));
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    state->draw = true;
+    state->pc += 2;
+}
+void setIToBigSprite(State *state, uint8_t reg)
+{
+    state->i = BIG_SPRITES_OFFSET + (state->registers[reg] & 0xf) * 10;
+    state->pc += 2;
+}
+void saveFlags(State *state, uint8_t reg)
+{
+    memcpy(state->flags, state->registers, reg + 1);
+    state->pc += 2;
+}
+void loadFlags(State *state, uint8_t reg)
+{
+    memcpy(state->registers, state->flags, reg + 1);
+    state->pc += 2;
+}
+void selectPlanes(State *state, uint8_t planes)
+{
+    state->planes = (planes & 0x3) ^ 0x1;
+    state->pc += 2;
+}
 
 void processOp(State *state, uint8_t memory[])
 {
@@ -275,14 +476,16 @@ void processOp(State *state, uint8_t memory[])
     // opcodeRight = 0x23
     // opCodeA,B,C,D = 0x0, 0x1, 0x2, 0x3
     uint8_t opCodeLeft, opCodeRight, opCodeA, opCodeB, opCodeC, opCodeD;
-    opCodeLeft = memory[state->pc];
-    opCodeRight = memory[state->pc + 1];
+    // BNNN, or running off the end, can take the pc past the end of memory,
+    // in which case the fetch wraps round as a 12-bit address would
+    opCodeLeft = memory[state->pc & (MEM_SIZE - 1)];
+    opCodeRight = memory[(state->pc + 1) & (MEM_SIZE - 1)];
     opCodeA = opCodeLeft >> 4;
     opCodeB = opCodeLeft & 0x0f;
     opCodeC = opCodeRight >> 4;
     opCodeD = opCodeRight & 0x0f;
+    uint16_t pc = state->pc;
     bool error = false;
-    //SDL_Log("Decoding %02x%02x (A:%x, B:%x, C:%x, D:%x)", opCodeLeft, opCodeRight, opCodeA, opCodeB, opCodeC, opCodeD);
     switch (opCodeA)
     {
     case (0x0):
@@ -291,17 +494,45 @@ void processOp(State *state, uint8_t memory[])
         {
         case (0x0):
         {
-            switch (opCodeRight)
+            switch (opCodeC)
             {
-            case (0xe0):
-                clearDisplay(state, memory);
+            case (0xc):
+                scrollDown(state, opCodeD);
                 break;
-            case (0xee):
-                returnFromSubroutine(state);
+            case (0xd):
+                scrollUp(state, opCodeD);
                 break;
             default:
-                error = true;
-                break;
+            {
+                switch (opCodeRight)
+                {
+                case (0xe0):
+                    clearDisplay(state, memory);
+                    break;
+                case (0xee):
+                    returnFromSubroutine(state);
+                    break;
+                case (0xfb):
+                    scrollRight(state);
+                    break;
+                case (0xfc):
+                    scrollLeft(state);
+                    break;
+                case (0xfd):
+                    exitInterpreter(state);
+                    break;
+                case (0xfe):
+                    setDisplayMode(state, false);
+                    break;
+                case (0xff):
+                    setDisplayMode(state, true);
+                    break;
+                default:
+                    error = true;
+                    break;
+                }
+            }
+            break;
             }
         }
         break;
@@ -404,6 +635,9 @@ void processOp(State *state, uint8_t memory[])
     {
         switch (opCodeRight)
         {
+        case (0x01):
+            selectPlanes(state, opCodeB);
+            break;
         case (0x07):
             setRegisterToDelayTimer(state, opCodeB);
             break;
@@ -422,6 +656,9 @@ void processOp(State *state, uint8_t memory[])
         case (0x29):
             setIToSprite(state, opCodeB);
             break;
+        case (0x30):
+            setIToBigSprite(state, opCodeB);
+            break;
         case (0x33):
             setIToBCD(state, opCodeB, memory);
             break;
@@ -431,6 +668,12 @@ void processOp(State *state, uint8_t memory[])
         case (0x65):
             loadRegisters(state, opCodeB, memory);
             break;
+        case (0x75):
+            saveFlags(state, opCodeB);
+            break;
+        case (0x85):
+            loadFlags(state, opCodeB);
+            break;
         default:
             error = true;
             break;
@@ -443,86 +686,1215 @@ void processOp(State *state, uint8_t memory[])
     }
     if (error)
     {
-        // we could do a bit more like dumping the state/memory
-        SDL_Log("Unknown/unimplemented opcode %02x%02x", opCodeLeft, opCodeRight);
-        exit(1);
+        // leave the pc pointing at the offending opcode, it's up to the caller
+        // to report it (and maybe dump the state/memory)
+        state->halted = true;
+        state->badOpcode = (opCodeLeft << 8) | opCodeRight;
+    }
+    else
+    {
+        PROFILE_OP(pc, (opCodeLeft << 8) | opCodeRight);
     }
 }
 
-void updateScreen2(SDL_Renderer *renderer, SDL_Texture *texture, bool myPixels[], uint32_t pixels[])
+// handlers for the decode cache - each one maps the pre-decoded operands
+// onto the same functions processOp uses so both paths behave identically
+static void opFallback(State *state, uint8_t memory[], const DecodedOp *op)
 {
-    for (int pixelIndex = 0; pixelIndex < SCREEN_HEIGHT*SCREEN_WIDTH; pixelIndex++) {
-        pixels[pixelIndex] = myPixels[pixelIndex] ? PIXEL_ON : PIXEL_OFF;
-    }
-    SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+    // unknown opcodes go through processOp so errors are reported the same way
+    processOp(state, memory);
+}
+static void opClearDisplay(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    clearDisplay(state, memory);
 }
+static void opReturnFromSubroutine(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    returnFromSubroutine(state);
+}
+static void opJumpToAddress(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->pc = op->nnn;
+}
+static void opCallSubroutine(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->stack[state->sp] = state->pc + 2;
+    state->sp += 1;
+    state->pc = op->nnn;
+}
+static void opJumpIfRegEqualToConst(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfRegEqualToConst(state, op->x, op->nn);
+}
+static void opJumpIfRegNotEqualToConst(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfRegNotEqualToConst(state, op->x, op->nn);
+}
+static void opJumpIfRegEqualToReg(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfRegEqualToReg(state, op->x, op->y);
+}
+static void opSetRegister(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegister(state, op->x, op->nn);
+}
+static void opAddToRegister(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    addToRegister(state, op->x, op->nn);
+}
+static void opSetRegisterToRegister(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegisterToRegister(state, op->x, op->y);
+}
+static void opSetRegisterToBitwiseOr(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegisterToBitwiseOr(state, op->x, op->y);
+}
+static void opSetRegisterToBitwiseAnd(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegisterToBitwiseAnd(state, op->x, op->y);
+}
+static void opSetRegisterToBitwiseXor(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegisterToBitwiseXor(state, op->x, op->y);
+}
+static void opAddRegisters(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    addRegisters(state, op->x, op->y);
+}
+static void opSubtractRegisters(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    subtractRegisters(state, op->x, op->y);
+}
+static void opRightShift(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    rightShift(state, op->x);
+}
+static void opSubtractRightFromLeft(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    subtractRightFromLeft(state, op->x, op->y);
+}
+static void opLeftShift(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    leftShift(state, op->x);
+}
+static void opJumpIfRegNotEqualToReg(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfRegNotEqualToReg(state, op->x, op->y);
+}
+static void opSetI(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->i = op->nnn;
+    state->pc += 2;
+}
+static void opSetPC(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->pc = state->registers[0] + op->nnn;
+}
+static void opGetRandomNumber(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    getRandomNumber(state, op->x, op->nn);
+}
+static void opSetPixels(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setPixels2(state, op->x, op->y, op->n, memory);
+}
+static void opJumpIfKeyPressed(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfKeyPressed(state, op->x);
+}
+static void opJumpIfKeyNotPressed(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    jumpIfKeyNotPressed(state, op->x);
+}
+static void opSetRegisterToDelayTimer(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setRegisterToDelayTimer(state, op->x);
+}
+static void opWaitForKey(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    waitForKey(state, op->x);
+}
+static void opSetDelayTimerFromRegister(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setDelayTimerFromRegister(state, op->x);
+}
+static void opSetSoundTimerFromRegister(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setSoundTimerFromRegister(state, op->x);
+}
+static void opAddRegToI(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    addRegToI(state, op->x);
+}
+static void opSetIToSprite(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setIToSprite(state, op->x);
+}
+static void opSetIToBCD(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setIToBCD(state, op->x, memory);
+}
+static void opSaveRegisters(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    saveRegisters(state, op->x, memory);
+}
+static void opLoadRegisters(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    loadRegisters(state, op->x, memory);
+}
+static void opScrollDown(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    scrollDown(state, op->n);
+}
+static void opScrollUp(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    scrollUp(state, op->n);
+}
+static void opScrollRight(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    scrollRight(state);
+}
+static void opScrollLeft(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    scrollLeft(state);
+}
+static void opExitInterpreter(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    exitInterpreter(state);
+}
+static void opSetLores(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setDisplayMode(state, false);
+}
+static void opSetHires(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setDisplayMode(state, true);
+}
+static void opSetIToBigSprite(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    setIToBigSprite(state, op->x);
+}
+static void opSaveFlags(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    saveFlags(state, op->x);
+}
+static void opLoadFlags(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    loadFlags(state, op->x);
+}
+static void opSelectPlanes(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    selectPlanes(state, op->x);
+}
+
+// every opcode maps onto one of these, shared by the decode cache and the threaded engine
+typedef enum {
+    OP_UNKNOWN,
+    OP_CLEAR_DISPLAY,
+    OP_RETURN,
+    OP_JUMP,
+    OP_CALL,
+    OP_SKIP_EQ_CONST,
+    OP_SKIP_NE_CONST,
+    OP_SKIP_EQ_REG,
+    OP_SET_CONST,
+    OP_ADD_CONST,
+    OP_SET_REG,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_REG,
+    OP_SUB,
+    OP_SHIFT_RIGHT,
+    OP_SUB_REVERSE,
+    OP_SHIFT_LEFT,
+    OP_SKIP_NE_REG,
+    OP_SET_I,
+    OP_JUMP_V0,
+    OP_RANDOM,
+    OP_DRAW,
+    OP_SKIP_KEY,
+    OP_SKIP_NOT_KEY,
+    OP_GET_DELAY,
+    OP_WAIT_KEY,
+    OP_SET_DELAY,
+    OP_SET_SOUND,
+    OP_ADD_I,
+    OP_SPRITE,
+    OP_BCD,
+    OP_SAVE,
+    OP_LOAD,
+    OP_SCROLL_DOWN,
+    OP_SCROLL_UP,
+    OP_SCROLL_RIGHT,
+    OP_SCROLL_LEFT,
+    OP_EXIT,
+    OP_LORES,
+    OP_HIRES,
+    OP_BIG_SPRITE,
+    OP_SAVE_FLAGS,
+    OP_LOAD_FLAGS,
+    OP_PLANES,
+    NUM_OP_CLASSES
+} OpClass;
 
-void updateScreen(SDL_Renderer *renderer, SDL_Texture *texture, uint8_t memory[], uint32_t pixels[])
+static OpClass classifyOp(uint8_t opCodeLeft, uint8_t opCodeRight)
 {
-    // assume we're filling by row
-    uint8_t values;
-    int pixelIndex = 0;
-    uint16_t offset = MEM_DISPLAY_START;
-    for (int row = 0; row < SCREEN_HEIGHT; row++)
+    // mirrors the switch in processOp
+    switch (opCodeLeft >> 4)
     {
-        // our memory unit is a byte - so each block of 8 bits represents 8 pixels
-        for (int colGroup = 0; colGroup < SCREEN_WIDTH / 8; colGroup++)
+    case (0x0):
+        if (opCodeLeft != 0x00)
+            return OP_UNKNOWN;
+        if ((opCodeRight >> 4) == 0xc)
+            return OP_SCROLL_DOWN;
+        if ((opCodeRight >> 4) == 0xd)
+            return OP_SCROLL_UP;
+        switch (opCodeRight)
         {
-            values = memory[offset];
-            // we now bit-shift to get the state of each pixel
-            for (int shift = 7; shift >= 0; shift--)
-            {
-                pixels[pixelIndex] = ((values >> shift) & 0x1) ? PIXEL_ON : PIXEL_OFF;
-                pixelIndex++;
-            }
-            offset += 1;
+        case (0xe0):
+            return OP_CLEAR_DISPLAY;
+        case (0xee):
+            return OP_RETURN;
+        case (0xfb):
+            return OP_SCROLL_RIGHT;
+        case (0xfc):
+            return OP_SCROLL_LEFT;
+        case (0xfd):
+            return OP_EXIT;
+        case (0xfe):
+            return OP_LORES;
+        case (0xff):
+            return OP_HIRES;
+        default:
+            return OP_UNKNOWN;
+        }
+    case (0x1):
+        return OP_JUMP;
+    case (0x2):
+        return OP_CALL;
+    case (0x3):
+        return OP_SKIP_EQ_CONST;
+    case (0x4):
+        return OP_SKIP_NE_CONST;
+    case (0x5):
+        return OP_SKIP_EQ_REG;
+    case (0x6):
+        return OP_SET_CONST;
+    case (0x7):
+        return OP_ADD_CONST;
+    case (0x8):
+    {
+        switch (opCodeRight & 0x0f)
+        {
+        case (0x0):
+            return OP_SET_REG;
+        case (0x1):
+            return OP_OR;
+        case (0x2):
+            return OP_AND;
+        case (0x3):
+            return OP_XOR;
+        case (0x4):
+            return OP_ADD_REG;
+        case (0x5):
+            return OP_SUB;
+        case (0x6):
+            return OP_SHIFT_RIGHT;
+        case (0x7):
+            return OP_SUB_REVERSE;
+        case (0xe):
+            return OP_SHIFT_LEFT;
+        default:
+            return OP_UNKNOWN;
         }
     }
-    SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
-}
-
-void processInput(State *state, const uint8_t keyStates[])
-{
-    state->input[0x1] = keyStates[SDL_SCANCODE_1];
-    state->input[0x2] = keyStates[SDL_SCANCODE_2];
-    state->input[0x3] = keyStates[SDL_SCANCODE_3];
-    state->input[0xc] = keyStates[SDL_SCANCODE_4];
-    state->input[0x4] = keyStates[SDL_SCANCODE_Q];
-    state->input[0x5] = keyStates[SDL_SCANCODE_W];
-    state->input[0x6] = keyStates[SDL_SCANCODE_E];
-    state->input[0xd] = keyStates[SDL_SCANCODE_R];
-    state->input[0x7] = keyStates[SDL_SCANCODE_A];
-    state->input[0x8] = keyStates[SDL_SCANCODE_S];
-    state->input[0x9] = keyStates[SDL_SCANCODE_D];
-    state->input[0xe] = keyStates[SDL_SCANCODE_F];
-    state->input[0xa] = keyStates[SDL_SCANCODE_Z];
-    state->input[0x0] = keyStates[SDL_SCANCODE_X];
-    state->input[0xb] = keyStates[SDL_SCANCODE_C];
-    state->input[0xf] = keyStates[SDL_SCANCODE_V];
-    for (int i = 0; i < 16; i++)
-    {
-        if (state->input[i])
+    case (0x9):
+        return OP_SKIP_NE_REG;
+    case (0xa):
+        return OP_SET_I;
+    case (0xb):
+        return OP_JUMP_V0;
+    case (0xc):
+        return OP_RANDOM;
+    case (0xd):
+        return OP_DRAW;
+    case (0xe):
+        if (opCodeRight == 0x9e)
+            return OP_SKIP_KEY;
+        if (opCodeRight == 0xa1)
+            return OP_SKIP_NOT_KEY;
+        return OP_UNKNOWN;
+    case (0xf):
+    {
+        switch (opCodeRight)
         {
-            SDL_Log("%x pressed", i);
+        case (0x01):
+            return OP_PLANES;
+        case (0x07):
+            return OP_GET_DELAY;
+        case (0x0a):
+            return OP_WAIT_KEY;
+        case (0x15):
+            return OP_SET_DELAY;
+        case (0x18):
+            return OP_SET_SOUND;
+        case (0x1e):
+            return OP_ADD_I;
+        case (0x29):
+            return OP_SPRITE;
+        case (0x30):
+            return OP_BIG_SPRITE;
+        case (0x33):
+            return OP_BCD;
+        case (0x55):
+            return OP_SAVE;
+        case (0x65):
+            return OP_LOAD;
+        case (0x75):
+            return OP_SAVE_FLAGS;
+        case (0x85):
+            return OP_LOAD_FLAGS;
+        default:
+            return OP_UNKNOWN;
         }
     }
+    default:
+        return OP_UNKNOWN;
+    }
 }
 
-void processEvent(State *state, SDL_Event *event)
+static const OpHandler cachedHandlers[NUM_OP_CLASSES] = {
+    [OP_UNKNOWN] = opFallback,
+    [OP_CLEAR_DISPLAY] = opClearDisplay,
+    [OP_RETURN] = opReturnFromSubroutine,
+    [OP_JUMP] = opJumpToAddress,
+    [OP_CALL] = opCallSubroutine,
+    [OP_SKIP_EQ_CONST] = opJumpIfRegEqualToConst,
+    [OP_SKIP_NE_CONST] = opJumpIfRegNotEqualToConst,
+    [OP_SKIP_EQ_REG] = opJumpIfRegEqualToReg,
+    [OP_SET_CONST] = opSetRegister,
+    [OP_ADD_CONST] = opAddToRegister,
+    [OP_SET_REG] = opSetRegisterToRegister,
+    [OP_OR] = opSetRegisterToBitwiseOr,
+    [OP_AND] = opSetRegisterToBitwiseAnd,
+    [OP_XOR] = opSetRegisterToBitwiseXor,
+    [OP_ADD_REG] = opAddRegisters,
+    [OP_SUB] = opSubtractRegisters,
+    [OP_SHIFT_RIGHT] = opRightShift,
+    [OP_SUB_REVERSE] = opSubtractRightFromLeft,
+    [OP_SHIFT_LEFT] = opLeftShift,
+    [OP_SKIP_NE_REG] = opJumpIfRegNotEqualToReg,
+    [OP_SET_I] = opSetI,
+    [OP_JUMP_V0] = opSetPC,
+    [OP_RANDOM] = opGetRandomNumber,
+    [OP_DRAW] = opSetPixels,
+    [OP_SKIP_KEY] = opJumpIfKeyPressed,
+    [OP_SKIP_NOT_KEY] = opJumpIfKeyNotPressed,
+    [OP_GET_DELAY] = opSetRegisterToDelayTimer,
+    [OP_WAIT_KEY] = opWaitForKey,
+    [OP_SET_DELAY] = opSetDelayTimerFromRegister,
+    [OP_SET_SOUND] = opSetSoundTimerFromRegister,
+    [OP_ADD_I] = opAddRegToI,
+    [OP_SPRITE] = opSetIToSprite,
+    [OP_BCD] = opSetIToBCD,
+    [OP_SAVE] = opSaveRegisters,
+    [OP_LOAD] = opLoadRegisters,
+    [OP_SCROLL_DOWN] = opScrollDown,
+    [OP_SCROLL_UP] = opScrollUp,
+    [OP_SCROLL_RIGHT] = opScrollRight,
+    [OP_SCROLL_LEFT] = opScrollLeft,
+    [OP_EXIT] = opExitInterpreter,
+    [OP_LORES] = opSetLores,
+    [OP_HIRES] = opSetHires,
+    [OP_BIG_SPRITE] = opSetIToBigSprite,
+    [OP_SAVE_FLAGS] = opSaveFlags,
+    [OP_LOAD_FLAGS] = opLoadFlags,
+    [OP_PLANES] = opSelectPlanes,
+};
+
+static void decodeOp(DecodedOp *op, uint8_t opCodeLeft, uint8_t opCodeRight)
 {
-    switch (event->type)
+    // same nibble layout as processOp
+    op->x = opCodeLeft & 0x0f;
+    op->y = opCodeRight >> 4;
+    op->n = opCodeRight & 0x0f;
+    op->nn = opCodeRight;
+    op->nnn = (op->x << 8) | opCodeRight;
+    OpClass opClass = classifyOp(opCodeLeft, opCodeRight);
+    op->handler = cachedHandlers[opClass];
+    switch (opClass)
     {
-    case SDL_QUIT:
-        state->quit = true;
-        SDL_Log("Quit pressed");
+    case (OP_BCD):
+        op->writeLength = 3;
+        break;
+    case (OP_SAVE):
+        op->writeLength = op->x + 1;
+        break;
+    default:
+        op->writeLength = 0;
         break;
+    }
+    op->fusedLength = 0;
+    op->fused = NULL;
+}
+
+// superinstructions: sequences common enough in real ROMs to run as one
+// handler, picked from the pairs the profiler reports. Each takes its own
+// operands from op and the next instruction's from op[2], the DecodedOp two
+// bytes on, and leaves the State exactly as running them one by one would.
+// Each returns how many of them it ran, which a skip can make fewer than fusedLength
+
+// 7XNN then 3YNN/4YNN: a loop counter and its test
+static uint8_t opAddThenSkipEqual(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->registers[op->x] += op->nn;
+    state->pc += state->registers[op[2].x] == op[2].nn ? 6 : 4;
+    return 2;
+}
+static uint8_t opAddThenSkipNotEqual(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->registers[op->x] += op->nn;
+    state->pc += state->registers[op[2].x] != op[2].nn ? 6 : 4;
+    return 2;
+}
+// ANNN then DXYN: point at a sprite and draw it
+static uint8_t opSetIThenDraw(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->i = op->nnn;
+    state->pc += 2;
+    setPixels2(state, op[2].x, op[2].y, op[2].n, memory);
+    return 2;
+}
+// ANNN then FX1E: index into a table
+static uint8_t opSetIThenAdd(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->i = op->nnn + state->registers[op[2].x];
+    state->pc += 4;
+    return 2;
+}
+// FX07, 3YNN then 1NNN: the usual wait for the delay timer, one trip round per call.
+// Once the timer is done the skip steps over the jump, so only two run
+static uint8_t opWaitForTimer(State *state, uint8_t memory[], const DecodedOp *op)
+{
+    state->registers[op->x] = state->delay_timer;
+    if (state->registers[op[2].x] == op[2].nn)
+    {
+        state->pc += 6;
+        return 2;
+    }
+    state->pc = op[4].nnn;
+    return 3;
+}
+
+static void decodeAt(DecodeCache *cache, uint8_t memory[], uint16_t pc)
+{
+    // pc is already wrapped into memory, see processOp
+    DecodedOp *op = &cache->ops[pc];
+    decodeOp(op, memory[pc], memory[(pc + 1) & (MEM_SIZE - 1)]);
+#ifdef CHIP8_PROFILE
+    // a profile counts every instruction on its own, so profiling builds don't fuse
+    return;
+#endif
+    OpClass classes[3] = {OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN};
+    for (int idx = 0; idx < 3 && pc + 2 * idx + 1 < MEM_SIZE; idx++)
+    {
+        classes[idx] = classifyOp(memory[pc + 2 * idx], memory[pc + 2 * idx + 1]);
+    }
+    FusedHandler fused = NULL;
+    uint8_t length = 2;
+    if (classes[0] == OP_ADD_CONST && classes[1] == OP_SKIP_EQ_CONST)
+        fused = opAddThenSkipEqual;
+    else if (classes[0] == OP_ADD_CONST && classes[1] == OP_SKIP_NE_CONST)
+        fused = opAddThenSkipNotEqual;
+    else if (classes[0] == OP_SET_I && classes[1] == OP_DRAW)
+        fused = opSetIThenDraw;
+    else if (classes[0] == OP_SET_I && classes[1] == OP_ADD_I)
+        fused = opSetIThenAdd;
+    else if (classes[0] == OP_GET_DELAY && classes[1] == OP_SKIP_EQ_CONST && classes[2] == OP_JUMP)
+    {
+        fused = opWaitForTimer;
+        length = 3;
+    }
+    if (fused == NULL)
+        return;
+    // the rest only need their operands, which decodeOp fills in
+    for (int idx = 1; idx < length; idx++)
+    {
+        if (cache->ops[pc + 2 * idx].handler == NULL)
+            decodeOp(&cache->ops[pc + 2 * idx], memory[pc + 2 * idx], memory[pc + 2 * idx + 1]);
+    }
+    op->fused = fused;
+    op->fusedLength = length;
+}
+
+void initDecodeCache(DecodeCache *cache)
+{
+    memset(cache->ops, 0, sizeof(cache->ops));
+}
+
+void invalidateDecodeCache(DecodeCache *cache, uint16_t address, uint16_t length)
+{
+    // an instruction is 2 bytes long, so the one starting just before
+    // the first written byte is stale too, as is a superinstruction of up to
+    // 3 that covers it
+    int start = address > 5 ? address - 5 : 0;
+    int end = address + length;
+    if (end > MEM_SIZE)
+        end = MEM_SIZE;
+    for (int idx = start; idx < end; idx++)
+    {
+        cache->ops[idx].handler = NULL;
+    }
+}
+
+void processOpCached(State *state, uint8_t memory[], DecodeCache *cache)
+{
+    // the pc can be past the end of memory, the fetch wraps like processOp's
+    uint16_t pc = state->pc & (MEM_SIZE - 1);
+    DecodedOp *op = &cache->ops[pc];
+    if (op->handler == NULL)
+    {
+        decodeAt(cache, memory, pc);
+    }
+    // unknown opcodes are counted (or not) by processOp
+    if (op->handler != opFallback)
+        PROFILE_OP(state->pc, (memory[pc] << 8) | memory[(pc + 1) & (MEM_SIZE - 1)]);
+    op->handler(state, memory, op);
+    // Fx33/Fx55 may have overwritten code we already decoded
+    if (op->writeLength)
+    {
+        invalidateDecodeCache(cache, state->i, op->writeLength);
+    }
+}
+
+uint32_t processOpsCached(State *state, uint8_t memory[], DecodeCache *cache, uint32_t numOps)
+{
+    // returns the number of instructions executed, like runEngine
+    uint32_t executed = 0;
+    while (executed < numOps)
+    {
+        uint16_t pc = state->pc & (MEM_SIZE - 1);
+        DecodedOp *op = &cache->ops[pc];
+        if (op->handler == NULL)
+        {
+            decodeAt(cache, memory, pc);
+        }
+        // a superinstruction that doesn't fit in the budget runs one instruction at a time.
+        // None of them write to memory, so there's nothing to invalidate
+        if (op->fusedLength != 0 && op->fusedLength <= numOps - executed)
+        {
+            executed += op->fused(state, memory, op);
+            continue;
+        }
+        // processOpCached, without looking the op up again
+        if (op->handler != opFallback)
+            PROFILE_OP(state->pc, (memory[pc] << 8) | memory[(pc + 1) & (MEM_SIZE - 1)]);
+        op->handler(state, memory, op);
+        if (op->writeLength)
+        {
+            invalidateDecodeCache(cache, state->i, op->writeLength);
+        }
+        if (state->halted)
+            break;
+        executed++;
+    }
+    return executed;
+}
+
+// raw opcode -> OpClass, so the threaded engine decodes with a single load
+static uint8_t opClassTable[0x10000];
+// engines may be created from several threads at once (see batch.c)
+static pthread_once_t opClassTableOnce = PTHREAD_ONCE_INIT;
+
+static void fillOpClassTable(void)
+{
+    for (int opCode = 0; opCode < 0x10000; opCode++)
+    {
+        opClassTable[opCode] = classifyOp(opCode >> 8, opCode & 0xff);
+    }
+}
+
+static void buildOpClassTable(void)
+{
+    pthread_once(&opClassTableOnce, fillOpClassTable);
+}
+
+#if defined(__GNUC__)
+// labels-as-values aren't ISO C, hence the pragma
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+uint32_t processOpsThreaded(State *state, uint8_t memory[], uint32_t numOps)
+{
+    static const void *labels[NUM_OP_CLASSES] = {
+        [OP_UNKNOWN] = &&unknown,
+        [OP_CLEAR_DISPLAY] = &&clear_display,
+        [OP_RETURN] = &&return_from_subroutine,
+        [OP_JUMP] = &&jump,
+        [OP_CALL] = &&call,
+        [OP_SKIP_EQ_CONST] = &&skip_eq_const,
+        [OP_SKIP_NE_CONST] = &&skip_ne_const,
+        [OP_SKIP_EQ_REG] = &&skip_eq_reg,
+        [OP_SET_CONST] = &&set_const,
+        [OP_ADD_CONST] = &&add_const,
+        [OP_SET_REG] = &&set_reg,
+        [OP_OR] = &&or,
+        [OP_AND] = &&and,
+        [OP_XOR] = &&xor,
+        [OP_ADD_REG] = &&add_reg,
+        [OP_SUB] = &&sub,
+        [OP_SHIFT_RIGHT] = &&shift_right,
+        [OP_SUB_REVERSE] = &&sub_reverse,
+        [OP_SHIFT_LEFT] = &&shift_left,
+        [OP_SKIP_NE_REG] = &&skip_ne_reg,
+        [OP_SET_I] = &&set_i,
+        [OP_JUMP_V0] = &&jump_v0,
+        [OP_RANDOM] = &&random,
+        [OP_DRAW] = &&draw,
+        [OP_SKIP_KEY] = &&skip_key,
+        [OP_SKIP_NOT_KEY] = &&skip_not_key,
+        [OP_GET_DELAY] = &&get_delay,
+        [OP_WAIT_KEY] = &&wait_key,
+        [OP_SET_DELAY] = &&set_delay,
+        [OP_SET_SOUND] = &&set_sound,
+        [OP_ADD_I] = &&add_i,
+        [OP_SPRITE] = &&sprite,
+        [OP_BCD] = &&bcd,
+        [OP_SAVE] = &&save,
+        [OP_LOAD] = &&load,
+        [OP_SCROLL_DOWN] = &&scroll_down,
+        [OP_SCROLL_UP] = &&scroll_up,
+        [OP_SCROLL_RIGHT] = &&scroll_right,
+        [OP_SCROLL_LEFT] = &&scroll_left,
+        [OP_EXIT] = &&exit_interpreter,
+        [OP_LORES] = &&lores,
+        [OP_HIRES] = &&hires,
+        [OP_BIG_SPRITE] = &&big_sprite,
+        [OP_SAVE_FLAGS] = &&save_flags,
+        [OP_LOAD_FLAGS] = &&load_flags,
+        [OP_PLANES] = &&planes,
+    };
+    uint8_t opCodeLeft, opCodeRight, opClass;
+    uint32_t requested = numOps;
+    buildOpClassTable();
+
+// every handler ends with its own copy of this, giving the branch predictor
+// one indirect jump per handler rather than a single shared one
+#define DISPATCH()                                                  \
+    do                                                              \
+    {                                                               \
+        if (numOps == 0)                                            \
+            return requested;                                       \
+        numOps--;                                                   \
+        opCodeLeft = memory[state->pc & (MEM_SIZE - 1)];            \
+        opCodeRight = memory[(state->pc + 1) & (MEM_SIZE - 1)];     \
+        opClass = opClassTable[(opCodeLeft << 8) | opCodeRight];    \
+        if (opClass != OP_UNKNOWN)                                  \
+            PROFILE_OP(state->pc, (opCodeLeft << 8) | opCodeRight); \
+        goto *labels[opClass];                                      \
+    } while (0)
+#define X (opCodeLeft & 0x0f)
+#define Y (opCodeRight >> 4)
+#define N (opCodeRight & 0x0f)
+
+    DISPATCH();
+unknown:
+    processOp(state, memory);
+    // the unknown opcode itself doesn't count
+    if (state->halted)
+        return requested - numOps - 1;
+    DISPATCH();
+clear_display:
+    clearDisplay(state, memory);
+    DISPATCH();
+return_from_subroutine:
+    returnFromSubroutine(state);
+    DISPATCH();
+jump:
+    jumpToAddress(state, X, opCodeRight);
+    DISPATCH();
+call:
+    callSubroutine(state, X, opCodeRight);
+    DISPATCH();
+skip_eq_const:
+    jumpIfRegEqualToConst(state, X, opCodeRight);
+    DISPATCH();
+skip_ne_const:
+    jumpIfRegNotEqualToConst(state, X, opCodeRight);
+    DISPATCH();
+skip_eq_reg:
+    jumpIfRegEqualToReg(state, X, Y);
+    DISPATCH();
+set_const:
+    setRegister(state, X, opCodeRight);
+    DISPATCH();
+add_const:
+    addToRegister(state, X, opCodeRight);
+    DISPATCH();
+set_reg:
+    setRegisterToRegister(state, X, Y);
+    DISPATCH();
+or:
+    setRegisterToBitwiseOr(state, X, Y);
+    DISPATCH();
+and:
+    setRegisterToBitwiseAnd(state, X, Y);
+    DISPATCH();
+xor:
+    setRegisterToBitwiseXor(state, X, Y);
+    DISPATCH();
+add_reg:
+    addRegisters(state, X, Y);
+    DISPATCH();
+sub:
+    subtractRegisters(state, X, Y);
+    DISPATCH();
+shift_right:
+    rightShift(state, X);
+    DISPATCH();
+sub_reverse:
+    subtractRightFromLeft(state, X, Y);
+    DISPATCH();
+shift_left:
+    leftShift(state, X);
+    DISPATCH();
+skip_ne_reg:
+    jumpIfRegNotEqualToReg(state, X, Y);
+    DISPATCH();
+set_i:
+    setI(state, X, opCodeRight);
+    DISPATCH();
+jump_v0:
+    setPC(state, X, opCodeRight);
+    DISPATCH();
+random:
+    getRandomNumber(state, X, opCodeRight);
+    DISPATCH();
+draw:
+    setPixels2(state, X, Y, N, memory);
+    DISPATCH();
+skip_key:
+    jumpIfKeyPressed(state, X);
+    DISPATCH();
+skip_not_key:
+    jumpIfKeyNotPressed(state, X);
+    DISPATCH();
+get_delay:
+    setRegisterToDelayTimer(state, X);
+    DISPATCH();
+wait_key:
+    waitForKey(state, X);
+    DISPATCH();
+set_delay:
+    setDelayTimerFromRegister(state, X);
+    DISPATCH();
+set_sound:
+    setSoundTimerFromRegister(state, X);
+    DISPATCH();
+add_i:
+    addRegToI(state, X);
+    DISPATCH();
+sprite:
+    setIToSprite(state, X);
+    DISPATCH();
+bcd:
+    setIToBCD(state, X, memory);
+    DISPATCH();
+save:
+    saveRegisters(state, X, memory);
+    DISPATCH();
+load:
+    loadRegisters(state, X, memory);
+    DISPATCH();
+scroll_down:
+    scrollDown(state, N);
+    DISPATCH();
+scroll_up:
+    scrollUp(state, N);
+    DISPATCH();
+scroll_right:
+    scrollRight(state);
+    DISPATCH();
+scroll_left:
+    scrollLeft(state);
+    DISPATCH();
+exit_interpreter:
+    exitInterpreter(state);
+    DISPATCH();
+lores:
+    setDisplayMode(state, false);
+    DISPATCH();
+hires:
+    setDisplayMode(state, true);
+    DISPATCH();
+big_sprite:
+    setIToBigSprite(state, X);
+    DISPATCH();
+save_flags:
+    saveFlags(state, X);
+    DISPATCH();
+load_flags:
+    loadFlags(state, X);
+    DISPATCH();
+planes:
+    selectPlanes(state, X);
+    DISPATCH();
+
+#undef DISPATCH
+#undef X
+#undef Y
+#undef N
+}
+#pragma GCC diagnostic pop
+#else
+uint32_t processOpsThreaded(State *state, uint8_t memory[], uint32_t numOps)
+{
+    // no labels-as-values, so fall back to the switch
+    uint32_t executed = 0;
+    for (; executed < numOps; executed++)
+    {
+        processOp(state, memory);
+        if (state->halted)
+            break;
+    }
+    return executed;
+}
+#endif
+
+void initEngine(Engine *engine, EngineKind kind)
+{
+    engine->kind = kind;
+    engine->jit = NULL;
+    engine->aot = NULL;
+    engine->trace = NULL;
+    engine->idleOps = 0;
+    engine->debugger = NULL;
+    initDecodeCache(&engine->cache);
+    buildOpClassTable();
+    // compiled code comes from initAotEngine
+    if (kind == ENGINE_AOT)
+        engine->kind = ENGINE_CACHED;
+#ifdef CHIP8_PROFILE
+    // translated code has no profiling hooks, so profile with the cache instead
+    if (kind == ENGINE_JIT)
+        engine->kind = ENGINE_CACHED;
+#else
+    if (kind == ENGINE_JIT)
+    {
+        engine->jit = createJit();
+        // no code generator for this host (or no executable memory), the cache is the next best thing
+        if (engine->jit == NULL)
+            engine->kind = ENGINE_CACHED;
+    }
+#endif
+}
+
+void initAotEngine(Engine *engine, const AotProgram *program, const uint8_t memory[])
+{
+    // memory should already hold the ROM, or the save state, we're about to run
+    initEngine(engine, ENGINE_AOT);
+    // like translated code, compiled code has no profiling hooks
+#ifndef CHIP8_PROFILE
+    engine->aot = createAot(program, memory);
+    if (engine->aot != NULL)
+        engine->kind = ENGINE_AOT;
+#endif
+}
+
+void freeEngine(Engine *engine)
+{
+    destroyJit(engine->jit);
+    engine->jit = NULL;
+    destroyAot(engine->aot);
+    engine->aot = NULL;
+}
+
+void invalidateEngine(Engine *engine, uint16_t address, uint16_t length)
+{
+    invalidateDecodeCache(&engine->cache, address, length);
+    if (engine->jit != NULL)
+        invalidateJit(engine->jit, address, length);
+    if (engine->aot != NULL)
+        invalidateAot(engine->aot, address, length);
+}
+
+// idle loops: a ROM waiting on the delay timer or a key, spinning through a
+// few instructions that only read the registers, the timer and the keys. None
+// of those change until the host ticks the timers or samples input again,
+// which it only does between calls to runEngine, so once a trip round leaves
+// the registers as it found them every trip until the end of the call does too
+
+#define IDLE_MAX_OPS 4
+
+static bool idleOp(uint8_t opClass)
+{
+    // the instructions an idle loop can be made of, which write nothing but
+    // the registers, i and the pc
+    switch (opClass)
+    {
+    case (OP_JUMP):
+    case (OP_SKIP_EQ_CONST):
+    case (OP_SKIP_NE_CONST):
+    case (OP_SKIP_EQ_REG):
+    case (OP_SKIP_NE_REG):
+    case (OP_SET_CONST):
+    case (OP_ADD_CONST):
+    case (OP_SET_REG):
+    case (OP_OR):
+    case (OP_AND):
+    case (OP_XOR):
+    case (OP_ADD_REG):
+    case (OP_SUB):
+    case (OP_SHIFT_RIGHT):
+    case (OP_SUB_REVERSE):
+    case (OP_SHIFT_LEFT):
+    case (OP_SET_I):
+    case (OP_ADD_I):
+    case (OP_SKIP_KEY):
+    case (OP_SKIP_NOT_KEY):
+    case (OP_GET_DELAY):
+    case (OP_WAIT_KEY):
+        return true;
     default:
+        return false;
+    }
+}
+
+static bool mayBeIdle(const uint8_t memory[], uint16_t pc)
+{
+    // a quick look before running anything, as this happens every frame: the
+    // pc is in a short loop that reads the timer or the keys, or it's at an
+    // FX0A or a jump to itself
+    for (uint16_t at = pc; at < pc + 2 * IDLE_MAX_OPS && at + 1 < MEM_SIZE; at += 2)
+    {
+        uint8_t opClass = opClassTable[(memory[at] << 8) | memory[at + 1]];
+        if (!idleOp(opClass))
+            return false;
+        if (opClass == OP_WAIT_KEY)
+            return true;
+        uint16_t target = ((memory[at] & 0x0f) << 8) | memory[at + 1];
+        // jumps forward may be skipped over, the way out of the loop
+        if (opClass != OP_JUMP || target > pc)
+            continue;
+        if (at - target > 2 * (IDLE_MAX_OPS - 1))
+            return false;
+        if (target == at)
+            return true;
+        for (uint16_t op = target; op < at; op += 2)
+        {
+            opClass = opClassTable[(memory[op] << 8) | memory[op + 1]];
+            if (opClass == OP_GET_DELAY || opClass == OP_SKIP_KEY || opClass == OP_SKIP_NOT_KEY)
+                return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+static uint32_t idleTrip(State *state, uint8_t memory[])
+{
+    // one trip round the loop from the pc back to it, returning the number of
+    // instructions it took or 0 if it ran anything else on the way
+    uint16_t start = state->pc;
+    for (uint32_t count = 1; count <= IDLE_MAX_OPS; count++)
+    {
+        if (state->pc + 1 >= MEM_SIZE || !idleOp(opClassTable[(memory[state->pc] << 8) | memory[state->pc + 1]]))
+            return 0;
+        processOp(state, memory);
+        if (state->pc == start)
+            return count;
+    }
+    return 0;
+}
+
+static bool skipIdleLoop(State *state, uint8_t memory[], uint32_t numOps)
+{
+    // runs all numOps if the VM is idle and returns true, otherwise leaves the
+    // state as it was. Two trips in, the second one left the registers and i
+    // as it found them so the rest are the same and only the last, partial
+    // trip needs running
+#ifdef CHIP8_PROFILE
+    // a profile counts every instruction it ran, so profiling builds spin like the ROM asks
+    return false;
+#endif
+    if (!mayBeIdle(memory, state->pc))
+        return false;
+    uint8_t registers[16];
+    memcpy(registers, state->registers, sizeof(registers));
+    uint16_t i = state->i, pc = state->pc;
+    uint32_t first = idleTrip(state, memory);
+    if (first != 0 && first < numOps)
+    {
+        uint8_t settled[16];
+        memcpy(settled, state->registers, sizeof(settled));
+        uint16_t settledI = state->i;
+        uint32_t period = idleTrip(state, memory);
+        if (period != 0 && first + period <= numOps && state->i == settledI &&
+            memcmp(state->registers, settled, sizeof(settled)) == 0)
+        {
+            for (uint32_t remaining = (numOps - first - period) % period; remaining > 0; remaining--)
+            {
+                processOp(state, memory);
+            }
+            return true;
+        }
+    }
+    memcpy(state->registers, registers, sizeof(registers));
+    state->i = i;
+    state->pc = pc;
+    return false;
+}
+
+uint32_t runEngine(Engine *engine, State *state, uint8_t memory[], uint32_t numOps)
+{
+    // returns the number of instructions executed, which is less than numOps
+    // if we stopped on an unknown opcode
+    uint32_t executed = 0;
+    // the debugger traces too, if asked to
+    if (engine->debugger != NULL)
+        return runDebugged(engine->debugger, engine, state, memory, numOps);
+    if (engine->trace != NULL)
+        return runTraced(engine->trace, engine, state, memory, numOps);
+    if (skipIdleLoop(state, memory, numOps))
+    {
+        engine->idleOps += numOps;
+        return numOps;
+    }
+    switch (engine->kind)
+    {
+    case (ENGINE_SWITCH):
+        for (; executed < numOps; executed++)
+        {
+            processOp(state, memory);
+            if (state->halted)
+                break;
+        }
+        break;
+    case (ENGINE_CACHED):
+        executed = processOpsCached(state, memory, &engine->cache, numOps);
+        break;
+    case (ENGINE_THREADED):
+        executed = processOpsThreaded(state, memory, numOps);
+        break;
+    case (ENGINE_JIT):
+        executed = runJit(engine->jit, state, memory, numOps);
+        break;
+    case (ENGINE_AOT):
+        executed = runAot(engine->aot, state, memory, numOps);
         break;
     }
-}
\ No newline at end of file
+    return executed;
+}
+
+static const char *engineNames[] = {
+    [ENGINE_SWITCH] = "switch",
+    [ENGINE_CACHED] = "cached",
+    [ENGINE_THREADED] = "threaded",
+    [ENGINE_JIT] = "jit",
+    [ENGINE_AOT] = "aot",
+};
+
+bool parseEngineKind(const char *name, EngineKind *kind)
+{
+    for (int idx = 0; idx < (int)(sizeof(engineNames) / sizeof(engineNames[0])); idx++)
+    {
+        if (strcmp(name, engineNames[idx]) == 0)
+        {
+            *kind = idx;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *engineKindName(EngineKind kind)
+{
+    return engineNames[kind];
+}
+
+int displayWidth(const State *state)
+{
+    return state->hires ? HIRES_WIDTH : LORES_WIDTH;
+}
+
+int displayHeight(const State *state)
+{
+    return state->hires ? HIRES_HEIGHT : LORES_HEIGHT;
+}
+
+uint8_t getPixel(const State *state, int x, int y)
+{
+    // bit n is set if the pixel is set in plane n
+    uint8_t planes = 0;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++)
+    {
+        planes |= ((state->pixels[plane][y][x / 64] >> (63 - x % 64)) & 0x1) << plane;
+    }
+    return planes;
+}
+
+uint64_t hashState(const State *state, const uint8_t memory[])
+{
+    // FNV-1a over everything that affects how the VM runs from here on,
+    // field by field so struct padding doesn't leak in
+    uint64_t hash = 0xcbf29ce484222325ull;
+#define HASH_BYTES(ptr, len)                                  \
+    for (size_t idx = 0; idx < (len); idx++)                  \
+    {                                                         \
+        hash = (hash ^ ((const uint8_t *)(ptr))[idx]) * 0x100000001b3ull; \
+    }
+    HASH_BYTES(state->registers, sizeof(state->registers));
+    HASH_BYTES(&state->i, sizeof(state->i));
+    HASH_BYTES(&state->pc, sizeof(state->pc));
+    HASH_BYTES(&state->sp, sizeof(state->sp));
+    HASH_BYTES(state->stack, sizeof(state->stack));
+    HASH_BYTES(&state->delay_timer, sizeof(state->delay_timer));
+    HASH_BYTES(&state->sound_timer, sizeof(state->sound_timer));
+    HASH_BYTES(state->rng, sizeof(state->rng));
+    HASH_BYTES(state->pixels, sizeof(state->pixels));
+    HASH_BYTES(&state->hires, sizeof(state->hires));
+    HASH_BYTES(&state->planes, sizeof(state->planes));
+    HASH_BYTES(state->flags, sizeof(state->flags));
+    HASH_BYTES(memory, MEM_SIZE);
+#undef HASH_BYTES
+    return hash;
+}
+
+void dumpState(FILE *out, const State *state)
+{
+    fprintf(out, "pc: %03x i: %03x sp: %x delay: %02x sound: %02x\n", state->pc, state->i, state->sp, state->delay_timer, state->sound_timer);
+    for (int reg = 0; reg < 16; reg++)
+    {
+        fprintf(out, "v%x: %02x%s", reg, state->registers[reg], reg % 8 == 7 ? "\n" : " ");
+    }
+    fprintf(out, "stack:");
+    for (int idx = 0; idx < state->sp && idx < 12; idx++)
+    {
+        fprintf(out, " %03x", state->stack[idx]);
+    }
+    fprintf(out, "\n");
+    if (state->halted)
+        fprintf(out, "halted on unknown opcode %04x\n", state->badOpcode);
+    if (state->quit)
+        fprintf(out, "exited with 00fd\n");
+    if (state->hires)
+        fprintf(out, "hi-res\n");
+}
+
+void dumpDisplay(FILE *out, const State *state)
+{
+    // '#' for the first plane, '+' for the second and '@' for both
+    static const char shades[4] = {'.', '#', '+', '@'};
+    int width = displayWidth(state);
+    for (int y = 0; y < displayHeight(state); y++)
+    {
+        char line[HIRES_WIDTH + 1];
+        for (int x = 0; x < width; x++)
+        {
+            line[x] = shades[getPixel(state, x, y)];
+        }
+        line[width] = '\0';
+        fprintf(out, "%s\n", line);
+    }
+}
@@ -1,17 +1,31 @@
+#ifndef MYLIB_H
+#define MYLIB_H
+
+// the CHIP-8 core: no SDL, no exit(), no global state outside of profiling builds - see frontend.h for the SDL side
 #include <stdint.h>
 #include <stdbool.h>
-#include <SDL2/SDL.h>
+#include <stdio.h>
 
-#define SCREEN_WIDTH 64
-#define SCREEN_HEIGHT 32
-#define SCALE 10
+// the display mode is picked at runtime, see displayWidth: base CHIP-8 is
+// 64x32, SUPER-CHIP's 00FF switches to 128x64 and 00FE back
+#define LORES_WIDTH 64
+#define LORES_HEIGHT 32
+#define HIRES_WIDTH 128
+#define HIRES_HEIGHT 64
+// words per row at the widest, one bit per pixel
+#define DISPLAY_WORDS (HIRES_WIDTH / 64)
+// XO-CHIP bitplanes, picked with FN01
+#define DISPLAY_PLANES 2
 #define MEM_SIZE 4096
 #define SPRITES_OFFSET 0x0
+// SUPER-CHIP's 8x10 digits, FX30
+#define BIG_SPRITES_OFFSET 0x50
 #define ROM_OFFSET 0x200
 #define MAX_ROM_SIZE (0xea0 - 0x200)
 #define MEM_DISPLAY_START 0xf00
-#define PIXEL_ON 0xffffffff
-#define PIXEL_OFF 0x000000ff
+#define ALL_ROWS_DIRTY 0xffffffffffffffffull
+// bumped whenever the save state layout changes, see savestate.c
+#define SAVE_STATE_VERSION 3
 
 typedef struct {
     uint8_t registers[16];
@@ -21,32 +35,595 @@ typedef struct {
     uint16_t stack[12];
     uint8_t delay_timer;
     uint8_t sound_timer;
-    bool input[16];
+    // bit n is set while key n is held, sampled once per frame by the frontend
+    uint16_t keys;
     bool quit;
     bool draw;
-    bool pixels[SCREEN_WIDTH*SCREEN_HEIGHT];
+    // set on an unknown opcode, which is left in badOpcode with the pc pointing at it
+    bool halted;
+    uint16_t badOpcode;
+    // xoshiro128** state for CXNN, see seedRandom. All zero means not seeded yet
+    uint32_t rng[4];
+    // one bit per pixel per plane, DISPLAY_WORDS words per row - x = 0 is the
+    // most significant bit of the first word. In lo-res only the first word
+    // of the first LORES_HEIGHT rows is used
+    uint64_t pixels[DISPLAY_PLANES][HIRES_HEIGHT][DISPLAY_WORDS];
+    // bit y is set when row y has changed since the last updateScreen2
+    uint64_t dirtyRows;
+    // 128x64 rather than 64x32
+    bool hires;
+    // the planes FN01 picked, stored xor 1 so a zeroed State draws to the
+    // first plane only like base CHIP-8
+    uint8_t planes;
+    // SUPER-CHIP's RPL user flags, FX75/FX85
+    uint8_t flags[16];
 } State;
 
-void
-fillScreen(uint32_t pixels[], uint32_t pixel);
+typedef struct DecodedOp DecodedOp;
+
+// a handler executes one pre-decoded instruction
+typedef void (*OpHandler)(State *state, uint8_t memory[], const DecodedOp *op);
+// a superinstruction's handler, returns the number of instructions it ran
+typedef uint8_t (*FusedHandler)(State *state, uint8_t memory[], const DecodedOp *op);
+
+// an instruction split into its handler and operands, e.g. for 0xd125:
+// x = 0x1, y = 0x2, n = 0x5, nn = 0x25, nnn = 0x125
+struct DecodedOp {
+    OpHandler handler;
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t nn;
+    // number of bytes written at i (Fx33/Fx55), 0 if the op doesn't write to memory
+    uint8_t writeLength;
+    // the most instructions fused runs in one go, 0 if no superinstruction
+    // starts here. It reads the operands of the rest from the ops that follow this one
+    uint8_t fusedLength;
+    FusedHandler fused;
+};
+
+// one entry per address, filled lazily the first time the pc lands on it
+typedef struct {
+    DecodedOp ops[MEM_SIZE];
+} DecodeCache;
+
+// the interpreter loops we can choose from at runtime
+typedef enum {
+    // processOp: fetch, decode and a nested switch for every instruction
+    ENGINE_SWITCH,
+    // processOpsCached: handlers and operands looked up per address, common sequences fused into one
+    ENGINE_CACHED,
+    // processOpsThreaded: raw opcode -> handler table, labels-as-values dispatch where available
+    ENGINE_THREADED,
+    // runJit: basic blocks translated to x86-64, everything else through processOp
+    ENGINE_JIT,
+    // runAot: a ROM compiled to C ahead of time by chip8-aot, everything else through processOp
+    ENGINE_AOT,
+} EngineKind;
+
+// translated blocks and their code buffer, see jit.c
+typedef struct Jit Jit;
+
+// a binary execution trace being written to a file, see trace.c
+typedef struct Trace Trace;
+
+// breakpoints and watchpoints, see debugger.c
+typedef struct Debugger Debugger;
+
+// a ROM compiled to C by chip8-aot, see aot.c for the generated code and
+// aot_runtime.c for running it
+typedef struct Aot Aot;
+
+// a run of instructions compiled as one, entered only at start
+typedef struct {
+    uint16_t start;
+    // in bytes
+    uint16_t length;
+} AotBlock;
+
+typedef struct {
+    // the ROM the blocks were compiled from, loaded at ROM_OFFSET
+    const uint8_t *rom;
+    uint16_t romSize;
+    const AotBlock *blocks;
+    uint16_t numBlocks;
+    // runs whole blocks from the pc for at most numOps instructions and returns
+    // how many it ran. It stops at the first pc that isn't the start of a
+    // block, a stale block or one longer than what's left of numOps
+    uint32_t (*run)(Aot *aot, State *state, uint8_t memory[], uint32_t numOps);
+} AotProgram;
+
+struct Aot {
+    const AotProgram *program;
+    // by block start: memory no longer holds what the block was compiled from
+    bool stale[MEM_SIZE];
+    // set for every byte of guest code a block was compiled from
+    bool compiled[MEM_SIZE];
+    // instructions that went through processOp instead
+    uint64_t interpreted;
+};
+
+// why runDebugged stopped
+typedef enum {
+    DEBUG_RUNNING,
+    DEBUG_BREAKPOINT,
+    DEBUG_WATCH_MEMORY,
+    DEBUG_WATCH_I,
+    DEBUG_CONDITION,
+    DEBUG_STEP,
+    // on an unknown opcode, which is still at the pc
+    DEBUG_HALTED,
+} DebugStop;
+
+typedef enum {
+    DEBUG_EQUAL,
+    DEBUG_NOT_EQUAL,
+    DEBUG_LESS,
+    DEBUG_GREATER,
+} DebugCompare;
+
+#define DEBUG_MAX_CONDITIONS 8
+
+// vx compared with value
+typedef struct {
+    uint8_t reg;
+    DebugCompare compare;
+    uint8_t value;
+    // it held after the last instruction, we only stop as it becomes true
+    bool held;
+} DebugCondition;
+
+struct Debugger {
+    bool breakpoints[MEM_SIZE];
+    // bytes whose value changing stops us, only FX33 and FX55 write memory
+    bool watched[MEM_SIZE];
+    bool watchI;
+    DebugCondition conditions[DEBUG_MAX_CONDITIONS];
+    int numConditions;
+    // instructions left to single step, 0 to run until something else stops us
+    uint32_t steps;
+    DebugStop stopped;
+    // the byte that changed for DEBUG_WATCH_MEMORY, the condition for DEBUG_CONDITION
+    uint16_t where;
+    // the instruction at the pc runs when we carry on, even with a breakpoint on it
+    bool resume;
+};
+
+typedef struct {
+    EngineKind kind;
+    DecodeCache cache;
+    // only allocated for ENGINE_JIT
+    Jit *jit;
+    // only allocated for ENGINE_AOT
+    Aot *aot;
+    // when set, every instruction goes through processOp and is recorded here
+    Trace *trace;
+    // instructions runEngine got through by skipping to the end of an idle loop
+    uint64_t idleOps;
+    // when set, every instruction goes through processOp and is checked against it
+    Debugger *debugger;
+} Engine;
+
+// VMs stepped together by runLockstep, see lockstep.c
+#define LOCKSTEP_LANES 32
+
+// the hot part of up to LOCKSTEP_LANES VMs as a structure of arrays, one lane
+// per VM, so one instruction can run across all of them at once. Anything
+// else (display, input, rng) stays in each lane's State, which only sees the
+// rest after syncLockstep
+typedef struct {
+    _Alignas(32) uint8_t registers[16][LOCKSTEP_LANES];
+    _Alignas(32) uint16_t i[LOCKSTEP_LANES];
+    _Alignas(32) uint16_t pc[LOCKSTEP_LANES];
+    _Alignas(32) uint8_t sp[LOCKSTEP_LANES];
+    _Alignas(32) uint16_t stack[12][LOCKSTEP_LANES];
+    _Alignas(32) uint8_t delay_timer[LOCKSTEP_LANES];
+    _Alignas(32) uint8_t sound_timer[LOCKSTEP_LANES];
+    // 0xff for lanes in use that haven't halted or been stopped, 0x00 otherwise
+    _Alignas(32) uint8_t active[LOCKSTEP_LANES];
+    int numLanes;
+    State *states[LOCKSTEP_LANES];
+    uint8_t *memories[LOCKSTEP_LANES];
+    // true while every lane's memory is the same, so one fetch does for all lanes
+    bool sharedMemory;
+    // the pc the last lockstep instruction ran at
+    uint16_t leader;
+    // instructions executed by each lane
+    uint64_t cycles[LOCKSTEP_LANES];
+    // instructions executed across all lanes at once, and one lane at a time
+    uint64_t lockstepOps;
+    uint64_t scalarOps;
+} LockstepGroup;
+
+// rewind history, see rewind.c
+#define REWIND_KEYFRAME_INTERVAL 60
+// a snapshot is an image of the State followed by memory
+#define REWIND_IMAGE_SIZE (sizeof(State) + MEM_SIZE)
+// worst case for the encoding: every byte a literal, plus the run headers
+#define REWIND_MAX_ENCODED (REWIND_IMAGE_SIZE + REWIND_IMAGE_SIZE / 64 + 16)
+// the smallest arena initRewind takes: a whole keyframe interval of the
+// largest snapshots, and one more for the space lost wrapping round
+#define REWIND_MIN_CAPACITY ((REWIND_KEYFRAME_INTERVAL + 1) * REWIND_MAX_ENCODED)
+
+typedef struct {
+    // where the snapshot is in the arena, and how long it is
+    uint32_t offset;
+    uint16_t length;
+    // how many snapshots back its keyframe is, 0 for a keyframe
+    uint16_t sinceKeyframe;
+} RewindEntry;
+
+typedef struct {
+    uint8_t *arena;
+    size_t capacity;
+    // where the next snapshot goes
+    uint32_t head;
+    // a ring of maxFrames entries, the oldest at first
+    RewindEntry *entries;
+    size_t maxFrames;
+    size_t first;
+    size_t count;
+    // the image new deltas are taken against
+    uint8_t *keyframe;
+    uint16_t sinceKeyframe;
+    bool needKeyframe;
+    uint8_t *scratch;
+} Rewind;
+
+// execution profile, see profile.c. Only built with -DCHIP8_PROFILE=ON, and
+// the one piece of global state in the core: the hooks are plain increments
+// so they can sit in every engine's dispatch
+#ifdef CHIP8_PROFILE
+// per frame instruction counts are bucketed by powers of two
+#define PROFILE_FRAME_BUCKETS 16
+
+typedef struct {
+    // executions of each raw opcode, grouped into classes for the report
+    uint64_t opCodes[0x10000];
+    // executions of the instruction at each address
+    uint64_t pcs[MEM_SIZE];
+    // the opcode last run at each address, and how often it ran straight
+    // after the one 2 bytes before it - the pairs worth fusing
+    uint16_t opCodeAt[MEM_SIZE];
+    uint64_t followOns[MEM_SIZE];
+    uint16_t lastPc;
+    uint64_t instructions;
+    // a frame runs from one tickTimers to the next
+    uint64_t frames;
+    uint64_t frameStart;
+    uint64_t minFrame;
+    uint64_t maxFrame;
+    uint64_t frameBuckets[PROFILE_FRAME_BUCKETS];
+} Profile;
+
+extern Profile profile;
+
+#define PROFILE_OPS(pc, opCode, count)                                                           \
+    (profile.opCodes[(opCode)] += (count), profile.pcs[(pc) & (MEM_SIZE - 1)] += (count),        \
+     profile.opCodeAt[(pc) & (MEM_SIZE - 1)] = (opCode),                                         \
+     profile.followOns[(pc) & (MEM_SIZE - 1)] += (uint16_t)((pc) - profile.lastPc) == 2 ? (count) : 0, \
+     profile.lastPc = (pc), profile.instructions += (count))
+#define PROFILE_OP(pc, opCode) PROFILE_OPS(pc, opCode, 1)
+#define PROFILE_FRAME() profileFrame()
+#define PROFILE_START() startProfile()
+#else
+#define PROFILE_OPS(pc, opCode, count) ((void)(pc), (void)(opCode), (void)(count))
+#define PROFILE_OP(pc, opCode) ((void)(pc), (void)(opCode))
+#define PROFILE_FRAME() ((void)0)
+#define PROFILE_START() ((void)0)
+#endif
+
+int
+loadROM(const char *fileName, uint8_t memory[]);
 
 void
-loadROM(char *fileName, uint8_t memory[]);
+tickTimers(State *state);
+
+uint32_t
+cyclesInFrame(uint32_t clockSpeed, uint64_t frame);
 
 void
 processOp(State *state, uint8_t memory[]);
 
+// the handlers processOp dispatches to, one per instruction
+void
+clearDisplay(State *state, uint8_t memory[]);
+
+void
+jumpToAddress(State *state, uint8_t opCodeB, uint8_t opCodeRight);
+
+void
+callSubroutine(State *state, uint8_t opCodeB, uint8_t opCodeRight);
+
+void
+returnFromSubroutine(State *state);
+
+void
+setRegister(State *state, uint8_t reg, uint8_t opCodeRight);
+
+void
+addToRegister(State *state, uint8_t reg, uint8_t opCodeRight);
+
+void
+jumpIfRegEqualToConst(State *state, uint8_t reg, uint8_t value);
+
+void
+jumpIfRegNotEqualToConst(State *state, uint8_t reg, uint8_t value);
+
+void
+jumpIfRegEqualToReg(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+jumpIfRegNotEqualToReg(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+setRegisterToRegister(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+setRegisterToBitwiseOr(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+setRegisterToBitwiseAnd(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+setRegisterToBitwiseXor(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+leftShift(State *state, uint8_t reg);
+
+void
+rightShift(State *state, uint8_t reg);
+
+void
+addRegisters(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+subtractRegisters(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+subtractRightFromLeft(State *state, uint8_t reg1, uint8_t reg2);
+
+void
+jumpIfKeyPressed(State *state, uint8_t reg);
+
+void
+jumpIfKeyNotPressed(State *state, uint8_t reg);
+
+void
+waitForKey(State *state, uint8_t reg);
+
+void
+setI(State *state, uint8_t top, uint8_t bottom);
+
+void
+addRegToI(State *state, uint8_t reg);
+
+void
+setPC(State *state, uint8_t top, uint8_t bottom);
+
+void
+saveRegisters(State *state, uint8_t reg, uint8_t memory[]);
+
+void
+loadRegisters(State *state, uint8_t reg, uint8_t memory[]);
+
+void
+getRandomNumber(State *state, uint8_t reg, uint8_t mask);
+
+void
+seedRandom(State *state, uint64_t seed);
+
+void
+setIToSprite(State *state, uint8_t reg);
+
+void
+setPixels2(State *state, uint8_t xReg, uint8_t yReg, uint8_t height, uint8_t memory[]);
+
+void
+setIToBCD(State *state, uint8_t reg, uint8_t memory[]);
+
+void
+setRegisterToDelayTimer(State *state, uint8_t reg);
+
+void
+setDelayTimerFromRegister(State *state, uint8_t reg);
+
+void
+setSoundTimerFromRegister(State *state, uint8_t reg);
+
+void
+scrollDown(State *state, uint8_t rows);
+
+void
+scrollUp(State *state, uint8_t rows);
+
+void
+scrollRight(State *state);
+
+void
+scrollLeft(State *state);
+
+void
+exitInterpreter(State *state);
+
+void
+setDisplayMode(State *state, bool hires);
+
+void
+setIToBigSprite(State *state, uint8_t reg);
+
+void
+saveFlags(State *state, uint8_t reg);
+
+void
+loadFlags(State *state, uint8_t reg);
+
+void
+selectPlanes(State *state, uint8_t planes);
+
+void
+initDecodeCache(DecodeCache *cache);
+
+void
+invalidateDecodeCache(DecodeCache *cache, uint16_t address, uint16_t length);
+
+void
+processOpCached(State *state, uint8_t memory[], DecodeCache *cache);
+
+uint32_t
+processOpsCached(State *state, uint8_t memory[], DecodeCache *cache, uint32_t numOps);
+
+uint32_t
+processOpsThreaded(State *state, uint8_t memory[], uint32_t numOps);
+
+Jit *
+createJit(void);
+
+void
+destroyJit(Jit *jit);
+
+void
+invalidateJit(Jit *jit, uint16_t address, uint16_t length);
+
+uint32_t
+runJit(Jit *jit, State *state, uint8_t memory[], uint32_t numOps);
+
+Aot *
+createAot(const AotProgram *program, const uint8_t memory[]);
+
+void
+destroyAot(Aot *aot);
+
+bool
+invalidateAot(Aot *aot, uint16_t address, uint16_t length);
+
+uint32_t
+runAot(Aot *aot, State *state, uint8_t memory[], uint32_t numOps);
+
+void
+initEngine(Engine *engine, EngineKind kind);
+
+void
+initAotEngine(Engine *engine, const AotProgram *program, const uint8_t memory[]);
+
+void
+freeEngine(Engine *engine);
+
+void
+invalidateEngine(Engine *engine, uint16_t address, uint16_t length);
+
+uint32_t
+runEngine(Engine *engine, State *state, uint8_t memory[], uint32_t numOps);
+
+void
+initLockstep(LockstepGroup *group, State *states[], uint8_t *memories[], int numLanes);
+
+uint64_t
+runLockstep(LockstepGroup *group, uint32_t numOps);
+
+void
+tickLockstepTimers(LockstepGroup *group);
+
+void
+syncLockstep(LockstepGroup *group);
+
+void
+stopLane(LockstepGroup *group, int lane);
+
+Trace *
+openTrace(const char *fileName, size_t capacity);
+
+bool
+closeTrace(Trace *trace);
+
+size_t
+traceStalls(const Trace *trace);
+
+uint32_t
+runTraced(Trace *trace, Engine *engine, State *state, uint8_t memory[], uint32_t numOps);
+
+void
+initDebugger(Debugger *debugger);
+
+bool
+addDebugCondition(Debugger *debugger, const State *state, uint8_t reg, DebugCompare compare, uint8_t value);
+
+uint32_t
+runDebugged(Debugger *debugger, Engine *engine, State *state, uint8_t memory[], uint32_t numOps);
+
+const char *
+debugStopName(DebugStop stop);
+
+void
+disassembleOp(char *out, size_t size, uint16_t opCode);
+
+void
+dumpDisassembly(FILE *out, const Debugger *debugger, const State *state, const uint8_t memory[], uint16_t address, int count);
+
+bool
+parseEngineKind(const char *name, EngineKind *kind);
+
+const char *
+engineKindName(EngineKind kind);
+
 void
 copySpritesToMemory(uint8_t memory[]);
 
+int
+displayWidth(const State *state);
+
+int
+displayHeight(const State *state);
+
+uint8_t
+getPixel(const State *state, int x, int y);
+
+bool
+saveState(const char *fileName, const State *state, const uint8_t memory[]);
+
+bool
+loadState(const char *fileName, State *state, uint8_t memory[]);
+
+bool
+initRewind(Rewind *rewind, size_t capacity, size_t maxFrames);
+
 void
-updateScreen(SDL_Renderer *renderer, SDL_Texture *texture, uint8_t memory[], uint32_t pixels[]);
+freeRewind(Rewind *rewind);
 
 void
-updateScreen2(SDL_Renderer *renderer, SDL_Texture *texture, bool myPixels[], uint32_t pixels[]);
+pushRewind(Rewind *rewind, const State *state, const uint8_t memory[]);
+
+bool
+stepBackRewind(Rewind *rewind, State *state, uint8_t memory[]);
+
+uint64_t
+hashState(const State *state, const uint8_t memory[]);
 
 void
-processInput(State * state, const uint8_t keyStates[]);
+dumpState(FILE *out, const State *state);
 
 void
-processEvent(State * state, SDL_Event *event);
+dumpDisplay(FILE *out, const State *state);
+
+void
+expandPixels(uint64_t plane0, uint64_t plane1, const uint32_t palette[4], uint32_t out[]);
+
+void
+upscaleRows(const State *state, int firstRow, int numRows, int scale, const uint32_t palette[4], uint32_t out[]);
+
+#ifdef CHIP8_PROFILE
+void
+startProfile(void);
+
+void
+resetProfile(void);
+
+void
+profileFrame(void);
+
+void
+dumpProfile(FILE *out);
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "mylib.h"
+
+// the execution profile: how often each kind of instruction ran, which
+// addresses are hot and how many instructions each frame took. The report
+// goes to stderr at exit, and whenever the process gets SIGUSR1
+
+#define PROFILE_HOT_PCS 20
+#define PROFILE_HOT_PAIRS 10
+
+Profile profile;
+
+// set by the signal handler, the report is written at the next frame
+static volatile sig_atomic_t dumpRequested = 0;
+
+// one entry per instruction, in the same order as processOp's switch
+static const struct
+{
+    uint16_t mask;
+    uint16_t value;
+    const char *name;
+} opClasses[] = {
+    {0xffff, 0x00e0, "00E0 clear"},
+    {0xffff, 0x00ee, "00EE return"},
+    {0xfff0, 0x00c0, "00CN scroll down"},
+    {0xfff0, 0x00d0, "00DN scroll up"},
+    {0xffff, 0x00fb, "00FB scroll right"},
+    {0xffff, 0x00fc, "00FC scroll left"},
+    {0xffff, 0x00fd, "00FD exit"},
+    {0xffff, 0x00fe, "00FE lo-res"},
+    {0xffff, 0x00ff, "00FF hi-res"},
+    {0xf000, 0x1000, "1NNN jump"},
+    {0xf000, 0x2000, "2NNN call"},
+    {0xf000, 0x3000, "3XNN skip if vx == nn"},
+    {0xf000, 0x4000, "4XNN skip if vx != nn"},
+    {0xf000, 0x5000, "5XY0 skip if vx == vy"},
+    {0xf000, 0x6000, "6XNN vx = nn"},
+    {0xf000, 0x7000, "7XNN vx += nn"},
+    {0xf00f, 0x8000, "8XY0 vx = vy"},
+    {0xf00f, 0x8001, "8XY1 vx |= vy"},
+    {0xf00f, 0x8002, "8XY2 vx &= vy"},
+    {0xf00f, 0x8003, "8XY3 vx ^= vy"},
+    {0xf00f, 0x8004, "8XY4 vx += vy"},
+    {0xf00f, 0x8005, "8XY5 vx -= vy"},
+    {0xf00f, 0x8006, "8XY6 vx >>= 1"},
+    {0xf00f, 0x8007, "8XY7 vx = vy - vx"},
+    {0xf00f, 0x800e, "8XYE vx <<= 1"},
+    {0xf000, 0x9000, "9XY0 skip if vx != vy"},
+    {0xf000, 0xa000, "ANNN i = nnn"},
+    {0xf000, 0xb000, "BNNN jump to v0 + nnn"},
+    {0xf000, 0xc000, "CXNN vx = rand & nn"},
+    {0xf00f, 0xd000, "DXY0 draw 16x16"},
+    {0xf000, 0xd000, "DXYN draw"},
+    {0xf0ff, 0xe09e, "EX9E skip if key vx"},
+    {0xf0ff, 0xe0a1, "EXA1 skip unless key vx"},
+    {0xf0ff, 0xf001, "FN01 select planes"},
+    {0xf0ff, 0xf007, "FX07 vx = delay"},
+    {0xf0ff, 0xf00a, "FX0A wait for key"},
+    {0xf0ff, 0xf015, "FX15 delay = vx"},
+    {0xf0ff, 0xf018, "FX18 sound = vx"},
+    {0xf0ff, 0xf01e, "FX1E i += vx"},
+    {0xf0ff, 0xf029, "FX29 i = sprite"},
+    {0xf0ff, 0xf030, "FX30 i = big sprite"},
+    {0xf0ff, 0xf033, "FX33 bcd"},
+    {0xf0ff, 0xf055, "FX55 save"},
+    {0xf0ff, 0xf065, "FX65 load"},
+    {0xf0ff, 0xf075, "FX75 save flags"},
+    {0xf0ff, 0xf085, "FX85 load flags"},
+};
+
+#define NUM_CLASSES (sizeof(opClasses) / sizeof(opClasses[0]))
+
+typedef struct
+{
+    int key;
+    uint64_t count;
+} Tally;
+
+static int compareTallies(const void *left, const void *right)
+{
+    // most first, ties in key order so the report is stable
+    const Tally *a = left, *b = right;
+    if (a->count != b->count)
+        return a->count < b->count ? 1 : -1;
+    return a->key - b->key;
+}
+
+static size_t classOf(uint16_t opCode)
+{
+    // anything that matches nothing ends up in the slot after the last
+    size_t idx = 0;
+    while (idx < NUM_CLASSES && (opCode & opClasses[idx].mask) != opClasses[idx].value)
+        idx++;
+    return idx;
+}
+
+static const char *className(size_t idx)
+{
+    return idx < NUM_CLASSES ? opClasses[idx].name : "unknown";
+}
+
+static double percent(uint64_t count, uint64_t total)
+{
+    return total > 0 ? 100.0 * count / total : 0.0;
+}
+
+static void onSignal(int signal)
+{
+    (void)signal;
+    dumpRequested = 1;
+}
+
+static void dumpAtExit(void)
+{
+    dumpProfile(stderr);
+}
+
+void startProfile(void)
+{
+    resetProfile();
+    atexit(dumpAtExit);
+    signal(SIGUSR1, onSignal);
+}
+
+void resetProfile(void)
+{
+    memset(&profile, 0x0, sizeof(Profile));
+    profile.minFrame = UINT64_MAX;
+}
+
+void profileFrame(void)
+{
+    uint64_t count = profile.instructions - profile.frameStart;
+    profile.frameStart = profile.instructions;
+    profile.frames++;
+    if (count < profile.minFrame)
+        profile.minFrame = count;
+    if (count > profile.maxFrame)
+        profile.maxFrame = count;
+    int bucket = 0;
+    while (bucket < PROFILE_FRAME_BUCKETS - 1 && count >= (2ull << bucket))
+        bucket++;
+    profile.frameBuckets[bucket]++;
+    if (dumpRequested)
+    {
+        dumpRequested = 0;
+        dumpProfile(stderr);
+    }
+}
+
+void dumpProfile(FILE *out)
+{
+    uint64_t total = profile.instructions;
+    fprintf(out, "profile: %llu instructions over %llu frames\n", (unsigned long long)total, (unsigned long long)profile.frames);
+
+    static Tally classes[NUM_CLASSES + 1];
+    for (size_t idx = 0; idx <= NUM_CLASSES; idx++)
+    {
+        classes[idx] = (Tally){.key = idx, .count = 0};
+    }
+    for (int opCode = 0; opCode < 0x10000; opCode++)
+    {
+        if (profile.opCodes[opCode] == 0)
+            continue;
+        classes[classOf(opCode)].count += profile.opCodes[opCode];
+    }
+    qsort(classes, NUM_CLASSES + 1, sizeof(Tally), compareTallies);
+    fprintf(out, "\nby instruction:\n");
+    for (size_t idx = 0; idx <= NUM_CLASSES && classes[idx].count > 0; idx++)
+    {
+        fprintf(out, "  %-28s %14llu %6.2f%%\n", className(classes[idx].key), (unsigned long long)classes[idx].count, percent(classes[idx].count, total));
+    }
+
+    static Tally pcs[MEM_SIZE];
+    for (int pc = 0; pc < MEM_SIZE; pc++)
+    {
+        pcs[pc] = (Tally){.key = pc, .count = profile.pcs[pc]};
+    }
+    qsort(pcs, MEM_SIZE, sizeof(Tally), compareTallies);
+    // a handful of addresses taking most of the time is a ROM spinning in a busy-wait loop
+    fprintf(out, "\nhottest addresses:\n");
+    uint64_t cumulative = 0;
+    for (int idx = 0; idx < PROFILE_HOT_PCS && pcs[idx].count > 0; idx++)
+    {
+        cumulative += pcs[idx].count;
+        fprintf(out, "  %03x %14llu %6.2f%% %6.2f%% cumulative\n", pcs[idx].key, (unsigned long long)pcs[idx].count,
+                percent(pcs[idx].count, total), percent(cumulative, total));
+    }
+
+    // instructions that keep running straight after one another, the
+    // candidates for fusing into one handler in the decode cache
+    static Tally pairs[(NUM_CLASSES + 1) * (NUM_CLASSES + 1)];
+    for (size_t idx = 0; idx < (NUM_CLASSES + 1) * (NUM_CLASSES + 1); idx++)
+    {
+        pairs[idx] = (Tally){.key = idx, .count = 0};
+    }
+    for (int pc = 2; pc < MEM_SIZE; pc++)
+    {
+        if (profile.followOns[pc] == 0)
+            continue;
+        size_t first = classOf(profile.opCodeAt[pc - 2]), second = classOf(profile.opCodeAt[pc]);
+        pairs[first * (NUM_CLASSES + 1) + second].count += profile.followOns[pc];
+    }
+    qsort(pairs, (NUM_CLASSES + 1) * (NUM_CLASSES + 1), sizeof(Tally), compareTallies);
+    fprintf(out, "\nhottest pairs:\n");
+    for (int idx = 0; idx < PROFILE_HOT_PAIRS && pairs[idx].count > 0; idx++)
+    {
+        fprintf(out, "  %-28s then %-28s %14llu %6.2f%%\n", className(pairs[idx].key / (NUM_CLASSES + 1)),
+                className(pairs[idx].key % (NUM_CLASSES + 1)), (unsigned long long)pairs[idx].count,
+                percent(pairs[idx].count, total));
+    }
+
+    if (profile.frames > 0)
+    {
+        fprintf(out, "\ninstructions per frame: min %llu, mean %.1f, max %llu\n", (unsigned long long)profile.minFrame,
+                (double)(profile.frameStart) / profile.frames, (unsigned long long)profile.maxFrame);
+        for (int bucket = 0; bucket < PROFILE_FRAME_BUCKETS; bucket++)
+        {
+            if (profile.frameBuckets[bucket] == 0)
+                continue;
+            uint64_t low = bucket == 0 ? 0 : 1ull << bucket;
+            fprintf(out, "  %6llu+ %14llu frames %6.2f%%\n", (unsigned long long)low, (unsigned long long)profile.frameBuckets[bucket],
+                    percent(profile.frameBuckets[bucket], profile.frames));
+        }
+    }
+    fflush(out);
+}
@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mylib.h"
+
+// rewind history: one snapshot per frame in a fixed size ring buffer
+//
+// A snapshot is an image of the State (display included) followed by memory.
+// Every REWIND_KEYFRAME_INTERVAL frames the image is stored as is, in
+// between only its XOR against the last keyframe is stored. Either way it's
+// run-length encoded as (zero run, literal run, literal bytes) with varint
+// lengths, so a frame where little changed costs a handful of bytes.
+
+static uint8_t *putVarint(uint8_t *out, size_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static const uint8_t *getVarint(const uint8_t *in, size_t *value)
+{
+    *value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        *value |= (size_t)(*in & 0x7f) << shift;
+        if (!(*in++ & 0x80))
+            return in;
+    }
+}
+
+// encodes image ^ base, returns the number of bytes written to out
+static size_t encodeDelta(const uint8_t *image, const uint8_t *base, uint8_t *out)
+{
+    uint8_t *start = out;
+    size_t pos = 0;
+    while (pos < REWIND_IMAGE_SIZE)
+    {
+        size_t zeros = 0;
+        while (pos + zeros < REWIND_IMAGE_SIZE && image[pos + zeros] == base[pos + zeros])
+            zeros++;
+        pos += zeros;
+        // a literal run ends at the first pair of unchanged bytes, a single one
+        // costs less to carry along than a new header
+        size_t literals = 0;
+        while (pos + literals < REWIND_IMAGE_SIZE &&
+               (image[pos + literals] != base[pos + literals] ||
+                (pos + literals + 1 < REWIND_IMAGE_SIZE && image[pos + literals + 1] != base[pos + literals + 1])))
+            literals++;
+        out = putVarint(out, zeros);
+        out = putVarint(out, literals);
+        for (size_t idx = 0; idx < literals; idx++)
+        {
+            *out++ = image[pos + idx] ^ base[pos + idx];
+        }
+        pos += literals;
+    }
+    return out - start;
+}
+
+// XORs an encoded delta into image
+static void applyDelta(const uint8_t *in, size_t length, uint8_t *image)
+{
+    const uint8_t *end = in + length;
+    size_t pos = 0;
+    while (in < end)
+    {
+        size_t zeros, literals;
+        in = getVarint(in, &zeros);
+        in = getVarint(in, &literals);
+        pos += zeros;
+        for (size_t idx = 0; idx < literals; idx++)
+        {
+            image[pos++] ^= *in++;
+        }
+    }
+}
+
+static void makeImage(uint8_t *image, const State *state, const uint8_t memory[])
+{
+    memcpy(image, state, sizeof(State));
+    memcpy(image + sizeof(State), memory, MEM_SIZE);
+}
+
+bool initRewind(Rewind *rewind, size_t capacity, size_t maxFrames)
+{
+    memset(rewind, 0x0, sizeof(Rewind));
+    rewind->arena = malloc(capacity);
+    rewind->entries = malloc(maxFrames * sizeof(RewindEntry));
+    rewind->keyframe = malloc(REWIND_IMAGE_SIZE);
+    rewind->scratch = malloc(REWIND_MAX_ENCODED > REWIND_IMAGE_SIZE ? REWIND_MAX_ENCODED : REWIND_IMAGE_SIZE);
+    rewind->capacity = capacity;
+    rewind->maxFrames = maxFrames;
+    rewind->needKeyframe = true;
+    if (rewind->arena == NULL || rewind->entries == NULL || rewind->keyframe == NULL || rewind->scratch == NULL ||
+        capacity < REWIND_MIN_CAPACITY || maxFrames == 0)
+    {
+        freeRewind(rewind);
+        return false;
+    }
+    return true;
+}
+
+void freeRewind(Rewind *rewind)
+{
+    free(rewind->arena);
+    free(rewind->entries);
+    free(rewind->keyframe);
+    free(rewind->scratch);
+    memset(rewind, 0x0, sizeof(Rewind));
+}
+
+static RewindEntry *entryAt(const Rewind *rewind, size_t idx)
+{
+    // idx 0 is the oldest snapshot we still have
+    return &rewind->entries[(rewind->first + idx) % rewind->maxFrames];
+}
+
+static void dropOldest(Rewind *rewind)
+{
+    rewind->first = (rewind->first + 1) % rewind->maxFrames;
+    rewind->count--;
+    // deltas are no use without their keyframe
+    while (rewind->count > 0 && entryAt(rewind, 0)->sinceKeyframe != 0)
+    {
+        rewind->first = (rewind->first + 1) % rewind->maxFrames;
+        rewind->count--;
+    }
+}
+
+void pushRewind(Rewind *rewind, const State *state, const uint8_t memory[])
+{
+    uint8_t image[REWIND_IMAGE_SIZE];
+    makeImage(image, state, memory);
+    bool keyframe = rewind->needKeyframe || rewind->sinceKeyframe + 1 >= REWIND_KEYFRAME_INTERVAL;
+
+    // the arena is used in order, wrapping to the start when the snapshot
+    // doesn't fit in what's left at the end, and the oldest snapshots give
+    // way to the new one
+    if (rewind->count == rewind->maxFrames)
+        dropOldest(rewind);
+    uint32_t offset, length;
+    for (;;)
+    {
+        if (keyframe)
+            memset(rewind->keyframe, 0x0, REWIND_IMAGE_SIZE);
+        length = encodeDelta(image, rewind->keyframe, rewind->scratch);
+        offset = rewind->head;
+        if (offset + length > rewind->capacity)
+            offset = 0;
+        while (rewind->count > 0)
+        {
+            const RewindEntry *oldest = entryAt(rewind, 0);
+            bool overlaps = oldest->offset < offset + length && offset < oldest->offset + oldest->length;
+            if (!overlaps)
+                break;
+            dropOldest(rewind);
+        }
+        // a delta is no use if its keyframe just gave way, so it becomes one
+        if (keyframe || rewind->count >= rewind->sinceKeyframe + 1u)
+            break;
+        keyframe = true;
+    }
+    if (keyframe)
+    {
+        memcpy(rewind->keyframe, image, REWIND_IMAGE_SIZE);
+        rewind->sinceKeyframe = 0;
+        rewind->needKeyframe = false;
+    }
+    else
+    {
+        rewind->sinceKeyframe++;
+    }
+    memcpy(rewind->arena + offset, rewind->scratch, length);
+    rewind->head = offset + length;
+    *entryAt(rewind, rewind->count) = (RewindEntry){.offset = offset, .length = length, .sinceKeyframe = rewind->sinceKeyframe};
+    rewind->count++;
+}
+
+bool stepBackRewind(Rewind *rewind, State *state, uint8_t memory[])
+{
+    // restores the newest snapshot and drops it, so each call goes back a frame
+    if (rewind->count == 0)
+        return false;
+    const RewindEntry *entry = entryAt(rewind, rewind->count - 1);
+    const RewindEntry *keyframe = entryAt(rewind, rewind->count - 1 - entry->sinceKeyframe);
+    uint8_t *image = rewind->scratch;
+    memset(image, 0x0, REWIND_IMAGE_SIZE);
+    applyDelta(rewind->arena + keyframe->offset, keyframe->length, image);
+    if (entry != keyframe)
+        applyDelta(rewind->arena + entry->offset, entry->length, image);
+
+    // keys and quit are live, not history
+    State live = *state;
+    memcpy(state, image, sizeof(State));
+    memcpy(memory, image + sizeof(State), MEM_SIZE);
+    state->keys = live.keys;
+    state->quit = live.quit;
+    state->draw = true;
+    state->dirtyRows = ALL_ROWS_DIRTY;
+
+    rewind->count--;
+    rewind->head = entry->offset;
+    // the keyframe new deltas would be against may have just been dropped
+    rewind->needKeyframe = true;
+    return true;
+}
@@ -0,0 +1,226 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mylib.h"
+
+// a save state is a fixed header followed by the payload, everything little endian:
+//
+//   "CH8S"   magic
+//   u16      version
+//   u16      reserved, 0
+//   u32      payload size
+//   u64      FNV-1a of the payload
+//   payload  registers, i, pc, sp, stack, delay timer, sound timer, halted,
+//            bad opcode, rng (4 x u32), hires, planes, user flags (16),
+//            display words plane by plane and row by row, memory
+//
+// keys, draw and dirtyRows aren't saved: they're set again on the first
+// frame after loading
+
+#define SAVE_STATE_MAGIC "CH8S"
+#define SAVE_STATE_HEADER_SIZE 20
+#define SAVE_STATE_DISPLAY_WORDS (DISPLAY_PLANES * HIRES_HEIGHT * DISPLAY_WORDS)
+#define SAVE_STATE_PAYLOAD_SIZE (16 + 2 + 2 + 1 + 12 * 2 + 1 + 1 + 1 + 2 + 4 * 4 + 1 + 1 + 16 + SAVE_STATE_DISPLAY_WORDS * 8 + MEM_SIZE)
+
+static uint8_t *putBytes(uint8_t *out, const void *bytes, size_t length)
+{
+    memcpy(out, bytes, length);
+    return out + length;
+}
+
+static uint8_t *putLE(uint8_t *out, uint64_t value, int size)
+{
+    for (int byte = 0; byte < size; byte++)
+    {
+        *out++ = (value >> (8 * byte)) & 0xff;
+    }
+    return out;
+}
+
+static const uint8_t *getLE(const uint8_t *in, uint64_t *value, int size)
+{
+    *value = 0;
+    for (int byte = 0; byte < size; byte++)
+    {
+        *value |= (uint64_t)in[byte] << (8 * byte);
+    }
+    return in + size;
+}
+
+static uint64_t checksum(const uint8_t *bytes, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t idx = 0; idx < length; idx++)
+    {
+        hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static void encodeState(uint8_t *out, const State *state, const uint8_t memory[])
+{
+    uint8_t *payload = out + SAVE_STATE_HEADER_SIZE;
+    uint8_t *p = payload;
+    p = putBytes(p, state->registers, 16);
+    p = putLE(p, state->i, 2);
+    p = putLE(p, state->pc, 2);
+    p = putLE(p, state->sp, 1);
+    for (int level = 0; level < 12; level++)
+    {
+        p = putLE(p, state->stack[level], 2);
+    }
+    p = putLE(p, state->delay_timer, 1);
+    p = putLE(p, state->sound_timer, 1);
+    p = putLE(p, state->halted, 1);
+    p = putLE(p, state->badOpcode, 2);
+    for (int word = 0; word < 4; word++)
+    {
+        p = putLE(p, state->rng[word], 4);
+    }
+    p = putLE(p, state->hires, 1);
+    p = putLE(p, state->planes, 1);
+    p = putBytes(p, state->flags, 16);
+    const uint64_t *words = &state->pixels[0][0][0];
+    for (int word = 0; word < SAVE_STATE_DISPLAY_WORDS; word++)
+    {
+        p = putLE(p, words[word], 8);
+    }
+    putBytes(p, memory, MEM_SIZE);
+
+    p = putBytes(out, SAVE_STATE_MAGIC, 4);
+    p = putLE(p, SAVE_STATE_VERSION, 2);
+    p = putLE(p, 0, 2);
+    p = putLE(p, SAVE_STATE_PAYLOAD_SIZE, 4);
+    putLE(p, checksum(payload, SAVE_STATE_PAYLOAD_SIZE), 8);
+}
+
+static bool decodeState(const uint8_t *in, size_t length, State *state, uint8_t memory[])
+{
+    uint64_t version, reserved, payloadSize, sum, value;
+    if (length < SAVE_STATE_HEADER_SIZE || memcmp(in, SAVE_STATE_MAGIC, 4) != 0)
+        return false;
+    const uint8_t *p = getLE(in + 4, &version, 2);
+    p = getLE(p, &reserved, 2);
+    p = getLE(p, &payloadSize, 4);
+    p = getLE(p, &sum, 8);
+    if (version != SAVE_STATE_VERSION || payloadSize != SAVE_STATE_PAYLOAD_SIZE ||
+        length - SAVE_STATE_HEADER_SIZE < payloadSize || checksum(p, payloadSize) != sum)
+        return false;
+    // the checksum only catches accidents, a pc, I or stack pointer out of
+    // range would have the engines reading and writing past their arrays
+    uint64_t i, pc, sp;
+    const uint8_t *q = getLE(p + 16, &i, 2);
+    q = getLE(q, &pc, 2);
+    getLE(q, &sp, 1);
+    if (i >= MEM_SIZE || pc > MEM_SIZE - 2 || sp > 12)
+        return false;
+
+    // only touch the caller's state once we know the file is good
+    memset(state, 0x0, sizeof(State));
+    memcpy(state->registers, p, 16);
+    p += 16;
+    p = getLE(p, &value, 2);
+    state->i = value;
+    p = getLE(p, &value, 2);
+    state->pc = value;
+    p = getLE(p, &value, 1);
+    state->sp = value;
+    for (int level = 0; level < 12; level++)
+    {
+        p = getLE(p, &value, 2);
+        state->stack[level] = value;
+    }
+    p = getLE(p, &value, 1);
+    state->delay_timer = value;
+    p = getLE(p, &value, 1);
+    state->sound_timer = value;
+    p = getLE(p, &value, 1);
+    state->halted = value != 0;
+    p = getLE(p, &value, 2);
+    state->badOpcode = value;
+    for (int word = 0; word < 4; word++)
+    {
+        p = getLE(p, &value, 4);
+        state->rng[word] = value;
+    }
+    p = getLE(p, &value, 1);
+    state->hires = value != 0;
+    p = getLE(p, &value, 1);
+    state->planes = value & 0x3;
+    memcpy(state->flags, p, 16);
+    p += 16;
+    uint64_t *words = &state->pixels[0][0][0];
+    for (int word = 0; word < SAVE_STATE_DISPLAY_WORDS; word++)
+    {
+        p = getLE(p, &words[word], 8);
+    }
+    memcpy(memory, p, MEM_SIZE);
+    // the whole screen needs redrawing
+    state->draw = true;
+    state->dirtyRows = ALL_ROWS_DIRTY;
+    return true;
+}
+
+bool saveState(const char *fileName, const State *state, const uint8_t memory[])
+{
+    // written to a temporary file next to the real one and renamed over it,
+    // so a crash part way through never leaves a truncated save behind
+    uint8_t buffer[SAVE_STATE_HEADER_SIZE + SAVE_STATE_PAYLOAD_SIZE];
+    encodeState(buffer, state, memory);
+
+    size_t nameLength = strlen(fileName);
+    char *tmpName = malloc(nameLength + 8);
+    if (tmpName == NULL)
+        return false;
+    snprintf(tmpName, nameLength + 8, "%s.XXXXXX", fileName);
+    int fd = mkstemp(tmpName);
+    if (fd < 0)
+    {
+        free(tmpName);
+        return false;
+    }
+    size_t written = 0;
+    while (written < sizeof(buffer))
+    {
+        ssize_t n = write(fd, buffer + written, sizeof(buffer) - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    bool ok = written == sizeof(buffer) && fsync(fd) == 0;
+    // mkstemp creates the file 0600, saves are shared like any other file
+    ok = ok && fchmod(fd, 0644) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmpName, fileName) == 0;
+    if (!ok)
+        unlink(tmpName);
+    free(tmpName);
+    return ok;
+}
+
+bool loadState(const char *fileName, State *state, uint8_t memory[])
+{
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < SAVE_STATE_HEADER_SIZE)
+    {
+        close(fd);
+        return false;
+    }
+    // mapped rather than read, so the payload is decoded straight out of the page cache
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    bool ok = decodeState(mapped, info.st_size, state, memory);
+    munmap(mapped, info.st_size);
+    return ok;
+}
@@ -0,0 +1,205 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "mylib.h"
+
+// binary execution trace: one fixed size record per instruction, written to
+// a single producer single consumer ring by the emulation thread and drained
+// to a file by a background thread, see tracedump.c for reading it back
+//
+// the file is a header followed by records, everything little endian:
+//
+//   "CH8T"   magic
+//   u16      version
+//   u16      record size
+//   records  u16 pc, u16 opcode, u16 i, u8 vx, u8 vf - after the instruction ran,
+//            where x is the second nibble of the opcode
+
+#define TRACE_MAGIC "CH8T"
+#define TRACE_VERSION 1
+// records are drained this many at a time
+#define TRACE_CHUNK 4096
+
+typedef struct {
+    uint16_t pc;
+    uint16_t opCode;
+    uint16_t i;
+    uint8_t vx;
+    uint8_t vf;
+} TraceRecord;
+
+struct Trace {
+    TraceRecord *records;
+    // a power of two
+    size_t capacity;
+    // total records written and read, the ring index is these mod capacity.
+    // Each lives on its own cache line so the two threads don't fight over it
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    // the producer's last look at tail, so it only touches the shared one when the ring seems full
+    _Alignas(64) size_t cachedTail;
+    // times the producer found the ring full and had to wait for the drain thread
+    size_t stalls;
+    atomic_bool stop;
+    bool ok;
+    FILE *out;
+    pthread_t thread;
+};
+
+static void putLE16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+}
+
+static void waitForRecords(void)
+{
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 200000};
+    nanosleep(&delay, NULL);
+}
+
+static void *drainTrace(void *arg)
+{
+    Trace *trace = arg;
+    static const size_t recordSize = 8;
+    uint8_t *buffer = malloc(TRACE_CHUNK * recordSize);
+    size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    for (;;)
+    {
+        // stop is checked before head, so nothing written before closeTrace is missed
+        bool stopping = atomic_load_explicit(&trace->stop, memory_order_acquire);
+        size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (stopping)
+                break;
+            waitForRecords();
+            continue;
+        }
+        size_t count = head - tail;
+        if (count > TRACE_CHUNK)
+            count = TRACE_CHUNK;
+        for (size_t idx = 0; idx < count; idx++)
+        {
+            const TraceRecord *record = &trace->records[(tail + idx) & (trace->capacity - 1)];
+            uint8_t *out = buffer + idx * recordSize;
+            putLE16(out, record->pc);
+            putLE16(out + 2, record->opCode);
+            putLE16(out + 4, record->i);
+            out[6] = record->vx;
+            out[7] = record->vf;
+        }
+        tail += count;
+        // the slots can be reused as soon as they're copied out
+        atomic_store_explicit(&trace->tail, tail, memory_order_release);
+        if (fwrite(buffer, recordSize, count, trace->out) != count)
+            trace->ok = false;
+    }
+    free(buffer);
+    return NULL;
+}
+
+Trace *openTrace(const char *fileName, size_t capacity)
+{
+    // capacity is rounded up to a power of two
+    size_t rounded = TRACE_CHUNK;
+    while (rounded < capacity)
+        rounded <<= 1;
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL)
+        return NULL;
+    trace->records = malloc(rounded * sizeof(TraceRecord));
+    trace->out = fopen(fileName, "wb");
+    if (trace->records == NULL || trace->out == NULL)
+    {
+        if (trace->out != NULL)
+            fclose(trace->out);
+        free(trace->records);
+        free(trace);
+        return NULL;
+    }
+    trace->capacity = rounded;
+    trace->ok = true;
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stop, false);
+
+    uint8_t header[8];
+    memcpy(header, TRACE_MAGIC, 4);
+    putLE16(header + 4, TRACE_VERSION);
+    putLE16(header + 6, 8);
+    if (fwrite(header, 1, sizeof(header), trace->out) != sizeof(header) ||
+        pthread_create(&trace->thread, NULL, drainTrace, trace) != 0)
+    {
+        fclose(trace->out);
+        free(trace->records);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+bool closeTrace(Trace *trace)
+{
+    // waits for everything recorded to reach the file, returns false if any of it didn't
+    atomic_store_explicit(&trace->stop, true, memory_order_release);
+    pthread_join(trace->thread, NULL);
+    bool ok = trace->ok;
+    ok = fclose(trace->out) == 0 && ok;
+    free(trace->records);
+    free(trace);
+    return ok;
+}
+
+size_t traceStalls(const Trace *trace)
+{
+    return trace->stalls;
+}
+
+uint32_t runTraced(Trace *trace, Engine *engine, State *state, uint8_t memory[], uint32_t numOps)
+{
+    // processOp one instruction at a time, with a record after each
+    size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint32_t executed = 0;
+    for (; executed < numOps; executed++)
+    {
+        uint16_t pc = state->pc;
+        // fetched the way processOp does, wrapping a pc past the end of memory
+        uint16_t opCode = (memory[pc & (MEM_SIZE - 1)] << 8) | memory[(pc + 1) & (MEM_SIZE - 1)];
+        processOp(state, memory);
+        // Fx33/Fx55 may have overwritten code the engine has decoded
+        if ((opCode & 0xf0ff) == 0xf033 || (opCode & 0xf0ff) == 0xf055)
+            invalidateEngine(engine, state->i, (opCode & 0xff) == 0x33 ? 3 : ((opCode >> 8) & 0xf) + 1);
+
+        while (head - trace->cachedTail == trace->capacity)
+        {
+            trace->cachedTail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+            if (head - trace->cachedTail == trace->capacity)
+            {
+                // let the drain thread catch up, publishing what we have so far
+                atomic_store_explicit(&trace->head, head, memory_order_release);
+                trace->stalls++;
+                sched_yield();
+            }
+        }
+        TraceRecord *record = &trace->records[head & (trace->capacity - 1)];
+        record->pc = pc;
+        record->opCode = opCode;
+        record->i = state->i;
+        record->vx = state->registers[(opCode >> 8) & 0xf];
+        record->vf = state->registers[0xf];
+        head++;
+        // published every instruction, on x86 a release store is a plain mov
+        atomic_store_explicit(&trace->head, head, memory_order_release);
+        // the unknown opcode is recorded, it's usually what we're looking for
+        if (state->halted)
+            break;
+    }
+    return executed;
+}
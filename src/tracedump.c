@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mylib.h"
+
+// decodes a trace written by chip8 --trace or chip8-headless --trace to text,
+// one line per instruction, see trace.c for the format
+
+#define RECORD_SIZE 8
+
+// writes the instruction and what it did in a form like
+// "8124  add  v1, v2   v1=07 vf=00", given its record
+static void describe(char *out, size_t size, uint16_t opCode, uint16_t i, uint8_t vx, uint8_t vf)
+{
+    int x = (opCode >> 8) & 0xf, n = opCode & 0xf, nn = opCode & 0xff;
+    char text[32];
+    disassembleOp(text, sizeof(text), opCode);
+    // what the instruction changed, if anything
+    char effect[32] = "";
+    switch (opCode >> 12)
+    {
+    case (0x6):
+    case (0x7):
+    case (0xc):
+        snprintf(effect, sizeof(effect), "v%x=%02x", x, vx);
+        break;
+    case (0x8):
+        // 8xy4 and on set the flag as well
+        if (n >= 0x4 && (n <= 0x7 || n == 0xe))
+            snprintf(effect, sizeof(effect), "v%x=%02x vf=%02x", x, vx, vf);
+        else if (n < 0x4)
+            snprintf(effect, sizeof(effect), "v%x=%02x", x, vx);
+        break;
+    case (0xa):
+        snprintf(effect, sizeof(effect), "i=%03x", i);
+        break;
+    case (0xd):
+        snprintf(effect, sizeof(effect), "vf=%02x", vf);
+        break;
+    case (0xf):
+        if (nn == 0x07 || nn == 0x0a || nn == 0x65 || nn == 0x85)
+            snprintf(effect, sizeof(effect), "v%x=%02x", x, vx);
+        else if (nn == 0x1e || nn == 0x29 || nn == 0x30)
+            snprintf(effect, sizeof(effect), "i=%03x", i);
+        break;
+    }
+    if (effect[0] == '\0')
+        snprintf(out, size, "%04x  %s", opCode, text);
+    else
+        snprintf(out, size, "%04x  %-16s %s", opCode, text, effect);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s trace\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+    uint8_t header[8];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "CH8T", 4) != 0 ||
+        (header[4] | header[5] << 8) != 1 || (header[6] | header[7] << 8) != RECORD_SIZE)
+    {
+        fprintf(stderr, "%s is not a version 1 trace\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    // read in large chunks, traces run to millions of records
+    static uint8_t records[4096 * RECORD_SIZE];
+    size_t count, index = 0;
+    char line[96];
+    while ((count = fread(records, RECORD_SIZE, 4096, fp)) > 0)
+    {
+        for (size_t idx = 0; idx < count; idx++)
+        {
+            const uint8_t *record = records + idx * RECORD_SIZE;
+            uint16_t pc = record[0] | record[1] << 8;
+            uint16_t opCode = record[2] | record[3] << 8;
+            uint16_t i = record[4] | record[5] << 8;
+            describe(line, sizeof(line), opCode, i, record[6], record[7]);
+            printf("%10zu  %03x  %s\n", index++, pc, line);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+#include "mylib.h"
+
+// turns the display's bitplanes into 32-bit colours, scaled up by a whole
+// number so the renderer only ever has to copy the result
+//
+// Expanding works on VEC_PIXELS pixels at a time: each plane's bits are
+// broadcast to every lane, each lane tests its own bit, and the masks pick
+// one of the four palette colours. Scaling repeats each colour with
+// overlapping stores of a vector full of it, then copies the finished line
+// down for the rest of the row.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i Vec;
+#define VEC_PIXELS 8
+static inline Vec vecSplat(uint32_t colour) { return _mm256_set1_epi32((int)colour); }
+static inline void vecStore(uint32_t *p, Vec v) { _mm256_storeu_si256((__m256i *)p, v); }
+// all ones in the lanes whose bit is set in the low VEC_PIXELS bits, leftmost in the top one
+static inline Vec vecMask(uint32_t bits)
+{
+    const __m256i lanes = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+    return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int)bits), lanes), lanes);
+}
+static inline Vec vecSelect(Vec mask, Vec set, Vec clear) { return _mm256_blendv_epi8(clear, set, mask); }
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i Vec;
+#define VEC_PIXELS 4
+static inline Vec vecSplat(uint32_t colour) { return _mm_set1_epi32((int)colour); }
+static inline void vecStore(uint32_t *p, Vec v) { _mm_storeu_si128((__m128i *)p, v); }
+static inline Vec vecMask(uint32_t bits)
+{
+    const __m128i lanes = _mm_setr_epi32(0x8, 0x4, 0x2, 0x1);
+    return _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)bits), lanes), lanes);
+}
+static inline Vec vecSelect(Vec mask, Vec set, Vec clear) { return _mm_or_si128(_mm_and_si128(mask, set), _mm_andnot_si128(mask, clear)); }
+#else
+// no SIMD, one pixel at a time
+typedef uint32_t Vec;
+#define VEC_PIXELS 1
+static inline Vec vecSplat(uint32_t colour) { return colour; }
+static inline void vecStore(uint32_t *p, Vec v) { *p = v; }
+static inline Vec vecMask(uint32_t bits) { return bits ? 0xffffffffu : 0x0; }
+static inline Vec vecSelect(Vec mask, Vec set, Vec clear) { return (mask & set) | (~mask & clear); }
+#endif
+
+#define LANE_BITS ((1u << VEC_PIXELS) - 1)
+
+void expandPixels(uint64_t plane0, uint64_t plane1, const uint32_t palette[4], uint32_t out[])
+{
+    // 64 pixels, coloured palette[plane0 bit | plane1 bit << 1]. The leftmost
+    // is the top bit of each word
+    Vec colours[4];
+    for (int colour = 0; colour < 4; colour++)
+    {
+        colours[colour] = vecSplat(palette[colour]);
+    }
+    if (plane1 == 0)
+    {
+        // nothing in the second plane, which is every base CHIP-8 ROM
+        for (int x = 0; x < 64; x += VEC_PIXELS)
+        {
+            Vec mask = vecMask((plane0 >> (64 - VEC_PIXELS - x)) & LANE_BITS);
+            vecStore(out + x, vecSelect(mask, colours[1], colours[0]));
+        }
+        return;
+    }
+    for (int x = 0; x < 64; x += VEC_PIXELS)
+    {
+        Vec mask0 = vecMask((plane0 >> (64 - VEC_PIXELS - x)) & LANE_BITS);
+        Vec mask1 = vecMask((plane1 >> (64 - VEC_PIXELS - x)) & LANE_BITS);
+        Vec first = vecSelect(mask0, colours[1], colours[0]);
+        Vec second = vecSelect(mask0, colours[3], colours[2]);
+        vecStore(out + x, vecSelect(mask1, second, first));
+    }
+}
+
+void upscaleRows(const State *state, int firstRow, int numRows, int scale, const uint32_t palette[4], uint32_t out[])
+{
+    // out is displayWidth * scale pixels wide
+    int width = displayWidth(state), words = width / 64;
+    size_t lineWidth = (size_t)width * scale;
+    uint32_t colours[HIRES_WIDTH];
+    for (int y = firstRow; y < firstRow + numRows; y++)
+    {
+        uint32_t *line = out + y * scale * lineWidth;
+        uint32_t *expanded = scale == 1 ? line : colours;
+        for (int word = 0; word < words; word++)
+        {
+            expandPixels(state->pixels[0][y][word], state->pixels[1][y][word], palette, expanded + word * 64);
+        }
+        if (scale == 1)
+            continue;
+        // a pixel's last store can run past it, into pixels written after it
+        // or, for the last one, into the next line which is copied over below
+        for (int x = 0; x < width; x++)
+        {
+            Vec colour = vecSplat(colours[x]);
+            uint32_t *pixel = line + x * scale;
+            for (int offset = 0; offset < scale; offset += VEC_PIXELS)
+            {
+                vecStore(pixel + offset, colour);
+            }
+        }
+        for (int copy = 1; copy < scale; copy++)
+        {
+            memcpy(line + copy * lineWidth, line, lineWidth * sizeof(uint32_t));
+        }
+    }
+}
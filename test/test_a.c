@@ -2,9 +2,14 @@
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <cmocka.h>
 #include "mylib.h"
 
+// test/aot.ch8, compiled by chip8-aot when the tests are built
+extern const AotProgram testAotProgram;
+
 static void test_clear_display(void **state)
 {
     /*
@@ -333,7 +338,7 @@ static void test_keyboard(void **state)
     memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
 
     // check that key 1 is depressed
-    assert_int_equal(chip8State.input[1], false);
+    assert_false((chip8State.keys >> 1) & 0x1);
     // set the register
     processOp(&chip8State, memory);
     // skip 0x0204 if the key is pressed (which it isn't)
@@ -344,7 +349,7 @@ static void test_keyboard(void **state)
 
     // now run through this again but setting the key as pressed
     State chip8State2 = {.pc = ROM_OFFSET};
-    chip8State2.input[0x1] = true;
+    chip8State2.keys = 1 << 0x1;
 
     processOp(&chip8State2, memory);
     // skip 0x0204 if the key is pressed (which it is this time)
@@ -372,7 +377,7 @@ static void test_keyboard_blocking(void **state)
     processOp(&chip8State, memory);
     assert_int_equal(chip8State.pc, ROM_OFFSET);
     // simulate a key getting pressed
-    chip8State.input[1] = true;
+    chip8State.keys = 1 << 1;
     // check again
     processOp(&chip8State, memory);
     // we should now proceed to the next instruction
@@ -477,20 +482,35 @@ static void test_rand(void **state)
     /*
     The test ROM will look like this:
         0x0200 0xc50f # generate a random number between 0-255 & 0x0f
+        0x0202 0xc50f # and again
     */
 
     // init
     State chip8State = {.pc = ROM_OFFSET};
     uint8_t memory[MEM_SIZE];
     memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
-    uint8_t rom[] = {0xc5, 0x0f};
+    uint8_t rom[] = {0xc5, 0x0f, 0xc5, 0x0f};
     memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
 
     processOp(&chip8State, memory);
-    // set the seed so we always get the same random number
-    srand(0xdeadbeef);
     assert_in_range(chip8State.registers[0x5],0x0,0xf);
-    assert_int_equal(chip8State.registers[0x5],0x7);
+    // each VM has its own generator, so the same starting state gives the same numbers
+    State otherState = {.pc = ROM_OFFSET};
+    processOp(&otherState, memory);
+    assert_int_equal(chip8State.registers[0x5], otherState.registers[0x5]);
+    // and it moves on after each call
+    processOp(&chip8State, memory);
+    assert_memory_not_equal(chip8State.rng, otherState.rng, sizeof(chip8State.rng));
+    // seeding starts the sequence over, the same seed giving the same numbers
+    seedRandom(&chip8State, 42);
+    seedRandom(&otherState, 42);
+    chip8State.pc = otherState.pc = ROM_OFFSET;
+    processOp(&chip8State, memory);
+    processOp(&otherState, memory);
+    assert_memory_equal(chip8State.rng, otherState.rng, sizeof(chip8State.rng));
+    assert_int_equal(chip8State.registers[0x5], otherState.registers[0x5]);
+    seedRandom(&otherState, 43);
+    assert_memory_not_equal(chip8State.rng, otherState.rng, sizeof(chip8State.rng));
 }
 
 static void test_set_sprite(void **state)
@@ -590,6 +610,1458 @@ static void test_bcd(void **state)
     assert_int_equal(memory[chip8State.i+2], 9);
 }
 
+static void test_decode_cache(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6105 # set r1 to 0x5
+        0x0202 0x7101 # add 0x1 to r1
+        0x0204 0x3108 # skip the next instruction if r1 is 0x8
+        0x0206 0x1202 # jump back to 0x202
+        0x0208 0x8210 # set r2 to r1
+
+    Running it through the cache should give the same result as processOp
+    */
+
+    // init
+    State chip8State = {.pc = ROM_OFFSET};
+    State cachedState = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0x61, 0x05, 0x71, 0x01, 0x31, 0x08, 0x12, 0x02, 0x82, 0x10};
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+    DecodeCache cache;
+    initDecodeCache(&cache);
+
+    // the first instruction, two full trips round the loop, then 0x202, 0x204 and 0x208
+    for (int i = 0; i < 10; i++)
+    {
+        processOp(&chip8State, memory);
+        processOpCached(&cachedState, memory, &cache);
+    }
+    assert_int_equal(cachedState.pc, 0x20a);
+    assert_int_equal(cachedState.registers[2], 0x8);
+    assert_memory_equal(&chip8State, &cachedState, sizeof(State));
+}
+
+static void test_decode_cache_invalidation(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6062 # set r0 to 0x62
+        0x0202 0x6107 # set r1 to 0x07
+        0x0204 0xa20c # set i to 0x20c
+        0x0206 0x120c # jump to 0x20c
+        0x0208 0xf155 # store r0 and r1 at i, turning 0x20c into 0x6207
+        0x020a 0x120c # jump to 0x20c
+        0x020c 0x6201 # set r2 to 0x1
+        0x020e 0x3207 # skip the next instruction if r2 is 0x7
+        0x0210 0x1208 # jump to 0x208
+
+    0x20c has already been decoded by the time 0xf155 rewrites it,
+    so the cache must drop it or we'd loop forever
+    */
+
+    // init
+    State chip8State = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0x60, 0x62, 0x61, 0x07, 0xa2, 0x0c, 0x12, 0x0c, 0xf1, 0x55, 0x12, 0x0c, 0x62, 0x01, 0x32, 0x07, 0x12, 0x08};
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+    DecodeCache cache;
+    initDecodeCache(&cache);
+
+    for (int i = 0; i < 11; i++)
+    {
+        processOpCached(&chip8State, memory, &cache);
+    }
+    assert_int_equal(memory[0x20c], 0x62);
+    assert_int_equal(memory[0x20d], 0x07);
+    assert_int_equal(chip8State.registers[2], 0x7);
+    // we skipped over the jump
+    assert_int_equal(chip8State.pc, 0x212);
+}
+
+static void test_fused_ops(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6000 # set r0 to 0x0
+        0x0202 0x6100 # set r1 to 0x0
+        0x0204 0x7001 # add 0x1 to r0
+        0x0206 0x3005 # skip the next instruction if r0 is 0x5
+        0x0208 0x1204 # jump to 0x204
+        0x020a 0x7102 # add 0x2 to r1
+        0x020c 0x410a # skip the next instruction if r1 isn't 0xa
+        0x020e 0x1214 # jump to 0x214
+        0x0210 0x120a # jump to 0x20a
+        0x0212 0x0000
+        0x0214 0xa300 # set i to 0x300
+        0x0216 0xd015 # draw the sprite at (r0, r1)
+        0x0218 0xa300 # set i to 0x300
+        0x021a 0xf01e # add r0 to i
+        0x021c 0x6203 # set r2 to 0x3
+        0x021e 0xf215 # set the delay timer to r2
+        0x0220 0xf307 # set r3 to the delay timer
+        0x0222 0x3300 # skip the next instruction if r3 is 0x0
+        0x0224 0x1220 # jump to 0x220
+        0x0226 0x7401 # add 0x1 to r4
+        0x0228 0x1226 # jump to 0x226 forever
+
+    0x204, 0x20a, 0x214, 0x218 and 0x220 each start a superinstruction.
+    Run in uneven chunks, some of which end half way through one, the
+    cache should match processOp exactly, counting through the wait loop's
+    exit into the straight-line code after it
+    */
+
+    uint8_t rom[] = {0x60, 0x00, 0x61, 0x00, 0x70, 0x01, 0x30, 0x05, 0x12, 0x04, 0x71, 0x02, 0x41, 0x0a,
+                     0x12, 0x14, 0x12, 0x0a, 0x00, 0x00, 0xa3, 0x00, 0xd0, 0x15, 0xa3, 0x00, 0xf0, 0x1e,
+                     0x62, 0x03, 0xf2, 0x15, 0xf3, 0x07, 0x33, 0x00, 0x12, 0x20, 0x74, 0x01, 0x12, 0x26};
+    uint8_t sprite[] = {0xf0, 0x90, 0xf0, 0x90, 0xf0};
+    State states[2];
+    uint8_t memories[2][MEM_SIZE];
+    for (int k = 0; k < 2; k++)
+    {
+        memset(&states[k], 0x0, sizeof(State));
+        states[k].pc = ROM_OFFSET;
+        memset(memories[k], 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memories[k] + ROM_OFFSET, rom, sizeof(rom));
+        memcpy(memories[k] + 0x300, sprite, sizeof(sprite));
+    }
+    DecodeCache cache;
+    initDecodeCache(&cache);
+
+    uint32_t chunks[] = {1, 2, 3, 5, 8};
+    for (int idx = 0; idx < 40; idx++)
+    {
+        uint32_t numOps = chunks[idx % 5];
+        for (uint32_t op = 0; op < numOps; op++)
+        {
+            processOp(&states[0], memories[0]);
+        }
+        assert_int_equal(processOpsCached(&states[1], memories[1], &cache, numOps), numOps);
+        assert_memory_equal(&states[0], &states[1], sizeof(State));
+        // the timer runs down between frames
+        for (int k = 0; k < 2; k++)
+        {
+            if (states[k].delay_timer > 0)
+                states[k].delay_timer--;
+        }
+    }
+    assert_true(states[1].registers[4] > 0);
+    assert_int_equal(states[1].registers[0], 0x5);
+    assert_int_equal(states[1].registers[1], 0xa);
+    assert_int_equal(states[1].i, 0x305);
+    assert_memory_equal(memories[0], memories[1], MEM_SIZE);
+
+#ifndef CHIP8_PROFILE
+    assert_int_equal(cache.ops[0x204].fusedLength, 2);
+    assert_int_equal(cache.ops[0x20a].fusedLength, 2);
+    assert_int_equal(cache.ops[0x214].fusedLength, 2);
+    assert_int_equal(cache.ops[0x218].fusedLength, 2);
+    assert_int_equal(cache.ops[0x220].fusedLength, 3);
+    assert_int_equal(cache.ops[0x21c].fusedLength, 0);
+#endif
+    // rewriting the jump at the end of the wait drops the whole superinstruction
+    memories[1][0x225] = 0x26;
+    invalidateDecodeCache(&cache, 0x224, 2);
+    assert_null(cache.ops[0x220].handler);
+    states[1].pc = 0x220;
+    states[1].delay_timer = 0x1;
+    processOpsCached(&states[1], memories[1], &cache, 3);
+    assert_int_equal(states[1].pc, 0x226);
+
+    // a wait that exits through the superinstruction skips the jump, so only
+    // two instructions ran: 6003 f015 f007 3000 1204 7101 7201 120a in chunks
+    // of 7 leaves the whole wait to it
+    uint8_t waitRom[] = {0x60, 0x03, 0xf0, 0x15, 0xf0, 0x07, 0x30, 0x00, 0x12, 0x04, 0x71, 0x01, 0x72, 0x01, 0x12, 0x0a};
+    for (int k = 0; k < 2; k++)
+    {
+        memset(&states[k], 0x0, sizeof(State));
+        states[k].pc = ROM_OFFSET;
+        memcpy(memories[k] + ROM_OFFSET, waitRom, sizeof(waitRom));
+    }
+    initDecodeCache(&cache);
+    for (int idx = 0; idx < 10; idx++)
+    {
+        for (uint32_t op = 0; op < 7; op++)
+        {
+            processOp(&states[0], memories[0]);
+        }
+        assert_int_equal(processOpsCached(&states[1], memories[1], &cache, 7), 7);
+        assert_memory_equal(&states[0], &states[1], sizeof(State));
+        for (int k = 0; k < 2; k++)
+        {
+            if (states[k].delay_timer > 0)
+                states[k].delay_timer--;
+        }
+    }
+    assert_true(states[1].registers[2] > 0);
+}
+
+static void test_pc_wraps(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x60f0 # set r0 to 0xf0
+        0x0202 0xbf20 # jump to 0xf20 + r0, past the end of memory
+        ...
+        0x0010 0x7101 # add 0x1 to r1, fetched for pc 0x1010
+        0x0012 0x1200 # jump to 0x200
+
+    The fetch wraps round memory, and every engine should agree on it
+    */
+
+    uint8_t rom[] = {0x60, 0xf0, 0xbf, 0x20};
+    uint8_t low[] = {0x71, 0x01, 0x12, 0x00};
+    EngineKind kinds[] = {ENGINE_SWITCH, ENGINE_CACHED, ENGINE_THREADED, ENGINE_JIT};
+    State states[4];
+    uint8_t memories[4][MEM_SIZE];
+    for (int k = 0; k < 4; k++)
+    {
+        memset(&states[k], 0x0, sizeof(State));
+        states[k].pc = ROM_OFFSET;
+        memset(memories[k], 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memories[k] + ROM_OFFSET, rom, sizeof(rom));
+        memcpy(memories[k] + 0x10, low, sizeof(low));
+        Engine engine;
+        initEngine(&engine, kinds[k]);
+        runEngine(&engine, &states[k], memories[k], 7);
+        runEngine(&engine, &states[k], memories[k], 93);
+        freeEngine(&engine);
+    }
+    assert_false(states[0].halted);
+    assert_int_equal(states[0].registers[1], 25);
+    for (int k = 1; k < 4; k++)
+    {
+        assert_memory_equal(&states[0], &states[k], sizeof(State));
+    }
+
+    // and the lockstep engine, here with two lanes. Their memory is allocated
+    // separately, so reading past the end of one doesn't land in the next
+    State lanes[2];
+    State *statePtrs[2];
+    uint8_t *memoryPtrs[2];
+    for (int lane = 0; lane < 2; lane++)
+    {
+        memset(&lanes[lane], 0x0, sizeof(State));
+        lanes[lane].pc = ROM_OFFSET;
+        memoryPtrs[lane] = malloc(MEM_SIZE);
+        memcpy(memoryPtrs[lane], memories[0], MEM_SIZE);
+        statePtrs[lane] = &lanes[lane];
+    }
+    LockstepGroup group;
+    initLockstep(&group, statePtrs, memoryPtrs, 2);
+    runLockstep(&group, 7);
+    runLockstep(&group, 93);
+    syncLockstep(&group);
+    for (int lane = 0; lane < 2; lane++)
+    {
+        assert_memory_equal(&states[0], &lanes[lane], sizeof(State));
+        free(memoryPtrs[lane]);
+    }
+}
+
+static void test_engines_agree(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x00e0 # clear the screen
+        0x0202 0x6000 # set r0 to 0x0
+        0x0204 0x6105 # set r1 to 0x5
+        0x0206 0xa300 # set i to 0x300
+        0x0208 0x2220 # call the subroutine at 0x220
+        0x020a 0x7001 # add 0x1 to r0
+        0x020c 0x300a # skip the next instruction if r0 is 0xa
+        0x020e 0x1208 # jump to 0x208
+        0x0210 0xf233 # store the BCD of r2 at i
+        0x0212 0xf265 # load r0 to r2 from i
+        0x0214 0x1214 # jump to 0x214 forever
+
+        0x0220 0x8214 # add r1 to r2
+        0x0222 0x8325 # subtract r2 from r3
+        0x0224 0x8426 # right shift r4
+        0x0226 0x842e # left shift r4
+        0x0228 0x8537 # set r5 to r3 - r5
+        0x022a 0xf01e # add r0 to i
+        0x022c 0xf029 # set i to the sprite for r0
+        0x022e 0xd125 # draw the sprite at (r1, r2)
+        0x0230 0xa300 # set i to 0x300
+        0x0232 0xf355 # store r0 to r3 at i
+        0x0234 0x00ee # return
+
+    Every engine should end up with exactly the same state and memory
+    */
+
+    uint8_t rom[] = {0x00, 0xe0, 0x60, 0x00, 0x61, 0x05, 0xa3, 0x00, 0x22, 0x20, 0x70, 0x01, 0x30, 0x0a, 0x12, 0x08,
+                     0xf2, 0x33, 0xf2, 0x65, 0x12, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                     0x82, 0x14, 0x83, 0x25, 0x84, 0x26, 0x84, 0x2e, 0x85, 0x37, 0xf0, 0x1e, 0xf0, 0x29, 0xd1, 0x25,
+                     0xa3, 0x00, 0xf3, 0x55, 0x00, 0xee};
+    EngineKind kinds[] = {ENGINE_SWITCH, ENGINE_CACHED, ENGINE_THREADED, ENGINE_JIT};
+    State states[4];
+    uint8_t memories[4][MEM_SIZE];
+    for (int k = 0; k < 4; k++)
+    {
+        // zeroed rather than initialised so the padding compares equal too
+        memset(&states[k], 0x0, sizeof(State));
+        states[k].pc = ROM_OFFSET;
+        memset(memories[k], 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(memories[k]);
+        memcpy(memories[k] + ROM_OFFSET, rom, sizeof(rom));
+        Engine engine;
+        initEngine(&engine, kinds[k]);
+        // in uneven chunks so the threaded engine has to stop and resume
+        runEngine(&engine, &states[k], memories[k], 7);
+        runEngine(&engine, &states[k], memories[k], 293);
+        freeEngine(&engine);
+    }
+    // make sure we got as far as the final loop
+    assert_int_equal(states[0].pc, 0x214);
+    for (int k = 1; k < 4; k++)
+    {
+        assert_memory_equal(&states[0], &states[k], sizeof(State));
+        assert_memory_equal(memories[0], memories[k], MEM_SIZE);
+    }
+}
+
+static void test_idle_loops(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6203 # set r2 to 0x3
+        0x0202 0xf215 # set the delay timer to r2
+        0x0204 0xf307 # set r3 to the delay timer
+        0x0206 0x3300 # skip the next instruction if r3 is 0x0
+        0x0208 0x1204 # jump to 0x204
+        0x020a 0xf00a # wait for a key, into r0
+        0x020c 0xe0a1 # skip the next instruction unless key r0 is held
+        0x020e 0x120c # jump to 0x20c
+        0x0210 0x1210 # jump to 0x210 forever
+
+    It waits on the timer, then for key 5 and then for it to be let go.
+    Each engine should skip through the waits and still end every frame
+    exactly where processOp does
+    */
+
+    uint8_t rom[] = {0x62, 0x03, 0xf2, 0x15, 0xf3, 0x07, 0x33, 0x00, 0x12, 0x04,
+                     0xf0, 0x0a, 0xe0, 0xa1, 0x12, 0x0c, 0x12, 0x10};
+    EngineKind kinds[] = {ENGINE_SWITCH, ENGINE_CACHED, ENGINE_THREADED, ENGINE_JIT};
+    for (int k = 0; k < 4; k++)
+    {
+        State states[2];
+        uint8_t memories[2][MEM_SIZE];
+        for (int idx = 0; idx < 2; idx++)
+        {
+            memset(&states[idx], 0x0, sizeof(State));
+            states[idx].pc = ROM_OFFSET;
+            memset(memories[idx], 0x0, MEM_SIZE * sizeof(uint8_t));
+            memcpy(memories[idx] + ROM_OFFSET, rom, sizeof(rom));
+        }
+        Engine engine;
+        initEngine(&engine, kinds[k]);
+        for (int frame = 0; frame < 12; frame++)
+        {
+            // uneven frames, so the last trip round a loop is cut short
+            uint32_t numOps = 100 + 7 * frame;
+            uint16_t keys = frame >= 6 && frame < 9 ? 0x1 << 5 : 0x0;
+            states[0].keys = states[1].keys = keys;
+            for (uint32_t op = 0; op < numOps; op++)
+            {
+                processOp(&states[0], memories[0]);
+            }
+            assert_int_equal(runEngine(&engine, &states[1], memories[1], numOps), numOps);
+            assert_memory_equal(&states[0], &states[1], sizeof(State));
+            tickTimers(&states[0]);
+            tickTimers(&states[1]);
+        }
+        assert_int_equal(states[1].pc, 0x210);
+        assert_int_equal(states[1].registers[0], 0x5);
+#ifndef CHIP8_PROFILE
+        assert_true(engine.idleOps > 0);
+        // too many to run one by one in a test
+        assert_int_equal(runEngine(&engine, &states[1], memories[1], 0x1u << 31), 0x1u << 31);
+        assert_int_equal(states[1].pc, 0x210);
+#endif
+        freeEngine(&engine);
+    }
+}
+
+static void test_parse_engine(void **state)
+{
+    EngineKind kind = ENGINE_SWITCH;
+    assert_true(parseEngineKind("threaded", &kind));
+    assert_int_equal(kind, ENGINE_THREADED);
+    assert_string_equal(engineKindName(kind), "threaded");
+    assert_false(parseEngineKind("turbo", &kind));
+    // unchanged on failure
+    assert_int_equal(kind, ENGINE_THREADED);
+}
+
+static void test_jit_random_programs(void **state)
+{
+    /*
+    Random programs made of the instructions the JIT translates, plus a few
+    it hands back to processOp, should leave the JIT and processOp in the
+    same state. Each program ends with two jumps back to the start so no
+    skip can fall off the end.
+    */
+#ifdef CHIP8_PROFILE
+    // profiling builds run the decode cache in place of the JIT
+    skip();
+#endif
+
+    // a fixed LCG rather than rand() so test_rand isn't disturbed
+    uint32_t seed = 0x1234567;
+#define NEXT() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0xffff)
+    for (int program = 0; program < 200; program++)
+    {
+        uint8_t memory[MEM_SIZE];
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(memory);
+        int numOps = 8 + NEXT() % 40;
+        for (int op = 0; op < numOps; op++)
+        {
+            uint16_t r = NEXT();
+            uint8_t x = r & 0xf, y = (r >> 4) & 0xf, nn = r >> 8;
+            uint16_t target = ROM_OFFSET + 2 * (NEXT() % (numOps + 2));
+            uint16_t opCode;
+            switch (NEXT() % 18)
+            {
+            case 0: opCode = 0x6000 | (x << 8) | nn; break;
+            case 1: opCode = 0x7000 | (x << 8) | nn; break;
+            case 2: opCode = 0x8000 | (x << 8) | (y << 4) | (NEXT() % 8); break;
+            case 3: opCode = 0x800e | (x << 8) | (y << 4); break;
+            case 4: opCode = 0x3000 | (x << 8) | (nn & 0x3); break;
+            case 5: opCode = 0x4000 | (x << 8) | (nn & 0x3); break;
+            case 6: opCode = 0x5000 | (x << 8) | (y << 4); break;
+            case 7: opCode = 0x9000 | (x << 8) | (y << 4); break;
+            case 8: opCode = 0xa000 | (NEXT() % 0xf00); break;
+            case 9: opCode = 0xf01e | (x << 8); break;
+            case 10: opCode = 0xf007 | (x << 8); break;
+            case 11: opCode = 0xf015 | (x << 8); break;
+            case 12: opCode = 0xf018 | (x << 8); break;
+            case 13: opCode = 0xf029 | (x << 8); break;
+            case 14: opCode = 0xf065 | (x << 8); break;
+            case 15: opCode = 0xd000 | (x << 8) | (y << 4) | (nn & 0xf); break;
+            case 16: opCode = 0x1000 | target; break;
+            default: opCode = 0x8004 | (x << 8) | (y << 4) | (NEXT() % 2); break;
+            }
+            memory[ROM_OFFSET + 2 * op] = opCode >> 8;
+            memory[ROM_OFFSET + 2 * op + 1] = opCode & 0xff;
+        }
+        for (int op = numOps; op < numOps + 2; op++)
+        {
+            memory[ROM_OFFSET + 2 * op] = 0x12;
+            memory[ROM_OFFSET + 2 * op + 1] = 0x00;
+        }
+        // the I register can point anywhere, keep a copy of memory for each engine
+        uint8_t jitMemory[MEM_SIZE];
+        memcpy(jitMemory, memory, MEM_SIZE);
+
+        State expected, actual;
+        memset(&expected, 0x0, sizeof(State));
+        expected.pc = ROM_OFFSET;
+        expected.delay_timer = NEXT() & 0xff;
+        for (int reg = 0; reg < 16; reg++)
+        {
+            expected.registers[reg] = NEXT() & 0xff;
+        }
+        memcpy(&actual, &expected, sizeof(State));
+
+        Engine engine;
+        initEngine(&engine, ENGINE_JIT);
+        uint32_t budget = 1 + NEXT() % 500;
+        for (uint32_t op = 0; op < budget; op++)
+        {
+            processOp(&expected, memory);
+        }
+        runEngine(&engine, &actual, jitMemory, budget);
+        freeEngine(&engine);
+        assert_memory_equal(&expected, &actual, sizeof(State));
+        assert_memory_equal(memory, jitMemory, MEM_SIZE);
+    }
+#undef NEXT
+}
+
+static void test_aot(void **state)
+{
+    /*
+    testAotProgram is test/aot.ch8, compiled by chip8-aot at build time:
+        0x0200 0x00e0 # clear the screen
+        0x0202 0x6000 # set r0 to 0x0
+        0x0204 0x6105 # set r1 to 0x5
+        0x0206 0xa300 # set i to 0x300
+        0x0208 0x2240 # call the subroutine at 0x240
+        0x020a 0x7001 # add 0x1 to r0
+        0x020c 0x300a # skip the next instruction if r0 is 0xa
+        0x020e 0x1208 # jump to 0x208
+        0x0210 0xf233 # store the BCD of r2 at i
+        0x0212 0xf265 # load r0 to r2 from i
+        0x0214 0x606b # set r0 to 0x6b
+        0x0216 0x6142 # set r1 to 0x42
+        0x0218 0xa21e # set i to 0x21e
+        0x021a 0xf155 # store r0 to r1 at i, so 0x21e becomes 0x6b42
+        0x021c 0x6000 # set r0 to 0x0
+        0x021e 0x6b01 # set rb to 0x1, or 0x42 once overwritten
+        0x0220 0x2228 # call the subroutine at 0x228
+        0x0222 0x1222 # jump to 0x222 forever
+        0x0228 0xb260 # jump to 0x260 + r0
+
+        0x0240 0x8214 # the subroutine from test_engines_agree
+        ...
+        0x0254 0x00ee # return
+
+        0x0260 0x6c07 # set rc to 0x7, only reachable through bnnn
+        0x0262 0x00ee # return
+
+    The compiled code has to give way to the interpreter for the code it
+    overwrote and the code it couldn't see, and end up exactly where the
+    switch engine does
+    */
+
+    uint8_t memories[2][MEM_SIZE];
+    State states[2];
+    for (int k = 0; k < 2; k++)
+    {
+        memset(&states[k], 0x0, sizeof(State));
+        states[k].pc = ROM_OFFSET;
+        memset(memories[k], 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(memories[k]);
+        memcpy(memories[k] + ROM_OFFSET, testAotProgram.rom, testAotProgram.romSize);
+    }
+    Engine engine;
+    initEngine(&engine, ENGINE_SWITCH);
+    runEngine(&engine, &states[0], memories[0], 300);
+    freeEngine(&engine);
+
+    initAotEngine(&engine, &testAotProgram, memories[1]);
+#ifndef CHIP8_PROFILE
+    assert_int_equal(engine.kind, ENGINE_AOT);
+#endif
+    // in uneven chunks so blocks don't always fit
+    uint32_t executed = 0;
+    for (uint32_t chunk = 1; executed < 300; chunk = chunk * 3 % 17 + 1)
+    {
+        uint32_t numOps = 300 - executed < chunk ? 300 - executed : chunk;
+        executed += runEngine(&engine, &states[1], memories[1], numOps);
+    }
+#ifndef CHIP8_PROFILE
+    assert_true(engine.aot->stale[0x210]);
+    assert_false(engine.aot->stale[0x240]);
+    assert_true(engine.aot->interpreted > 0);
+#endif
+    freeEngine(&engine);
+    assert_int_equal(states[0].pc, 0x222);
+    assert_int_equal(states[0].registers[0xb], 0x42);
+    assert_int_equal(states[0].registers[0xc], 0x7);
+    assert_memory_equal(&states[0], &states[1], sizeof(State));
+    assert_memory_equal(memories[0], memories[1], MEM_SIZE);
+
+    // a different ROM in memory, nothing compiled can run
+    memories[1][ROM_OFFSET + 1] = 0xe1;
+    initAotEngine(&engine, &testAotProgram, memories[1]);
+#ifndef CHIP8_PROFILE
+    assert_true(engine.aot->stale[0x200]);
+    assert_false(engine.aot->stale[0x208]);
+#endif
+    freeEngine(&engine);
+}
+
+static void test_lockstep_random_programs(void **state)
+{
+    /*
+    Random programs run across a group of lanes should leave every lane in
+    the same state as running it on its own through processOp. The lanes
+    start with slightly different registers, keys and rng so the skips send
+    them different ways, and Fx55 can rewrite the program in some lanes.
+    */
+
+    uint32_t seed = 0x7654321;
+#define NEXT() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0xffff)
+    for (int program = 0; program < 100; program++)
+    {
+        uint8_t rom[MEM_SIZE];
+        memset(rom, 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(rom);
+        int numOps = 8 + NEXT() % 40;
+        for (int op = 0; op < numOps; op++)
+        {
+            uint16_t r = NEXT();
+            uint8_t x = r & 0xf, y = (r >> 4) & 0xf, nn = r >> 8;
+            uint16_t target = ROM_OFFSET + 2 * (NEXT() % (numOps + 2));
+            uint16_t opCode;
+            switch (NEXT() % 20)
+            {
+            case 0: opCode = 0x6000 | (x << 8) | nn; break;
+            case 1: opCode = 0x7000 | (x << 8) | nn; break;
+            case 2: opCode = 0x8000 | (x << 8) | (y << 4) | (NEXT() % 8); break;
+            case 3: opCode = 0x800e | (x << 8) | (y << 4); break;
+            case 4: opCode = 0x3000 | (x << 8) | (nn & 0x3); break;
+            case 5: opCode = 0x4000 | (x << 8) | (nn & 0x3); break;
+            case 6: opCode = 0x5000 | (x << 8) | (y << 4); break;
+            case 7: opCode = 0x9000 | (x << 8) | (y << 4); break;
+            case 8: opCode = 0xa000 | (NEXT() % 0xf00); break;
+            case 9: opCode = 0xf01e | (x << 8); break;
+            case 10: opCode = 0xf007 | (x << 8); break;
+            case 11: opCode = 0xf015 | (x << 8); break;
+            case 12: opCode = 0xf029 | (x << 8); break;
+            case 13: opCode = 0xf055 | (x << 8); break;
+            case 14: opCode = 0xf033 | (x << 8); break;
+            case 15: opCode = 0xd000 | (x << 8) | (y << 4) | (nn & 0xf); break;
+            case 16: opCode = 0xc000 | (x << 8) | nn; break;
+            case 17: opCode = 0xe09e | (x << 8); break;
+            case 18: opCode = 0xb000 | target; break;
+            default: opCode = 0x1000 | target; break;
+            }
+            rom[ROM_OFFSET + 2 * op] = opCode >> 8;
+            rom[ROM_OFFSET + 2 * op + 1] = opCode & 0xff;
+        }
+        for (int op = numOps; op < numOps + 2; op++)
+        {
+            rom[ROM_OFFSET + 2 * op] = 0x12;
+            rom[ROM_OFFSET + 2 * op + 1] = 0x00;
+        }
+
+        int numLanes = 1 + NEXT() % LOCKSTEP_LANES;
+        static State expected[LOCKSTEP_LANES], actual[LOCKSTEP_LANES];
+        static uint8_t expectedMemory[LOCKSTEP_LANES][MEM_SIZE], actualMemory[LOCKSTEP_LANES][MEM_SIZE];
+        State *states[LOCKSTEP_LANES];
+        uint8_t *memories[LOCKSTEP_LANES];
+        uint8_t registers[16];
+        for (int reg = 0; reg < 16; reg++)
+        {
+            registers[reg] = NEXT() & 0x3;
+        }
+        for (int lane = 0; lane < numLanes; lane++)
+        {
+            memset(&expected[lane], 0x0, sizeof(State));
+            expected[lane].pc = ROM_OFFSET;
+            memcpy(expected[lane].registers, registers, sizeof(registers));
+            // most lanes start the same, a few don't
+            if (NEXT() % 4 == 0)
+            {
+                uint8_t reg = NEXT() & 0xf;
+                expected[lane].registers[reg] = NEXT() & 0x3;
+            }
+            expected[lane].keys = 1 << (NEXT() & 0x3);
+            seedRandom(&expected[lane], NEXT() % 2);
+            memcpy(&actual[lane], &expected[lane], sizeof(State));
+            memcpy(expectedMemory[lane], rom, MEM_SIZE);
+            memcpy(actualMemory[lane], rom, MEM_SIZE);
+            states[lane] = &actual[lane];
+            memories[lane] = actualMemory[lane];
+        }
+
+        // in two goes with the timers ticking in between
+        uint32_t budget = 1 + NEXT() % 500;
+        uint64_t total = 0;
+        for (int lane = 0; lane < numLanes; lane++)
+        {
+            for (uint32_t op = 0; op < budget && !expected[lane].halted; op++)
+            {
+                if (op == budget / 2)
+                    tickTimers(&expected[lane]);
+                processOp(&expected[lane], expectedMemory[lane]);
+                total += !expected[lane].halted;
+            }
+        }
+        LockstepGroup group;
+        initLockstep(&group, states, memories, numLanes);
+        uint64_t executed = runLockstep(&group, budget / 2);
+        tickLockstepTimers(&group);
+        executed += runLockstep(&group, budget - budget / 2);
+        syncLockstep(&group);
+        assert_true(executed == total);
+        for (int lane = 0; lane < numLanes; lane++)
+        {
+            assert_memory_equal(&expected[lane], &actual[lane], sizeof(State));
+            assert_memory_equal(expectedMemory[lane], actualMemory[lane], MEM_SIZE);
+        }
+    }
+#undef NEXT
+}
+
+static void test_lockstep_calls(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x2206 # call 0x206
+        0x0202 0x7101 # add 1 to r1
+        0x0204 0x1200 # jump back to the start
+        0x0206 0x8004 # r0 += r0, carry into rf
+        0x0208 0x00ee # return
+
+    Every lane stays in step, so everything but the first fetch runs in lockstep
+    */
+
+    State states[LOCKSTEP_LANES];
+    uint8_t memories[LOCKSTEP_LANES][MEM_SIZE];
+    State *statePtrs[LOCKSTEP_LANES];
+    uint8_t *memoryPtrs[LOCKSTEP_LANES];
+    uint8_t rom[] = {0x22, 0x06, 0x71, 0x01, 0x12, 0x00, 0x80, 0x04, 0x00, 0xee};
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        memset(&states[lane], 0x0, sizeof(State));
+        states[lane].pc = ROM_OFFSET;
+        states[lane].registers[0] = lane + 1;
+        memset(memories[lane], 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memories[lane] + ROM_OFFSET, rom, sizeof(rom));
+        statePtrs[lane] = &states[lane];
+        memoryPtrs[lane] = memories[lane];
+    }
+    LockstepGroup group;
+    initLockstep(&group, statePtrs, memoryPtrs, LOCKSTEP_LANES);
+
+    assert_true(runLockstep(&group, 35) == 35 * LOCKSTEP_LANES);
+    assert_true(group.scalarOps == 0);
+    syncLockstep(&group);
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        // 35 ops is 7 times round the loop
+        assert_int_equal(states[lane].pc, 0x200);
+        assert_int_equal(states[lane].sp, 0);
+        assert_int_equal(states[lane].registers[1], 7);
+        assert_int_equal(states[lane].registers[0], (uint8_t)((lane + 1) << 7));
+        assert_true(group.cycles[lane] == 35);
+    }
+}
+
+static void test_jit_subtract_edge_cases(void **state)
+{
+    /*
+    subtractRegisters computes (Vx - Vy) % 0xff, so a difference of +/-255 is 0.
+    The test ROM will look like this:
+        0x0200 0x60ff # set r0 to 0xff
+        0x0202 0x6100 # set r1 to 0x0
+        0x0204 0x8015 # r0 = r0 - r1
+        0x0206 0x6200 # set r2 to 0x0
+        0x0208 0x63ff # set r3 to 0xff
+        0x020a 0x8235 # r2 = r2 - r3
+        0x020c 0x6fff # set rf to 0xff
+        0x020e 0x6400 # set r4 to 0x0
+        0x0210 0x8f47 # rf = r4 - rf, rf ends up as the flag
+        0x0212 0x8ff6 # shift rf right, rf ends up as 0
+        0x0214 0x1214 # jump to 0x214 forever
+    */
+
+    uint8_t rom[] = {0x60, 0xff, 0x61, 0x00, 0x80, 0x15, 0x62, 0x00, 0x63, 0xff, 0x82, 0x35,
+                     0x6f, 0xff, 0x64, 0x00, 0x8f, 0x47, 0x8f, 0xf6, 0x12, 0x14};
+    State expected, actual;
+    memset(&expected, 0x0, sizeof(State));
+    expected.pc = ROM_OFFSET;
+    memcpy(&actual, &expected, sizeof(State));
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+
+    for (int op = 0; op < 12; op++)
+    {
+        processOp(&expected, memory);
+    }
+    Engine engine;
+    initEngine(&engine, ENGINE_JIT);
+    runEngine(&engine, &actual, memory, 12);
+    freeEngine(&engine);
+    assert_int_equal(expected.registers[0], 0x0);
+    assert_int_equal(expected.registers[2], 0x0);
+    assert_memory_equal(&expected, &actual, sizeof(State));
+}
+
+static void test_jit_invalidation(void **state)
+{
+    /*
+    Same ROM as test_decode_cache_invalidation: 0xf155 rewrites 0x20c
+    after the JIT has already translated it
+    */
+
+    State chip8State = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0x60, 0x62, 0x61, 0x07, 0xa2, 0x0c, 0x12, 0x0c, 0xf1, 0x55, 0x12, 0x0c, 0x62, 0x01, 0x32, 0x07, 0x12, 0x08};
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+    Engine engine;
+    initEngine(&engine, ENGINE_JIT);
+
+    runEngine(&engine, &chip8State, memory, 11);
+    freeEngine(&engine);
+    assert_int_equal(chip8State.registers[2], 0x7);
+    assert_int_equal(chip8State.pc, 0x212);
+}
+
+static void test_draw_sprite_wraps(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0xa000 # set i to the sprite for 0x0
+        0x0202 0x613c # set r1 to 60
+        0x0204 0x621e # set r2 to 30
+        0x0206 0xd125 # draw the 5x8 sprite defined at i at (r1,r2)
+        0x0208 0x6300 # set r3 to 0
+        0x020a 0xd135 # draw the sprite again at (r1,r3)
+
+    The sprite for 0 is 0xf0,0x90,0x90,0x90,0xf0, so the first draw puts
+    its left half on the right edge of rows 30-31 and wraps the bottom
+    three rows round to 0-2. Its right half is all off, so nothing
+    lands on the left edge.
+    */
+
+    // init
+    State chip8State = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0xa0, 0x00, 0x61, 0x3c, 0x62, 0x1e, 0xd1, 0x25, 0x63, 0x00, 0xd1, 0x35};
+    copySpritesToMemory(memory);
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+
+    for (int i = 0; i < 4; i++)
+    {
+        processOp(&chip8State, memory);
+    }
+    assert_int_equal(chip8State.registers[0xf], 0);
+    // top row of the sprite, 0xf0
+    assert_true(getPixel(&chip8State, 60, 30));
+    assert_true(getPixel(&chip8State, 63, 30));
+    assert_false(getPixel(&chip8State, 0, 30));
+    // 0x90 on the wrapped rows
+    assert_true(getPixel(&chip8State, 60, 0));
+    assert_false(getPixel(&chip8State, 61, 0));
+    assert_true(getPixel(&chip8State, 63, 0));
+    assert_int_equal(chip8State.pixels[0][31][0], 0x9ull);
+    assert_int_equal(chip8State.pixels[0][3][0], 0x0);
+
+    // drawing at (60, 0) overlaps the wrapped rows 0-2
+    processOp(&chip8State, memory);
+    processOp(&chip8State, memory);
+    assert_int_equal(chip8State.registers[0xf], 1);
+    // 0x90 ^ 0xf0 = 0x60 on row 0
+    assert_int_equal(chip8State.pixels[0][0][0], 0x6ull);
+    // untouched by the second draw
+    assert_int_equal(chip8State.pixels[0][30][0], 0xfull);
+}
+
+static void test_dirty_rows(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0xa000 # set i to the sprite for 0x0
+        0x0202 0x6104 # set r1 to 4
+        0x0204 0xd115 # draw the 5x8 sprite defined at i at (r1,r1)
+        0x0206 0xa300 # set i to 0x300, which is all zeroes
+        0x0208 0xd105 # draw an empty sprite at (r1,r0)
+        0x020a 0x00e0 # clear the screen
+    */
+
+    // init
+    State chip8State = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0xa0, 0x00, 0x61, 0x04, 0xd1, 0x15, 0xa3, 0x00, 0xd1, 0x05, 0x00, 0xe0};
+    copySpritesToMemory(memory);
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+
+    for (int i = 0; i < 3; i++)
+    {
+        processOp(&chip8State, memory);
+    }
+    // rows 4-8
+    assert_int_equal(chip8State.dirtyRows, 0x1f0);
+    // simulate the screen being updated
+    chip8State.dirtyRows = 0;
+    processOp(&chip8State, memory);
+    processOp(&chip8State, memory);
+    // an empty sprite doesn't change anything
+    assert_int_equal(chip8State.dirtyRows, 0x0);
+    assert_true(chip8State.draw);
+    processOp(&chip8State, memory);
+    assert_int_equal(chip8State.dirtyRows, ALL_ROWS_DIRTY);
+}
+
+static void test_unknown_opcode(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6001 # set r0 to 0x1
+        0x0202 0x0123 # not an opcode we know about
+
+    Rather than exiting, the VM halts and leaves the pc at the bad opcode.
+    Only the first instruction counts as executed, whatever the engine
+    */
+
+    uint8_t rom[] = {0x60, 0x01, 0x01, 0x23};
+    for (EngineKind kind = ENGINE_SWITCH; kind <= ENGINE_JIT; kind++)
+    {
+        // init
+        State chip8State = {.pc = ROM_OFFSET};
+        uint8_t memory[MEM_SIZE];
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+        Engine engine;
+        initEngine(&engine, kind);
+
+        uint32_t executed = runEngine(&engine, &chip8State, memory, 10);
+        freeEngine(&engine);
+        assert_int_equal(executed, 1);
+        assert_true(chip8State.halted);
+        assert_int_equal(chip8State.badOpcode, 0x0123);
+        assert_int_equal(chip8State.pc, 0x202);
+        assert_int_equal(chip8State.registers[0], 0x1);
+    }
+}
+
+static void test_schip(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x00ff # switch to hi-res
+        0x0202 0xa300 # set i to 0x300, a solid 16x16 sprite
+        0x0204 0x6178 # set r1 to 120
+        0x0206 0x6202 # set r2 to 2
+        0x0208 0xd120 # draw the 16x16 sprite at (r1,r2), wrapping to columns 0-7
+        0x020a 0x00c4 # scroll down 4 rows
+        0x020c 0x00fb # scroll right 4 pixels
+        0x020e 0x00fc # scroll left 4 pixels
+        0x0210 0x6305 # set r3 to 5
+        0x0212 0xf330 # set i to the big sprite for r3
+        0x0214 0xf375 # save r0-r3 to the flags
+        0x0216 0x6300 # set r3 to 0
+        0x0218 0xf385 # load r0-r3 from the flags
+        0x021a 0xf201 # select the second plane
+        0x021c 0x6400 # set r4 to 0
+        0x021e 0xd441 # draw one row of the sprite at (r4,r4)
+        0x0220 0x00fe # switch to lo-res, clearing the screen
+        0x0222 0x00fd # exit
+
+    Scrolling right pushes columns 124-127 off the edge, so scrolling back
+    left doesn't bring them back
+    */
+
+    uint8_t rom[] = {0x00, 0xff, 0xa3, 0x00, 0x61, 0x78, 0x62, 0x02, 0xd1, 0x20, 0x00, 0xc4,
+                     0x00, 0xfb, 0x00, 0xfc, 0x63, 0x05, 0xf3, 0x30, 0xf3, 0x75, 0x63, 0x00,
+                     0xf3, 0x85, 0xf2, 0x01, 0x64, 0x00, 0xd4, 0x41, 0x00, 0xfe, 0x00, 0xfd};
+    for (EngineKind kind = ENGINE_SWITCH; kind <= ENGINE_JIT; kind++)
+    {
+        // init
+        State chip8State = {.pc = ROM_OFFSET};
+        uint8_t memory[MEM_SIZE];
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        copySpritesToMemory(memory);
+        memset(memory + 0x300, 0xff, 32);
+        memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+        Engine engine;
+        initEngine(&engine, kind);
+
+        runEngine(&engine, &chip8State, memory, 5);
+        assert_true(chip8State.hires);
+        assert_int_equal(displayWidth(&chip8State), HIRES_WIDTH);
+        assert_int_equal(chip8State.registers[0xf], 0);
+        assert_int_equal(chip8State.pixels[0][2][1], 0xffull);
+        assert_int_equal(chip8State.pixels[0][17][0], 0xff00000000000000ull);
+        assert_int_equal(chip8State.pixels[0][18][0], 0x0);
+        assert_int_equal(getPixel(&chip8State, 127, 17), 0x1);
+
+        runEngine(&engine, &chip8State, memory, 1);
+        assert_int_equal(chip8State.pixels[0][5][1], 0x0);
+        assert_int_equal(chip8State.pixels[0][6][1], 0xffull);
+        assert_int_equal(chip8State.pixels[0][21][0], 0xff00000000000000ull);
+        runEngine(&engine, &chip8State, memory, 1);
+        assert_int_equal(chip8State.pixels[0][6][1], 0xfull);
+        assert_int_equal(chip8State.pixels[0][6][0], 0x0ff0000000000000ull);
+        runEngine(&engine, &chip8State, memory, 1);
+        assert_int_equal(chip8State.pixels[0][6][1], 0xf0ull);
+        assert_int_equal(chip8State.pixels[0][6][0], 0xff00000000000000ull);
+
+        runEngine(&engine, &chip8State, memory, 2);
+        assert_int_equal(chip8State.i, BIG_SPRITES_OFFSET + 50);
+        runEngine(&engine, &chip8State, memory, 3);
+        assert_int_equal(chip8State.registers[3], 5);
+        assert_int_equal(chip8State.flags[1], 120);
+
+        runEngine(&engine, &chip8State, memory, 3);
+        // the second plane only, the first is untouched
+        assert_int_equal(chip8State.registers[0xf], 0);
+        assert_int_equal(getPixel(&chip8State, 0, 0), 0x2);
+        assert_int_equal(getPixel(&chip8State, 0, 6), 0x1);
+        assert_int_equal(chip8State.pixels[1][0][0], 0xff00000000000000ull);
+
+        runEngine(&engine, &chip8State, memory, 1);
+        assert_false(chip8State.hires);
+        assert_int_equal(displayWidth(&chip8State), LORES_WIDTH);
+        assert_int_equal(getPixel(&chip8State, 0, 6), 0x0);
+        assert_int_equal(chip8State.pixels[1][0][0], 0x0);
+
+        // 00fd stays put
+        runEngine(&engine, &chip8State, memory, 10);
+        freeEngine(&engine);
+        assert_true(chip8State.quit);
+        assert_false(chip8State.halted);
+        assert_int_equal(chip8State.pc, 0x222);
+    }
+}
+
+static void test_hash_state(void **state)
+{
+    /*
+    No ROM needed: two VMs in the same state hash the same, and changing
+    a register, a pixel in either plane, the display mode, the rng or a byte
+    of memory changes the hash
+    */
+
+    State left, right;
+    memset(&left, 0x0, sizeof(State));
+    memset(&right, 0x0, sizeof(State));
+    left.pc = right.pc = ROM_OFFSET;
+    uint8_t leftMemory[MEM_SIZE], rightMemory[MEM_SIZE];
+    memset(leftMemory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    memset(rightMemory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    // transient flags aren't part of the hash
+    right.draw = true;
+    right.dirtyRows = ALL_ROWS_DIRTY;
+    uint64_t hash = hashState(&left, leftMemory);
+    assert_true(hash == hashState(&right, rightMemory));
+
+    right.registers[0xa] = 1;
+    assert_false(hash == hashState(&right, rightMemory));
+    right.registers[0xa] = 0;
+    right.pixels[0][3][0] = 1;
+    assert_false(hash == hashState(&right, rightMemory));
+    right.pixels[0][3][0] = 0;
+    right.pixels[1][63][1] = 1;
+    assert_false(hash == hashState(&right, rightMemory));
+    right.pixels[1][63][1] = 0;
+    right.hires = true;
+    assert_false(hash == hashState(&right, rightMemory));
+    right.hires = false;
+    right.rng[2] = 1;
+    assert_false(hash == hashState(&right, rightMemory));
+    right.rng[2] = 0;
+    rightMemory[0xfff] = 1;
+    assert_false(hash == hashState(&right, rightMemory));
+}
+
+static void test_save_state(void **state)
+{
+    /*
+    No ROM needed: a VM saved and loaded again comes back the same, apart
+    from the input and the redraw flags, and a damaged save is rejected
+    without touching the VM it's loaded into, as is one that's out of range
+    */
+
+    const char *fileName = "test_save_state.ch8s";
+    State saved;
+    memset(&saved, 0x0, sizeof(State));
+    uint8_t memory[MEM_SIZE];
+    for (int idx = 0; idx < MEM_SIZE; idx++)
+    {
+        memory[idx] = idx * 7;
+    }
+    for (int reg = 0; reg < 16; reg++)
+    {
+        saved.registers[reg] = 0xf0 | reg;
+    }
+    saved.i = 0x345;
+    saved.pc = 0x2a2;
+    saved.sp = 2;
+    saved.stack[0] = 0x204;
+    saved.stack[1] = 0x312;
+    saved.delay_timer = 0x12;
+    saved.sound_timer = 0x34;
+    seedRandom(&saved, 0xdeadbeef);
+    saved.pixels[0][0][0] = 0x8000000000000001ull;
+    saved.pixels[0][31][0] = 0x0123456789abcdefull;
+    saved.pixels[1][63][1] = 0xfedcba9876543210ull;
+    saved.hires = true;
+    saved.planes = 0x2;
+    saved.flags[7] = 0x42;
+    saved.keys = 1 << 3;
+    assert_true(saveState(fileName, &saved, memory));
+
+    State loaded;
+    memset(&loaded, 0xff, sizeof(State));
+    uint8_t loadedMemory[MEM_SIZE];
+    assert_true(loadState(fileName, &loaded, loadedMemory));
+    assert_memory_equal(memory, loadedMemory, MEM_SIZE);
+    assert_true(hashState(&saved, memory) == hashState(&loaded, loadedMemory));
+    assert_memory_equal(loaded.rng, saved.rng, sizeof(saved.rng));
+    assert_memory_equal(loaded.pixels, saved.pixels, sizeof(saved.pixels));
+    assert_true(loaded.hires);
+    assert_int_equal(loaded.planes, 0x2);
+    assert_int_equal(loaded.flags[7], 0x42);
+    assert_int_equal(loaded.keys, 0);
+    assert_false(loaded.halted);
+    assert_true(loaded.draw);
+    assert_int_equal(loaded.dirtyRows, ALL_ROWS_DIRTY);
+
+    // flip a bit of memory in the file
+    FILE *fp = fopen(fileName, "r+b");
+    fseek(fp, -1, SEEK_END);
+    fputc(memory[MEM_SIZE - 1] ^ 0x1, fp);
+    fclose(fp);
+    memset(&loaded, 0x0, sizeof(State));
+    assert_false(loadState(fileName, &loaded, loadedMemory));
+    assert_int_equal(loaded.pc, 0x0);
+    assert_false(loadState("no_such_save.ch8s", &loaded, loadedMemory));
+
+    // a save with a good checksum but a stack pointer or pc nothing could reach
+    saved.sp = 200;
+    assert_true(saveState(fileName, &saved, memory));
+    assert_false(loadState(fileName, &loaded, loadedMemory));
+    assert_int_equal(loaded.pc, 0x0);
+    saved.sp = 2;
+    saved.pc = MEM_SIZE - 1;
+    assert_true(saveState(fileName, &saved, memory));
+    assert_false(loadState(fileName, &loaded, loadedMemory));
+    remove(fileName);
+}
+
+static void test_rewind(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0xa300 # point I at 0x300
+        0x0202 0x7001 # add 1 to r0
+        0x0204 0xf033 # BCD of r0 to 0x300
+        0x0206 0xd015 # draw 5 rows from I at (r0, r1)
+        0x0208 0x1202 # jump back to 0x202
+
+    Stepping back returns every frame in reverse, memory and display
+    included, until the history runs out. A history too small for all the
+    frames keeps the newest ones: the second run has the smallest arena
+    with thousands of bytes rewritten every frame, so the arena wraps and
+    the oldest snapshots give way, and the third keeps fewer frames than a
+    keyframe interval so the keyframe of the open group is dropped
+    */
+
+    uint8_t rom[] = {0xa3, 0x00, 0x70, 0x01, 0xf0, 0x33, 0xd0, 0x15, 0x12, 0x02};
+    enum { NUM_FRAMES = 400 };
+    static State frames[NUM_FRAMES];
+    static uint8_t frameMemory[NUM_FRAMES][MEM_SIZE];
+    size_t capacities[] = {1 << 20, REWIND_MIN_CAPACITY, 1 << 20};
+    size_t maxFrames[] = {NUM_FRAMES, NUM_FRAMES, REWIND_KEYFRAME_INTERVAL / 2};
+    Rewind rewind;
+    // too small for a keyframe interval
+    assert_false(initRewind(&rewind, REWIND_MAX_ENCODED, NUM_FRAMES));
+    for (int run = 0; run < 3; run++)
+    {
+        State chip8State;
+        memset(&chip8State, 0x0, sizeof(State));
+        chip8State.pc = ROM_OFFSET;
+        uint8_t memory[MEM_SIZE];
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+        assert_true(initRewind(&rewind, capacities[run], maxFrames[run]));
+        Engine engine;
+        initEngine(&engine, ENGINE_SWITCH);
+        uint32_t seed = 1;
+        for (int frame = 0; frame < NUM_FRAMES; frame++)
+        {
+            runEngine(&engine, &chip8State, memory, 8);
+            tickTimers(&chip8State);
+            for (int idx = 0; run == 1 && idx < 2000; idx++)
+            {
+                seed = seed * 1103515245 + 12345;
+                memory[0x400 + (seed >> 8) % 0xc00] = seed >> 24;
+            }
+            pushRewind(&rewind, &chip8State, memory);
+            memcpy(&frames[frame], &chip8State, sizeof(State));
+            memcpy(frameMemory[frame], memory, MEM_SIZE);
+        }
+        freeEngine(&engine);
+        if (run == 0)
+            assert_int_equal(rewind.count, NUM_FRAMES);
+        else
+            assert_true(rewind.count > 0 && rewind.count < NUM_FRAMES && rewind.count <= maxFrames[run]);
+
+        int restored = 0;
+        chip8State.keys = 1 << 5;
+        while (stepBackRewind(&rewind, &chip8State, memory))
+        {
+            State *expected = &frames[NUM_FRAMES - 1 - restored];
+            // the live keys are kept, and the whole screen redrawn
+            expected->keys = 1 << 5;
+            expected->draw = true;
+            expected->dirtyRows = ALL_ROWS_DIRTY;
+            assert_memory_equal(expected, &chip8State, sizeof(State));
+            assert_memory_equal(frameMemory[NUM_FRAMES - 1 - restored], memory, MEM_SIZE);
+            restored++;
+        }
+        assert_true(run == 0 ? restored == NUM_FRAMES : restored < NUM_FRAMES);
+        freeRewind(&rewind);
+    }
+}
+
+static void test_upscale(void **state)
+{
+    /*
+    No ROM needed: every pixel of the scaled up screen has the palette colour
+    of the planes set in the display pixel it came from, in both modes, at
+    scales on either side of the vector width, and only the rows asked for
+    are written
+    */
+
+    const uint32_t palette[4] = {0x000000ff, 0xffffffff, 0x5599ddff, 0xaaaaaaff}, untouched = 0x12345678;
+    const int scales[] = {1, 2, 3, 4, 5, 7, 8, 9, 16};
+    for (int hires = 0; hires <= 1; hires++)
+    {
+        State display;
+        memset(&display, 0x0, sizeof(State));
+        display.hires = hires;
+        uint64_t seed = 0x2545f4914f6cdd1d;
+        for (int y = 0; y < HIRES_HEIGHT; y++)
+        {
+            for (int word = 0; word < DISPLAY_WORDS; word++)
+            {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                display.pixels[0][y][word] = seed;
+                // the second plane is only set on some rows, which takes the one plane path on the others
+                display.pixels[1][y][word] = y % 3 ? seed * 31 : 0;
+            }
+        }
+        // the edges are where an off by one would show
+        display.pixels[0][0][0] = 0x8000000000000001;
+        display.pixels[0][1][0] = ~0ull;
+
+        int height = displayHeight(&display);
+        for (size_t idx = 0; idx < sizeof(scales) / sizeof(scales[0]); idx++)
+        {
+            int scale = scales[idx];
+            int width = displayWidth(&display) * scale;
+            size_t size = (size_t)width * height * scale;
+            uint32_t *out = malloc(size * sizeof(uint32_t));
+            for (size_t pixel = 0; pixel < size; pixel++)
+            {
+                out[pixel] = untouched;
+            }
+            upscaleRows(&display, 0, 2, scale, palette, out);
+            upscaleRows(&display, 5, height - 5, scale, palette, out);
+            for (int y = 0; y < height * scale; y++)
+            {
+                int row = y / scale;
+                for (int x = 0; x < width; x++)
+                {
+                    uint32_t expected = (row >= 2 && row < 5) ? untouched : palette[getPixel(&display, x / scale, row)];
+                    assert_int_equal(out[y * width + x], expected);
+                }
+            }
+            free(out);
+        }
+    }
+}
+
+static void test_trace(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6005 # set r0 to 5
+        0x0202 0x8004 # add r0 to itself
+        0x0204 0xa300 # point I at 0x300
+        0x0206 0x0000 # unknown, halts
+
+    Each instruction is recorded after it runs, the unknown one included,
+    with the pc, opcode, I, vx and vf in little endian after the header
+    */
+
+    uint8_t rom[] = {0x60, 0x05, 0x80, 0x04, 0xa3, 0x00};
+    const char *fileName = "test_trace.ch8t";
+    State chip8State;
+    memset(&chip8State, 0x0, sizeof(State));
+    chip8State.pc = ROM_OFFSET;
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+    Engine engine;
+    initEngine(&engine, ENGINE_THREADED);
+    engine.trace = openTrace(fileName, 0);
+    assert_non_null(engine.trace);
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 10), 3);
+    assert_true(chip8State.halted);
+    assert_true(closeTrace(engine.trace));
+    freeEngine(&engine);
+
+    uint8_t expected[] = {
+        'C', 'H', '8', 'T', 0x01, 0x00, 0x08, 0x00,
+        0x00, 0x02, 0x05, 0x60, 0x00, 0x00, 0x05, 0x00,
+        0x02, 0x02, 0x04, 0x80, 0x00, 0x00, 0x0a, 0x00,
+        0x04, 0x02, 0x00, 0xa3, 0x00, 0x03, 0x00, 0x00,
+        0x06, 0x02, 0x00, 0x00, 0x00, 0x03, 0x0a, 0x00,
+    };
+    uint8_t actual[sizeof(expected) + 1];
+    FILE *fp = fopen(fileName, "rb");
+    assert_non_null(fp);
+    assert_int_equal(fread(actual, 1, sizeof(actual), fp), sizeof(expected));
+    fclose(fp);
+    remove(fileName);
+    assert_memory_equal(expected, actual, sizeof(expected));
+}
+
+static void test_debugger(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6005 # set r0 to 0x5
+        0x0202 0xa300 # set i to 0x300
+        0x0204 0x7001 # add 0x1 to r0
+        0x0206 0xf033 # store the BCD of r0 at i
+        0x0208 0x4008 # skip the next instruction if r0 isn't 0x8
+        0x020a 0x0000 # unknown, reached once r0 is 0x8
+        0x020c 0x1204 # jump to 0x204
+
+    Each thing the debugger can stop on is armed in turn
+    */
+
+    State chip8State = {.pc = ROM_OFFSET};
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    uint8_t rom[] = {0x60, 0x05, 0xa3, 0x00, 0x70, 0x01, 0xf0, 0x33, 0x40, 0x08, 0x00, 0x00, 0x12, 0x04};
+    memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+    Engine engine;
+    initEngine(&engine, ENGINE_CACHED);
+    static Debugger debugger;
+    initDebugger(&debugger);
+    engine.debugger = &debugger;
+
+    debugger.watchI = true;
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 2);
+    assert_int_equal(debugger.stopped, DEBUG_WATCH_I);
+    assert_int_equal(chip8State.i, 0x300);
+    debugger.watchI = false;
+
+    // the first time round it runs the instruction we stopped at
+    debugger.breakpoints[0x204] = true;
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 4);
+    assert_int_equal(debugger.stopped, DEBUG_BREAKPOINT);
+    assert_int_equal(chip8State.pc, 0x204);
+    assert_int_equal(chip8State.registers[0], 0x6);
+    debugger.breakpoints[0x204] = false;
+
+    debugger.steps = 1;
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 1);
+    assert_int_equal(debugger.stopped, DEBUG_STEP);
+    assert_int_equal(chip8State.pc, 0x206);
+
+    debugger.watched[0x302] = true;
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 1);
+    assert_int_equal(debugger.stopped, DEBUG_WATCH_MEMORY);
+    assert_int_equal(debugger.where, 0x302);
+    assert_int_equal(memory[0x302], 0x7);
+    debugger.watched[0x302] = false;
+
+    // nothing armed, the budget runs out
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 1), 1);
+    assert_int_equal(debugger.stopped, DEBUG_RUNNING);
+
+    assert_true(addDebugCondition(&debugger, &chip8State, 0x0, DEBUG_EQUAL, 0x8));
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 2);
+    assert_int_equal(debugger.stopped, DEBUG_CONDITION);
+    assert_int_equal(debugger.where, 0);
+    assert_int_equal(chip8State.pc, 0x206);
+
+    // where we'd otherwise just halt
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 2);
+    assert_int_equal(debugger.stopped, DEBUG_HALTED);
+    assert_true(chip8State.halted);
+    assert_int_equal(chip8State.pc, 0x20a);
+    assert_int_equal(memory[0x302], 0x8);
+
+    // a pc past the end of memory (from BNNN) stops on the breakpoint it wraps to
+    chip8State.halted = false;
+    chip8State.pc = 0x1204;
+    debugger.breakpoints[0x204] = true;
+    assert_int_equal(runEngine(&engine, &chip8State, memory, 100), 0);
+    assert_int_equal(debugger.stopped, DEBUG_BREAKPOINT);
+    assert_int_equal(chip8State.pc, 0x1204);
+    freeEngine(&engine);
+
+    char text[32];
+    disassembleOp(text, sizeof(text), 0x8124);
+    assert_string_equal(text, "add  v1, v2");
+    disassembleOp(text, sizeof(text), 0xf033);
+    assert_string_equal(text, "ld   b, v0");
+    disassembleOp(text, sizeof(text), 0x0000);
+    assert_string_equal(text, "unknown");
+}
+
+static void test_cycles_in_frame(void **state)
+{
+    /*
+    No ROM needed: frames share out the clock speed between them, so a
+    second's worth runs every cycle even when it doesn't divide by 60
+    */
+
+    uint32_t clockSpeeds[] = {60, 500, 700, 1000, 12345};
+    for (int idx = 0; idx < 5; idx++)
+    {
+        uint64_t total = 0;
+        for (uint64_t frame = 0; frame < 600; frame++)
+        {
+            uint32_t cycles = cyclesInFrame(clockSpeeds[idx], frame);
+            assert_true(cycles == clockSpeeds[idx] / 60 || cycles == clockSpeeds[idx] / 60 + 1);
+            total += cycles;
+            if (frame % 60 == 59)
+                assert_true(total == (frame + 1) / 60 * clockSpeeds[idx]);
+        }
+    }
+}
+
+#ifdef CHIP8_PROFILE
+static void test_profile(void **state)
+{
+    /*
+    The test ROM will look like this:
+        0x0200 0x6005 # set r0 to 5
+        0x0202 0x7001 # add 1 to r0
+        0x0204 0x1202 # jump back to 0x202
+        0x0206 0x0000 # never reached
+
+    Every engine counts the same instructions at the same addresses, with
+    a frame at every tickTimers
+    */
+
+    uint8_t rom[] = {0x60, 0x05, 0x70, 0x01, 0x12, 0x02};
+    EngineKind kinds[] = {ENGINE_SWITCH, ENGINE_CACHED, ENGINE_THREADED, ENGINE_JIT};
+    for (int k = 0; k < 4; k++)
+    {
+        State chip8State;
+        memset(&chip8State, 0x0, sizeof(State));
+        chip8State.pc = ROM_OFFSET;
+        uint8_t memory[MEM_SIZE];
+        memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+        memcpy(memory + ROM_OFFSET, rom, sizeof(rom));
+        Engine engine;
+        initEngine(&engine, kinds[k]);
+        resetProfile();
+        for (int frame = 0; frame < 10; frame++)
+        {
+            runEngine(&engine, &chip8State, memory, 9);
+            tickTimers(&chip8State);
+        }
+        freeEngine(&engine);
+        assert_int_equal(profile.instructions, 90);
+        assert_int_equal(profile.opCodes[0x6005], 1);
+        assert_int_equal(profile.opCodes[0x7001], 45);
+        assert_int_equal(profile.opCodes[0x1202], 44);
+        assert_int_equal(profile.pcs[0x200], 1);
+        assert_int_equal(profile.pcs[0x202], 45);
+        assert_int_equal(profile.pcs[0x204], 44);
+        assert_int_equal(profile.frames, 10);
+        assert_int_equal(profile.minFrame, 9);
+        assert_int_equal(profile.maxFrame, 9);
+        // 9 instructions a frame lands in the 8-15 bucket
+        assert_int_equal(profile.frameBuckets[3], 10);
+    }
+
+    // the unknown opcode that halts isn't counted
+    State chip8State;
+    memset(&chip8State, 0x0, sizeof(State));
+    chip8State.pc = 0x206;
+    uint8_t memory[MEM_SIZE];
+    memset(memory, 0x0, MEM_SIZE * sizeof(uint8_t));
+    resetProfile();
+    processOp(&chip8State, memory);
+    assert_true(chip8State.halted);
+    assert_int_equal(profile.instructions, 0);
+}
+#endif
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -609,7 +2081,34 @@ int main(void)
         cmocka_unit_test(test_rand),
         cmocka_unit_test(test_set_sprite),
         cmocka_unit_test(test_draw_sprite),
+        cmocka_unit_test(test_draw_sprite_wraps),
+        cmocka_unit_test(test_dirty_rows),
+        cmocka_unit_test(test_unknown_opcode),
+        cmocka_unit_test(test_schip),
+        cmocka_unit_test(test_hash_state),
+        cmocka_unit_test(test_save_state),
+        cmocka_unit_test(test_rewind),
+        cmocka_unit_test(test_upscale),
+        cmocka_unit_test(test_trace),
+        cmocka_unit_test(test_debugger),
+        cmocka_unit_test(test_cycles_in_frame),
         cmocka_unit_test(test_bcd),
+        cmocka_unit_test(test_decode_cache),
+        cmocka_unit_test(test_decode_cache_invalidation),
+        cmocka_unit_test(test_fused_ops),
+        cmocka_unit_test(test_engines_agree),
+        cmocka_unit_test(test_pc_wraps),
+        cmocka_unit_test(test_idle_loops),
+        cmocka_unit_test(test_parse_engine),
+        cmocka_unit_test(test_jit_random_programs),
+        cmocka_unit_test(test_jit_subtract_edge_cases),
+        cmocka_unit_test(test_jit_invalidation),
+        cmocka_unit_test(test_aot),
+        cmocka_unit_test(test_lockstep_random_programs),
+        cmocka_unit_test(test_lockstep_calls),
+#ifdef CHIP8_PROFILE
+        cmocka_unit_test(test_profile),
+#endif
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);